@@ -0,0 +1,75 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <time.h>
+
+static size_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+    ++allocations;
+    return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+    ++allocations;
+    return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+    ++allocations;
+    return __real_realloc(ptr, size);
+}
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+bench_start(struct bench *bench)
+{
+    bench->start_allocations = allocations;
+    bench->start_nsec        = now_nsec();
+}
+
+void
+bench_stop(
+    struct bench *bench,
+    const char *name,
+    size_t iterations,
+    size_t bytes)
+{
+    double nsec = now_nsec() - bench->start_nsec;
+    double allocs_per_op =
+        (double)(allocations - bench->start_allocations) / iterations;
+
+    printf(
+        "%-40s %12.1f ns/op %8.2f allocs/op",
+        name,
+        nsec / iterations,
+        allocs_per_op);
+    if (bytes > 0) {
+        printf(" %8.3f ns/byte", nsec / bytes);
+    }
+    printf("\n");
+}
@@ -0,0 +1,35 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_BENCH_H
+#define KIWMI_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Small helpers shared by the benchmarks, run with `meson test --benchmark`.
+ * Calls to malloc(), calloc() and realloc() from the benchmark's own objects
+ * are counted through the linker's --wrap, so allocations in kiwmi code that
+ * is compiled into it show up, while the ones in Lua or wlroots don't.
+ */
+
+struct bench {
+    uint64_t start_nsec;
+    size_t start_allocations;
+};
+
+void bench_start(struct bench *bench);
+// Prints the time and allocations per iteration, and the time per byte if
+// `bytes` (summed over all iterations) isn't 0
+void bench_stop(
+    struct bench *bench,
+    const char *name,
+    size_t iterations,
+    size_t bytes);
+
+#endif /* KIWMI_BENCH_H */
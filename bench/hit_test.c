@@ -0,0 +1,112 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// Hit-testing pointer motion over 200 stacked views, the lookup
+// cursor_refresh_focus() does for every motion event, with and without the
+// hit cache in front of wlr_scene_node_at().
+
+#include <stdio.h>
+#include <wayland-server.h>
+#include <wlr/interfaces/wlr_buffer.h>
+#include <wlr/types/wlr_scene.h>
+
+#include "bench.h"
+#include "desktop/desktop.h"
+#include "desktop/hit_cache.h"
+
+#define VIEWS 200
+#define VIEW_WIDTH 800
+#define VIEW_HEIGHT 600
+#define EVENTS 100000
+
+static void
+view_buffer_destroy(struct wlr_buffer *UNUSED(buffer))
+{
+    // static, see main()
+}
+
+static const struct wlr_buffer_impl view_buffer_impl = {
+    .destroy = view_buffer_destroy,
+};
+
+// The n-th point of a pointer moving one pixel at a time, either wiggling
+// inside the top view or sweeping across all of them
+static void
+motion_point(size_t n, bool sweep, double *lx, double *ly)
+{
+    if (sweep) {
+        *lx = n % (VIEWS * 5 + VIEW_WIDTH);
+        *ly = (n / 4) % (VIEWS * 3 + VIEW_HEIGHT);
+    } else {
+        *lx = (VIEWS - 1) * 5 + 100 + n % 400;
+        *ly = (VIEWS - 1) * 3 + 100 + (n / 400) % 300;
+    }
+}
+
+static void
+bench_motion(struct kiwmi_desktop *desktop, bool sweep, bool cached)
+{
+    struct wlr_scene_node *root = &desktop->scene->tree.node;
+    size_t hits                 = 0;
+
+    struct bench bench;
+    bench_start(&bench);
+    for (size_t i = 0; i < EVENTS; ++i) {
+        double lx, ly, sx, sy;
+        motion_point(i, sweep, &lx, &ly);
+
+        struct wlr_scene_node *node =
+            cached ? hit_cache_node_at(desktop, lx, ly, &sx, &sy)
+                   : wlr_scene_node_at(root, lx, ly, &sx, &sy);
+        hits += node != NULL;
+    }
+
+    char name[64];
+    snprintf(
+        name,
+        sizeof(name),
+        "%s, %s",
+        sweep ? "motion across views" : "motion in the top view",
+        cached ? "hit cache" : "scene walk");
+    bench_stop(&bench, name, EVENTS, 0);
+
+    if (hits == 0) {
+        fprintf(stderr, "nothing under the pointer\n");
+    }
+}
+
+int
+main(void)
+{
+    struct kiwmi_desktop desktop = {
+        .scene = wlr_scene_create(),
+    };
+    hit_cache_init(&desktop.hit_cache);
+
+    static struct wlr_buffer buffer;
+    wlr_buffer_init(&buffer, &view_buffer_impl, VIEW_WIDTH, VIEW_HEIGHT);
+
+    // cascaded, each view mostly covers the ones below
+    for (int i = 0; i < VIEWS; ++i) {
+        struct wlr_scene_tree *tree =
+            wlr_scene_tree_create(&desktop.scene->tree);
+        wlr_scene_node_set_position(&tree->node, i * 5, i * 3);
+
+        struct wlr_scene_buffer *surface =
+            wlr_scene_buffer_create(tree, &buffer);
+        wlr_scene_buffer_set_dest_size(surface, VIEW_WIDTH, VIEW_HEIGHT);
+    }
+
+    for (int sweep = 0; sweep < 2; ++sweep) {
+        bench_motion(&desktop, sweep, false);
+        bench_motion(&desktop, sweep, true);
+    }
+
+    hit_cache_fini(&desktop.hit_cache);
+    wlr_scene_node_destroy(&desktop.scene->tree.node);
+    return 0;
+}
@@ -0,0 +1,92 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// 1000 text labels, like per-view titles and debug text, with only a few
+// distinct strings among them. They are put on an output so they rasterize.
+
+#include <pango/pango-font.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+
+#include "bench.h"
+#include "text_buffer.h"
+
+#define LABELS 1000
+#define DISTINCT_TEXTS 20
+
+static int
+compare_pointers(const void *a, const void *b)
+{
+    const void *pa = *(const void *const *)a;
+    const void *pb = *(const void *const *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+int
+main(void)
+{
+    struct wlr_scene *scene = wlr_scene_create();
+    PangoFontDescription *font =
+        pango_font_description_from_string("sans 11");
+    const float color[4] = {1, 1, 1, 1};
+
+    // text nodes only look at the scale, the subpixel order and the commit
+    // signal of the outputs they are on
+    struct wlr_output output = {
+        .scale    = 1,
+        .subpixel = WL_OUTPUT_SUBPIXEL_NONE,
+    };
+    wl_signal_init(&output.events.commit);
+    struct wlr_scene_output scene_output = {
+        .output = &output,
+    };
+
+    struct wlr_scene_buffer *nodes[LABELS];
+
+    struct bench bench;
+    bench_start(&bench);
+    for (size_t i = 0; i < LABELS; ++i) {
+        char text[32];
+        snprintf(text, sizeof(text), "view %zu", i % DISTINCT_TEXTS);
+
+        struct text_node *label =
+            text_node_create(&scene->tree, font, text, color, false);
+        if (!label) {
+            fprintf(stderr, "failed to create label\n");
+            return 1;
+        }
+
+        nodes[i] = wlr_scene_buffer_from_node(label->node);
+        wl_signal_emit(&nodes[i]->events.output_enter, &scene_output);
+    }
+    bench_stop(&bench, "text_node_create on an output", LABELS, 0);
+
+    struct wlr_buffer *buffers[LABELS];
+    for (size_t i = 0; i < LABELS; ++i) {
+        buffers[i] = nodes[i]->buffer;
+    }
+    qsort(buffers, LABELS, sizeof(buffers[0]), compare_pointers);
+
+    size_t distinct = 0;
+    for (size_t i = 0; i < LABELS; ++i) {
+        if (buffers[i] && (i == 0 || buffers[i] != buffers[i - 1])) {
+            ++distinct;
+        }
+    }
+    printf(
+        "%d labels with %d texts share %zu buffers\n",
+        LABELS,
+        DISTINCT_TEXTS,
+        distinct);
+
+    wlr_scene_node_destroy(&scene->tree.node);
+    pango_font_description_free(font);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// text_node_set_text() throughput, like a status label that changes all the
+// time. Off any output a text is only measured, on one it is rasterized too.
+
+#include <pango/pango-font.h>
+#include <stdio.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_output.h>
+#include <wlr/types/wlr_scene.h>
+
+#include "bench.h"
+#include "text_buffer.h"
+
+#define ITERATIONS 5000
+
+static void
+bench_set_text(struct text_node *label, const char *name)
+{
+    struct bench bench;
+    bench_start(&bench);
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        char text[64];
+        int len = snprintf(text, sizeof(text), "cpu %zu%% | 12:%02zu", i, i);
+        text_node_set_text(label, text, len);
+    }
+    bench_stop(&bench, name, ITERATIONS, 0);
+}
+
+int
+main(void)
+{
+    struct wlr_scene *scene = wlr_scene_create();
+    PangoFontDescription *font =
+        pango_font_description_from_string("sans 11");
+    const float color[4] = {1, 1, 1, 1};
+
+    struct text_node *label =
+        text_node_create(&scene->tree, font, "", color, false);
+    if (!label) {
+        fprintf(stderr, "failed to create label\n");
+        return 1;
+    }
+
+    bench_set_text(label, "text_node_set_text measuring");
+
+    // text nodes only look at the scale, the subpixel order and the commit
+    // signal of the outputs they are on
+    struct wlr_output output = {
+        .scale    = 1,
+        .subpixel = WL_OUTPUT_SUBPIXEL_NONE,
+    };
+    wl_signal_init(&output.events.commit);
+    struct wlr_scene_output scene_output = {
+        .output = &output,
+    };
+    wl_signal_emit(
+        &wlr_scene_buffer_from_node(label->node)->events.output_enter,
+        &scene_output);
+
+    bench_set_text(label, "text_node_set_text rendering");
+
+    wlr_scene_node_destroy(&scene->tree.node);
+    pango_font_description_free(font);
+    return 0;
+}
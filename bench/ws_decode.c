@@ -0,0 +1,105 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// Parsing of a 1 MB set_layout_state message, fed to the json parser in the
+// pieces cb_main() gets from lws. The parser is static, so it is built in.
+#include "../kiwmi/websocket.c"
+
+#include <lualib.h>
+
+#include "bench.h"
+
+#define ITERATIONS 20
+#define MESSAGE_BYTES (1024 * 1024)
+
+// Shaped like what the browser gui sends, with `n` views
+static const char set_layout_state[] =
+    "local n = ...\n"
+    "local workspaces, views = {}, {}\n"
+    "for i = 1, n do\n"
+    "    views[tostring(i)] = { tags = { 'term', 'dev' } }\n"
+    "end\n"
+    "for i = 1, n / 50 do\n"
+    "    local ids = {}\n"
+    "    for j = 1, 50 do ids[j] = tostring((i - 1) * 50 + j) end\n"
+    "    workspaces[i] = { id = i, top_k = -1, views = ids }\n"
+    "end\n"
+    "return {\n"
+    "    kind = 'set_layout_state',\n"
+    "    state = {\n"
+    "        workspaces = workspaces,\n"
+    "        outputs = { { name = 'DP-1', max_views = 2 } },\n"
+    "        views = views,\n"
+    "    },\n"
+    "}\n";
+
+// Encodes set_layout_state with more views until it is at least
+// MESSAGE_BYTES long
+static struct send_msg *
+make_message(lua_State *L, struct ws_arena *arena)
+{
+    for (int views = 1000;; views *= 2) {
+        if (luaL_loadstring(L, set_layout_state)) {
+            return NULL;
+        }
+        lua_pushinteger(L, views);
+        lua_call(L, 1, 1);
+
+        arena->head = arena->len;
+        size_t offset = arena_push_value(arena, L, -1, WS_FORMAT_JSON);
+        lua_pop(L, 1);
+
+        struct send_msg *msg = (struct send_msg *)(arena->data + offset);
+        if (msg->len >= MESSAGE_BYTES) {
+            return msg;
+        }
+    }
+}
+
+int
+main(void)
+{
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+
+    struct ws_arena arena = {0};
+    struct send_msg *msg  = make_message(L, &arena);
+    if (!msg) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+    unsigned char *payload = send_msg_payload(msg);
+
+    struct json_parse jp;
+    jp.T          = lua_newthread(L);
+    jp.thread_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    struct bench bench;
+    bench_start(&bench);
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        json_parse_reset(&jp);
+        for (size_t pos = 0; pos < msg->len; pos += RX_BUFFER_BYTES) {
+            size_t len = msg->len - pos;
+            if (len > RX_BUFFER_BYTES) {
+                len = RX_BUFFER_BYTES;
+            }
+            lejp_parse(&jp.lejp_ctx, payload + pos, len);
+        }
+
+        if (jp.rejected || !jp.done) {
+            fprintf(stderr, "set_layout_state did not parse\n");
+            return 1;
+        }
+    }
+    bench_stop(&bench, "recv set_layout_state json", ITERATIONS, msg->len);
+
+    json_parse_reset(&jp);
+    luaL_unref(L, LUA_REGISTRYINDEX, jp.thread_ref);
+    free(arena.data);
+    lua_close(L);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+// Encoding of the layout_state message kiwmi:ws_send() gets from the contrib
+// config, with 500 views. The encoder is static, so it is built in here.
+#include "../kiwmi/websocket.c"
+
+#include <lualib.h>
+
+#include "bench.h"
+
+#define ITERATIONS 2000
+
+// Shaped like Manager:export_layout_state()
+static const char layout_state[] =
+    "local workspaces, views, titles = {}, {}, {}\n"
+    "for i = 1, 500 do\n"
+    "    views[tostring(i)] = { tags = { 'term', 'dev' } }\n"
+    "    titles[tostring(i)] = { title = 'view ' .. i .. ' - ~/src/kiwmi' }\n"
+    "end\n"
+    "for i = 1, 10 do\n"
+    "    local ids = {}\n"
+    "    for j = 1, 50 do ids[j] = tostring((i - 1) * 50 + j) end\n"
+    "    workspaces[i] = { id = i, top_k = -1, views = ids }\n"
+    "end\n"
+    "return {\n"
+    "    kind = 'layout_state',\n"
+    "    data = {\n"
+    "        state = {\n"
+    "            workspaces = workspaces,\n"
+    "            outputs = { { name = 'DP-1', max_views = 2 } },\n"
+    "            views = views,\n"
+    "        },\n"
+    "        aux = { views = titles },\n"
+    "    },\n"
+    "}\n";
+
+static void
+bench_format(lua_State *L, int idx, enum ws_format format, const char *name)
+{
+    struct ws_arena arena = {0};
+
+    // the arena sizes itself after the previous message
+    arena_push_value(&arena, L, idx, format);
+    arena.head = arena.len;
+
+    size_t bytes = 0;
+    struct bench bench;
+    bench_start(&bench);
+    for (size_t i = 0; i < ITERATIONS; ++i) {
+        size_t offset = arena_push_value(&arena, L, idx, format);
+        bytes += ((struct send_msg *)(arena.data + offset))->len;
+
+        // sent, the next message starts over at the front
+        arena.head = arena.len;
+    }
+    bench_stop(&bench, name, ITERATIONS, bytes);
+
+    free(arena.data);
+}
+
+int
+main(void)
+{
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    if (luaL_dostring(L, layout_state)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return 1;
+    }
+
+    bench_format(L, -1, WS_FORMAT_JSON, "ws_send layout_state json");
+    bench_format(L, -1, WS_FORMAT_MSGPACK, "ws_send layout_state msgpack");
+
+    lua_close(L);
+    return 0;
+}
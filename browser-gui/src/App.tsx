@@ -7,6 +7,7 @@ import {
 } from 'react-beautiful-dnd'
 import { NumberSelector } from './components/NumberSelector'
 import _ from 'lodash'
+import { applyPatch } from './model'
 import type { State } from './model'
 import { NewWorkspace, Workspace } from './components/Workspace'
 
@@ -29,21 +30,44 @@ const App = () => {
   })
 
   const [ws, setWs] = useState(() => {
-    const ws = new WebSocket('ws://localhost:8000', 'main')
+    const ws = new WebSocket('ws://localhost:8000/?diff=1', 'main')
+
+    const onLayoutState = (state: State) => {
+      console.log('recv state:', state)
+
+      // HACK: empty tables from lua get serialized as arrays, fix it
+      for (const key of Object.keys(state.state.views)) {
+        if (Array.isArray(state.state.views[key].tags)) {
+          state.state.views[key].tags = {}
+        }
+      }
+
+      setState(state)
+    }
+
+    // The last layout_state message of the diff stream, patches apply to it
+    let layout: any = undefined
+    let seq = 0
+
     ws.onmessage = (ev) => {
       const data = JSON.parse(ev.data)
-      if (data.kind == 'layout_state') {
-        console.log('recv state:', data.data)
-
-        // HACK: empty tables from lua get serialized as arrays, fix it
-        const state: State = data.data
-        for (const key of Object.keys(state.state.views)) {
-          if (Array.isArray(state.state.views[key].tags)) {
-            state.state.views[key].tags = {}
-          }
+      if (data.kind == 'snapshot' && data.stream == 'layout_state') {
+        layout = data.msg
+        seq = data.seq
+        onLayoutState(_.cloneDeep(layout.data))
+      } else if (data.kind == 'patch' && data.stream == 'layout_state') {
+        if (layout === undefined) return // waiting for a snapshot
+        if (data.seq !== seq + 1) {
+          // missed something, start over from a snapshot
+          layout = undefined
+          ws.send(JSON.stringify({ kind: 'resync' }))
+          return
         }
-
-        setState(data.data)
+        layout = applyPatch(layout, data.ops)
+        seq = data.seq
+        onLayoutState(_.cloneDeep(layout.data))
+      } else if (data.kind == 'layout_state') {
+        onLayoutState(data.data)
       }
     }
     return ws
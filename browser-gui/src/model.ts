@@ -23,3 +23,38 @@ export type State = {
     views: Record<string, ViewAux>
   }
 }
+
+// One operation of a `patch` message, see kiwmi/websocket.c
+export type PatchOp =
+  | { op: 'add' | 'replace'; path: string; value: unknown }
+  | { op: 'remove'; path: string }
+
+// Applies the ops to `doc` in place. Returns the result, which is only a
+// different object if the root itself got replaced.
+export const applyPatch = (doc: any, ops: PatchOp[]): any => {
+  for (const op of ops) {
+    if (op.path === '') {
+      doc = op.op === 'remove' ? undefined : op.value
+      continue
+    }
+
+    const keys = op.path
+      .slice(1)
+      .split('/')
+      .map((key) => key.replace(/~1/g, '/').replace(/~0/g, '~'))
+    const last = keys.pop()!
+    const parent = keys.reduce((obj, key) => obj[key], doc)
+
+    if (Array.isArray(parent)) {
+      const idx = Number(last)
+      if (op.op === 'add') parent.splice(idx, 0, op.value)
+      else if (op.op === 'remove') parent.splice(idx, 1)
+      else parent[idx] = op.value
+    } else if (op.op === 'remove') {
+      delete parent[last]
+    } else {
+      parent[last] = op.value
+    }
+  }
+  return doc
+}
@@ -1,8 +1,3 @@
-local input_event_codes = {
-    KEY_1 = 2,
-    KEY_9 = 10
-}
-
 local keybinds = {
     Return = function(c) kiwmi:spawn("alacritty") end,
     q = function(c)
@@ -57,7 +52,6 @@ function Controller:_set_panel(visible)
     if not view_id then return end
 
     local view = self.manager.view_by_id[view_id]
-    local view_info = self.manager.view_info_by_id[view_id]
 
     if visible then
         local output = self.manager.output_by_name[self.manager.output_names_ordered[1]]
@@ -73,11 +67,7 @@ function Controller:_set_panel(visible)
         view:move(pos.x, pos.y)
         view:resize(size.x, size.y)
 
-        local border = view_info.border
-        border.left:set_size(0, 0)
-        border.right:set_size(0, 0)
-        border.top:set_size(0, 0)
-        border.bottom:set_size(0, 0)
+        view:set_border(false)
 
         view:show()
         view:focus()
@@ -86,37 +76,46 @@ function Controller:_set_panel(visible)
     end
 end
 
-function Controller:key_down(ev, mods)
-    local code = ev.keycode - 8
-
-    if ev.key == 'Super_L' or ev.key == 'Alt_R' then
-        self.show_panel = true
-        self:_set_panel(true)
-        return true
-    end
+function Controller:run_keybind(key)
+    local bind = keybinds[key]
+    if bind then bind(self) end
+end
 
-    if mods[self.mod_key] or mods.alt then
-        if mods.shift then
-            if input_event_codes.KEY_1 <= code and code <= input_event_codes.KEY_9 then
-                local num = code - input_event_codes.KEY_1 + 1
-                return self:handle_mod_shift_num(num)
-            end
+---Binds the keys natively, so that other keys don't enter Lua at all. The
+---bindings outlive reloads, so they go through get_controller().
+function Controller.bind_keys(keyboard, mod_key, get_controller)
+    for _, mod in ipairs({ mod_key, "alt" }) do
+        for key in pairs(keybinds) do
+            keyboard:bind({ mod }, key, function()
+                get_controller():run_keybind(key)
+            end)
         end
 
-        local bind = keybinds[ev.key]
-        if bind then
-            bind(self)
-            return true
+        -- by keycode (xkb KEY_1 is 10), the number row keysyms depend on the
+        -- layout
+        for num = 1, 9 do
+            keyboard:bind({ mod, "shift" }, num + 9, function()
+                get_controller():handle_mod_shift_num(num)
+            end)
         end
     end
 
-    return false
+    -- the panel shows for as long as the key is down
+    for _, key in ipairs({ "Super_L", "Alt_R" }) do
+        keyboard:tap(key, {
+            timeout = 0,
+            hold = function() get_controller():panel_hold() end,
+            release = function() get_controller():panel_release() end,
+        })
+    end
 end
 
-function Controller:key_up(ev, mods)
-    if ev.key == 'Super_L' or ev.key == 'Alt_R' then
-        self:_set_panel(false)
-        self.show_panel = false
-        return true
-    end
+function Controller:panel_hold()
+    self.show_panel = true
+    self:_set_panel(true)
+end
+
+function Controller:panel_release()
+    self:_set_panel(false)
+    self.show_panel = false
 end
@@ -29,7 +29,8 @@ local function reload()
     local new = {}
     new.manager = Manager()
     new.controller = Controller(new.manager, mod_key)
-    new.websocket_server = WebsocketServer(new.manager)
+    -- a nested instance must not take the port of the outer one
+    new.websocket_server = WebsocketServer(new.manager, { port = embed and 8001 or 8000, deflate = true })
 
     -- try to preserve the state (this can obviously be buggy, but some special
     -- cases can be added here)
@@ -49,17 +50,14 @@ local function reload()
 end
 
 local cursor = kiwmi:cursor()
-local function focus_at_cursor()
-    local view = cursor:view_at_pos()
 
-    if view then
-        manager:focus(view:id())
-    end
-end
-
-cursor:on("motion", function()
-    focus_at_cursor()
-end)
+kiwmi:focus_policy({
+    follow_mouse = true,
+    delay_ms = 50,
+    on_change = function(view)
+        manager.focused_view_id = view and view:id()
+    end,
+})
 
 cursor:on("button_up", function()
     kiwmi:stop_interactive()
@@ -109,23 +107,9 @@ local global_keyboard = nil
 
 kiwmi:on("keyboard", function(keyboard)
     global_keyboard = keyboard
-    keyboard:on("key_down", function(ev)
-        if not ev.raw then return end
-        local mods = ev.keyboard:modifiers()
 
-        if mods[mod_key] and ev.key == 'o' then
-            reload()
-            return true
-        end
-
-        return controller:key_down(ev, mods)
-    end)
-    keyboard:on("key_up", function(ev)
-        if not ev.raw then return end
-
-        local mods = ev.keyboard:modifiers()
-        return controller:key_up(ev, mods)
-    end)
+    keyboard:bind({ mod_key }, "o", reload)
+    Controller.bind_keys(keyboard, mod_key, function() return controller end)
 end)
 
 cursor:on("button_down", function(id)
@@ -95,16 +95,11 @@ function Manager:add_view(view, tags)
     }
     self.view_info_by_id[view_id] = view_info
 
-    -- set up scene nodes
-    local tree = view:scene_tree()
-    local color = config.theme.border_color
-    view_info.border = {
-        left = tree:add_rect(0, 0, color),
-        right = tree:add_rect(0, 0, color),
-        top = tree:add_rect(0, 0, color),
-        bottom = tree:add_rect(0, 0, color),
+    view:set_border {
+        width = 2,
+        color = config.theme.border_color,
+        focused_color = config.theme.focused_color,
     }
-    print(view_info.border.left, view_id)
 
     -- place into a workspace by default
     local ws_id = "def"
@@ -112,24 +107,6 @@ function Manager:add_view(view, tags)
 end
 
 function Manager:focus(view_id)
-    local view_info = self.view_info_by_id[view_id]
-
-    if self.focused_view_id then
-        local border = self.view_info_by_id[self.focused_view_id].border
-        local color = config.theme.border_color
-        border.left:set_color(color)
-        border.right:set_color(color)
-        border.top:set_color(color)
-        border.bottom:set_color(color)
-    end
-
-    local border = view_info.border
-    local color = config.theme.focused_color
-    border.left:set_color(color)
-    border.right:set_color(color)
-    border.top:set_color(color)
-    border.bottom:set_color(color)
-
     self.focused_view_id = view_id
 
     self.view_by_id[view_id]:focus()
@@ -373,6 +350,9 @@ function Manager:arrange_views()
         -- end
     end
 
+    -- applied in one go at the end, see kiwmi:apply_layout
+    local layout_entries = {}
+
     for i, name in ipairs(self.output_names_ordered) do
         local output = self.output_by_name[name]
         local view_ids = output_view_ids[i]
@@ -386,28 +366,17 @@ function Manager:arrange_views()
             local view_id = view_ids[view_i]
             view_i = view_i + 1
 
-            local view_info = self.view_info_by_id[view_id]
             local view = self.view_by_id[view_id]
-            view:move(pos.x, pos.y)
-            view:resize(size.x, size.y)
 
-            -- adjust border
-            local border = view_info.border
-            local th = 2
-
-            border.left:set_size(th, size.y)
-            border.left:set_position(-th, 0)
-
-            border.right:set_size(th, size.y)
-            border.right:set_position(size.x, 0)
-
-            border.top:set_size(size.x + 2 * th, th)
-            border.top:set_position(-th, -th)
-
-            border.bottom:set_size(size.x + 2 * th, th)
-            border.bottom:set_position(-th, size.y)
-
-            view:show()
+            layout_entries[#layout_entries + 1] = {
+                view = view,
+                x = pos.x,
+                y = pos.y,
+                w = size.x,
+                h = size.y,
+            }
         end
     end
+
+    kiwmi:apply_layout(layout_entries)
 end
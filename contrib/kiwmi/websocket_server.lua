@@ -1,18 +1,16 @@
 WebsocketServer = class()
 
-function WebsocketServer:ctor(manager)
+function WebsocketServer:ctor(manager, listen)
     self.clients = {}
     self.manager = manager
 
     manager.state_changed:subscribe(function()
-        local msg = {
+        if next(self.clients) == nil then return end
+
+        kiwmi:ws_broadcast({
             kind = "layout_state",
             data = self.manager:export_layout_state()
-        }
-
-        for client, _ in pairs(self.clients) do
-            kiwmi:ws_send(client, msg)
-        end
+        })
     end)
 
     local ws_handler = {}
@@ -45,4 +43,5 @@ function WebsocketServer:ctor(manager)
     end
 
     kiwmi:ws_register(ws_handler)
+    kiwmi:ws_listen(listen)
 end
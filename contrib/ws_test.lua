@@ -34,3 +34,4 @@ function ws_handler.close(client)
 end
 
 kiwmi:ws_register(ws_handler)
+kiwmi:ws_listen({ port = 8000 })
@@ -11,6 +11,7 @@
 #include <wayland-server.h>
 #include <wlr/types/wlr_scene.h>
 
+#include "desktop/hit_cache.h"
 #include "desktop/stratum.h"
 
 struct kiwmi_desktop {
@@ -27,9 +28,12 @@ struct kiwmi_desktop {
     struct wl_list outputs; // struct kiwmi_output::link
     struct wl_list views;   // struct kiwmi_view::link
 
+    struct kiwmi_transaction *transaction; // in flight, or NULL
+
     struct wlr_scene *scene;
     struct wlr_scene_rect *background_rect;
     struct wlr_scene_tree *strata[KIWMI_STRATA_COUNT];
+    struct kiwmi_hit_cache hit_cache;
 
     struct wl_listener xdg_shell_new_surface;
     struct wl_listener xdg_toplevel_new_decoration;
@@ -33,6 +33,8 @@ struct kiwmi_desktop_surface_impl {
         struct kiwmi_desktop_surface *desktop_surface);
 };
 
+struct kiwmi_desktop_surface *
+desktop_surface_from_wlr_surface(struct wlr_surface *surface);
 struct kiwmi_desktop_surface *
 desktop_surface_at(struct kiwmi_desktop *desktop, double lx, double ly);
 struct kiwmi_output *
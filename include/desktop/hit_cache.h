@@ -0,0 +1,55 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_DESKTOP_HIT_CACHE_H
+#define KIWMI_DESKTOP_HIT_CACHE_H
+
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+/**
+ * Remembers the last buffer found by wlr_scene_node_at(), so that a cursor
+ * moving within it doesn't walk the whole scene again. Anything that could
+ * change the buffer damages an output, so the cache is only trusted while
+ * there is no pending damage and no frame with damage was rendered since the
+ * lookup. The point may still have moved onto a node stacked above the
+ * buffer, so those are checked every time.
+ */
+
+struct kiwmi_desktop;
+struct wlr_scene_buffer;
+struct wlr_scene_node;
+struct wlr_scene_output;
+
+struct kiwmi_hit_cache {
+    struct wlr_scene_buffer *buffer; // or NULL
+    uint64_t serial;                 // scene_serial at the time of the lookup
+
+    // bumped for every frame that rendered damage
+    uint64_t scene_serial;
+
+    struct wl_listener buffer_destroy;
+};
+
+void hit_cache_init(struct kiwmi_hit_cache *cache);
+void hit_cache_fini(struct kiwmi_hit_cache *cache);
+
+// Called before the scene output is committed
+void hit_cache_output_frame(
+    struct kiwmi_hit_cache *cache,
+    struct wlr_scene_output *scene_output);
+
+// wlr_scene_node_at() on the whole scene, with the cache in front of it
+struct wlr_scene_node *hit_cache_node_at(
+    struct kiwmi_desktop *desktop,
+    double lx,
+    double ly,
+    double *sx,
+    double *sy);
+
+#endif /* KIWMI_DESKTOP_HIT_CACHE_H */
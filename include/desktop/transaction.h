@@ -0,0 +1,74 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_DESKTOP_TRANSACTION_H
+#define KIWMI_DESKTOP_TRANSACTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+/**
+ * A transaction applies a layout to many views at once. Resizes are sent to
+ * the clients right away, but the views keep showing a snapshot of their old
+ * buffers at their old position until every resized client has acked and
+ * committed its configure (or the timeout expires). Then all positions,
+ * visibility and borders change in the same frame.
+ */
+
+// How long to wait for the clients by default
+#define KIWMI_TRANSACTION_TIMEOUT_MS 200
+
+struct kiwmi_desktop;
+struct kiwmi_view;
+struct wlr_scene_tree;
+
+struct kiwmi_transaction {
+    struct kiwmi_desktop *desktop;
+    struct wl_list instructions; // struct kiwmi_transaction_instruction::link
+    size_t waiting;              // instructions with an unacked configure
+    struct wl_event_source *timeout;
+};
+
+struct kiwmi_transaction_instruction {
+    struct wl_list link;
+    struct kiwmi_transaction *transaction;
+    struct kiwmi_view *view;
+
+    bool move;
+    int x;
+    int y;
+    bool hidden;
+
+    uint32_t serial; // configure to wait for, 0 if not waiting
+    struct wlr_scene_tree *snapshot;
+};
+
+// Any transaction still in flight is applied first.
+struct kiwmi_transaction *transaction_create(struct kiwmi_desktop *desktop);
+void transaction_add_view(
+    struct kiwmi_transaction *transaction,
+    struct kiwmi_view *view,
+    bool move,
+    int x,
+    int y,
+    bool resize,
+    uint32_t width,
+    uint32_t height,
+    bool hidden);
+// Starts waiting for the clients, a timeout of 0 applies immediately.
+void transaction_commit(struct kiwmi_transaction *transaction, int timeout_ms);
+// Applies and frees the transaction in flight, if any.
+void transaction_flush(struct kiwmi_desktop *desktop);
+
+void transaction_view_commit(struct kiwmi_view *view, uint32_t serial);
+// Drops what's pending for the view, because it is going away or was moved
+// or hidden directly. Otherwise the transaction would undo that later.
+void transaction_view_cancel(struct kiwmi_view *view);
+
+#endif /* KIWMI_DESKTOP_TRANSACTION_H */
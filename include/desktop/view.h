@@ -28,6 +28,15 @@ enum kiwmi_view_type {
     KIWMI_VIEW_XDG_SHELL,
 };
 
+// Four rects around the view's geometry, recolored when it gets activated
+struct kiwmi_view_border {
+    struct wlr_scene_tree *tree; // NULL if the view has no border
+    struct wlr_scene_rect *rects[4];
+    int width;
+    float color[4];
+    float focused_color[4];
+};
+
 struct kiwmi_view {
     struct wl_list link;
     struct kiwmi_desktop_surface desktop_surface;
@@ -53,6 +62,12 @@ struct kiwmi_view {
     struct wl_listener request_resize;
 
     bool mapped;
+    bool activated;
+
+    struct kiwmi_view_border border;
+
+    // the layout waiting to be applied, or NULL
+    struct kiwmi_transaction_instruction *transaction;
 
     struct {
         struct wl_signal unmap;
@@ -71,7 +86,9 @@ struct kiwmi_view_impl {
     void (*close)(struct kiwmi_view *view);
     pid_t (*get_pid)(struct kiwmi_view *view);
     void (*set_activated)(struct kiwmi_view *view, bool activated);
-    void (*set_size)(struct kiwmi_view *view, uint32_t width, uint32_t height);
+    // returns the configure serial, or 0
+    uint32_t (
+        *set_size)(struct kiwmi_view *view, uint32_t width, uint32_t height);
     const char *(
         *get_string_prop)(struct kiwmi_view *view, enum kiwmi_view_prop prop);
     void (*set_tiled)(struct kiwmi_view *view, enum wlr_edges edges);
@@ -88,10 +105,19 @@ void view_get_size(struct kiwmi_view *view, uint32_t *width, uint32_t *height);
 const char *view_get_app_id(struct kiwmi_view *view);
 const char *view_get_title(struct kiwmi_view *view);
 void view_set_activated(struct kiwmi_view *view, bool activated);
-void view_set_size(struct kiwmi_view *view, uint32_t width, uint32_t height);
+uint32_t
+view_set_size(struct kiwmi_view *view, uint32_t width, uint32_t height);
 void view_set_pos(struct kiwmi_view *view, uint32_t x, uint32_t y);
+// view_set_pos() without refreshing the cursor focus, for moving many views
+void view_place(struct kiwmi_view *view, uint32_t x, uint32_t y);
 void view_set_tiled(struct kiwmi_view *view, enum wlr_edges edges);
 void view_set_hidden(struct kiwmi_view *view, bool hidden);
+void view_set_border(
+    struct kiwmi_view *view,
+    int width,
+    const float color[static 4],
+    const float focused_color[static 4]);
+void view_update_border(struct kiwmi_view *view);
 
 void view_focus(struct kiwmi_view *view);
 struct kiwmi_view *view_at(struct kiwmi_desktop *desktop, double lx, double ly);
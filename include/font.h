@@ -0,0 +1,26 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_FONT_H
+#define KIWMI_FONT_H
+
+#include <pango/pango-font.h>
+#include <wayland-server.h>
+
+// Interned font descriptions, handed out by font_registry_get(). They live
+// as long as the registry, so text nodes can hold on to them.
+struct font_registry {
+    struct wl_list fonts; // struct kiwmi_font::link
+    struct wl_list names; // struct kiwmi_font_name::link
+};
+
+void font_registry_init(struct font_registry *registry);
+void font_registry_fini(struct font_registry *registry);
+PangoFontDescription *
+font_registry_get(struct font_registry *registry, const char *name);
+
+#endif /* KIWMI_FONT_H */
@@ -34,6 +34,18 @@ struct kiwmi_cursor {
         uint32_t resize_edges;
     } grabbed;
 
+    // motion for the motion_frame event, delivered once per output frame or
+    // every interval_ms
+    struct {
+        bool pending;
+        double oldx;
+        double oldy;
+        double dx;
+        double dy;
+        int interval_ms;
+        struct wl_event_source *timer;
+    } coalesced;
+
     struct wl_listener cursor_motion;
     struct wl_listener cursor_motion_absolute;
     struct wl_listener cursor_button;
@@ -45,6 +57,7 @@ struct kiwmi_cursor {
         struct wl_signal button_up;
         struct wl_signal destroy;
         struct wl_signal motion;
+        struct wl_signal motion_frame;
         struct wl_signal scroll;
     } events;
 };
@@ -61,6 +74,15 @@ struct kiwmi_cursor_motion_event {
     double newy;
 };
 
+struct kiwmi_cursor_motion_frame_event {
+    double oldx;
+    double oldy;
+    double newx;
+    double newy;
+    double dx; // summed device deltas
+    double dy;
+};
+
 struct kiwmi_cursor_scroll_event {
     const char *device_name;
     bool is_vertical;
@@ -74,6 +96,9 @@ void cursor_refresh_focus(
     double *cursor_sx,
     double *cursor_sy);
 
+void cursor_set_motion_interval(struct kiwmi_cursor *cursor, int interval_ms);
+void cursor_flush_motion(struct kiwmi_cursor *cursor);
+
 struct kiwmi_cursor *cursor_create(
     struct kiwmi_server *server,
     struct wlr_output_layout *output_layout);
@@ -0,0 +1,64 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_INPUT_KEYBIND_H
+#define KIWMI_INPUT_KEYBIND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xkbcommon/xkbcommon.h>
+
+struct kiwmi_keyboard;
+
+// Set in `keysym` for a keybind on a keycode instead, which stays on the same
+// physical key whatever the layout. No keysym has this bit set.
+#define KIWMI_KEYBIND_KEYCODE (1u << 31)
+
+/**
+ * A keybind is looked up by (modifier mask, keysym) in a hash table, so keys
+ * without a binding never leave C. The owner embeds the keybind and gets it
+ * back with wl_container_of() in the handler.
+ */
+struct kiwmi_keybind {
+    struct kiwmi_keybind *next; // in the same bucket
+    uint32_t modifiers;         // enum wlr_keyboard_modifier
+    xkb_keysym_t keysym;
+
+    // the next steps of a chord (see input/keymap.h), or NULL
+    struct kiwmi_keybinds *children;
+
+    // not called for a chord prefix
+    void (*handler)(
+        struct kiwmi_keybind *keybind,
+        struct kiwmi_keyboard *keyboard);
+    void (*destroy)(struct kiwmi_keybind *keybind);
+};
+
+struct kiwmi_keybinds {
+    struct kiwmi_keybind **buckets;
+    size_t bucket_count; // a power of two, 0 while empty
+    size_t count;
+};
+
+void keybinds_init(struct kiwmi_keybinds *keybinds);
+void keybinds_fini(struct kiwmi_keybinds *keybinds);
+// Takes ownership of keybind, replacing (and destroying) an existing one
+bool keybinds_add(
+    struct kiwmi_keybinds *keybinds,
+    struct kiwmi_keybind *keybind);
+void keybinds_remove(
+    struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    xkb_keysym_t keysym);
+struct kiwmi_keybind *keybinds_find(
+    const struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    xkb_keysym_t keysym);
+
+#endif /* KIWMI_INPUT_KEYBIND_H */
@@ -13,6 +13,8 @@
 #include <wayland-server.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "input/keymap.h"
+
 struct kiwmi_keyboard {
     struct wl_list link;
     struct kiwmi_server *server;
@@ -21,6 +23,8 @@ struct kiwmi_keyboard {
     struct wl_listener key;
     struct wl_listener device_destroy;
 
+    struct kiwmi_keymap keymap;
+
     struct {
         struct wl_signal key_down;
         struct wl_signal key_up;
@@ -0,0 +1,125 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef KIWMI_INPUT_KEYMAP_H
+#define KIWMI_INPUT_KEYMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "input/keybind.h"
+
+/**
+ * The keymap decides which key presses belong to the compositor. It holds
+ * named modes, each with its own keybinds. A keybind can be a chord: its
+ * first steps lead to a nested table, which is used for the next key press
+ * (until the chord timeout expires). Tap keys report whether they were tapped
+ * or held on their own, while still being sent to the client.
+ */
+
+#define KIWMI_KEYMAP_DEFAULT_MODE "default"
+// enough for every key that can be held at once (WLR_KEYBOARD_KEYS_CAP)
+#define KIWMI_KEYMAP_BOUND_KEYS_CAP 32
+
+struct kiwmi_keyboard;
+
+struct kiwmi_keymap_step {
+    uint32_t modifiers;
+    xkb_keysym_t keysym;
+};
+
+struct kiwmi_keymap_mode {
+    struct wl_list link;
+    char *name;
+    struct kiwmi_keybinds keybinds;
+};
+
+enum kiwmi_keymap_tap_event {
+    KIWMI_KEYMAP_TAP,     // pressed and released before the timeout
+    KIWMI_KEYMAP_HOLD,    // still held alone when the timeout expired
+    KIWMI_KEYMAP_RELEASE, // released after KIWMI_KEYMAP_HOLD
+};
+
+struct kiwmi_keymap_tap {
+    struct wl_list link;
+    xkb_keysym_t keysym;
+    int timeout_ms; // 0 reports a hold right on the press, and never a tap
+
+    void (*handler)(
+        struct kiwmi_keymap_tap *tap,
+        struct kiwmi_keyboard *keyboard,
+        enum kiwmi_keymap_tap_event event);
+    void (*destroy)(struct kiwmi_keymap_tap *tap);
+};
+
+struct kiwmi_keymap {
+    struct kiwmi_keyboard *keyboard;
+
+    struct wl_list modes; // struct kiwmi_keymap_mode::link
+    struct kiwmi_keymap_mode *mode;
+
+    // the table for the next key of the chord in progress, or NULL
+    struct kiwmi_keybinds *chord;
+    int chord_timeout_ms;
+    struct wl_event_source *chord_timer;
+
+    struct wl_list taps;          // struct kiwmi_keymap_tap::link
+    struct kiwmi_keymap_tap *tap; // pressed and not yet decided, or held
+    uint32_t tap_keycode;
+    bool tap_held;
+    struct wl_event_source *tap_timer;
+
+    // keys pressed for a keybind, their release is not sent to the client
+    uint32_t bound_keycodes[KIWMI_KEYMAP_BOUND_KEYS_CAP];
+    size_t bound_keycodes_len;
+};
+
+struct kiwmi_keymap_key_event {
+    uint32_t keycode;
+    bool pressed;
+    uint32_t modifiers; // enum wlr_keyboard_modifier
+    const xkb_keysym_t *translated_syms;
+    int translated_syms_len;
+    const xkb_keysym_t *raw_syms;
+    int raw_syms_len;
+};
+
+bool keymap_init(
+    struct kiwmi_keymap *keymap,
+    struct kiwmi_keyboard *keyboard,
+    struct wl_event_loop *loop);
+void keymap_fini(struct kiwmi_keymap *keymap);
+
+// Returns whether the key is consumed by the compositor
+bool keymap_handle_key(
+    struct kiwmi_keymap *keymap,
+    const struct kiwmi_keymap_key_event *event);
+
+// Takes ownership of keybind, its modifiers and keysym are set from the last
+// step. The mode is created if it doesn't exist yet.
+bool keymap_bind(
+    struct kiwmi_keymap *keymap,
+    const char *mode,
+    const struct kiwmi_keymap_step *steps,
+    size_t steps_len,
+    struct kiwmi_keybind *keybind);
+void keymap_unbind(
+    struct kiwmi_keymap *keymap,
+    const char *mode,
+    const struct kiwmi_keymap_step *steps,
+    size_t steps_len);
+bool keymap_set_mode(struct kiwmi_keymap *keymap, const char *mode);
+
+// Takes ownership of tap, replacing one for the same keysym
+void keymap_add_tap(struct kiwmi_keymap *keymap, struct kiwmi_keymap_tap *tap);
+void keymap_remove_tap(struct kiwmi_keymap *keymap, xkb_keysym_t keysym);
+
+#endif /* KIWMI_INPUT_KEYMAP_H */
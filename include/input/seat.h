@@ -25,15 +25,32 @@ struct kiwmi_seat {
     // If exclusive_client is set, no other clients will receive input events
     struct wl_client *exclusive_client;
 
+    struct {
+        bool enabled;
+        int delay_ms;
+        struct kiwmi_view *hovered; // the view under the cursor
+        struct wl_event_source *timer;
+    } follow_mouse;
+
     struct wl_listener request_set_cursor;
     struct wl_listener request_set_selection;
     struct wl_listener request_set_primary_selection;
+
+    struct {
+        struct wl_signal focus_change; // the focused view or NULL
+    } events;
 };
 
 void
 seat_focus_surface(struct kiwmi_seat *seat, struct wlr_surface *wlr_surface);
 void seat_focus_layer(struct kiwmi_seat *seat, struct kiwmi_layer *layer);
 void seat_focus_view(struct kiwmi_seat *seat, struct kiwmi_view *view);
+// The view got hidden or unmapped, so it can't keep the focus
+void seat_forget_view(struct kiwmi_seat *seat, struct kiwmi_view *view);
+// Called by the cursor with the view under it whenever the pointer moves
+void seat_hover_view(struct kiwmi_seat *seat, struct kiwmi_view *view);
+void
+seat_set_follow_mouse(struct kiwmi_seat *seat, bool enabled, int delay_ms);
 void
 seat_set_exclusive_client(struct kiwmi_seat *seat, struct wl_client *client);
 
@@ -2,6 +2,15 @@
 #define KIWMI_LUAK_KIWMI_SCENE_NODE_H
 
 #include <lua.h>
+#include <stdbool.h>
+#include <wlr/types/wlr_scene.h>
+
+bool scene_node_set_geometry(
+    struct wlr_scene_node *node,
+    int x,
+    int y,
+    int width,
+    int height);
 
 int luaK_kiwmi_scene_node_new(lua_State *L);
 int luaK_kiwmi_scene_node_register(lua_State *L);
@@ -11,6 +11,7 @@
 #include <stdbool.h>
 
 #include "desktop/desktop.h"
+#include "font.h"
 #include "input/input.h"
 #include "websocket.h"
 #include <pango/pango-font.h>
@@ -28,7 +29,8 @@ struct kiwmi_server {
     struct kiwmi_desktop desktop;
     struct kiwmi_input input;
 
-    PangoFontDescription *font_description;
+    struct font_registry fonts;
+    PangoFontDescription *font_description; // the default, from `fonts`
     struct websocket *websocket;
 
     struct {
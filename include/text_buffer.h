@@ -2,6 +2,7 @@
 #ifndef KIWMI_TEXT_BUFFER_H
 #define KIWMI_TEXT_BUFFER_H
 #include "pango/pango-font.h"
+#include <wayland-server.h>
 #include <wlr/types/wlr_scene.h>
 
 struct text_node {
@@ -17,6 +18,8 @@ struct text_node {
     struct wlr_scene_node *node;
 };
 
+// font_description has to outlive the node and everything it rendered,
+// get it from the server's font_registry
 struct text_node *text_node_create(
     struct wlr_scene_tree *parent,
     PangoFontDescription *font_description,
@@ -24,7 +27,11 @@ struct text_node *text_node_create(
     const float *color,
     bool pango_markup);
 void text_node_set_color(struct text_node *node, const float *color);
-void text_node_set_text(struct text_node *node, const char *text);
+void text_node_set_text(struct text_node *node, const char *text, size_t len);
 void text_node_set_max_width(struct text_node *node, int max_width);
 
+// Without these, text is rasterized synchronously
+bool text_renderer_init(struct wl_event_loop *event_loop);
+void text_renderer_fini(void);
+
 #endif
@@ -1,15 +1,57 @@
 #ifndef KIWMI_WEBSOCKET_H
 #define KIWMI_WEBSOCKET_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include <lua.h>
 #include <wayland-server.h>
 
 struct websocket;
 
+struct websocket_listen_options {
+    const char *address; // bind address, NULL for all interfaces
+    int port;
+    const char *unix_path; // listen on this unix socket instead, if set
+    int deflate; // permessage-deflate compression level 1-9, 0 disables it
+};
+
+struct websocket_send_options {
+    // may replace a queued message of the same `kind` that wasn't sent yet
+    bool coalesce;
+    bool diff; // as a diff stream to clients that connected with ?diff=1
+};
+
+struct websocket_stats {
+    size_t clients;
+    size_t queued; // messages waiting to be sent
+    size_t queued_bytes;
+    uint64_t dropped;   // did not fit below the high-water mark
+    uint64_t coalesced; // replaced by a newer message of the same kind
+};
+
 struct websocket *
 websocket_init(struct lua_State *L, struct wl_event_loop *event_loop);
 void websocket_fini(struct websocket *data);
-int websocket_send_msg(struct lua_State *L);
+bool websocket_listen(
+    struct websocket *self,
+    const struct websocket_listen_options *options);
+bool websocket_send(
+    struct websocket *self,
+    struct lua_State *L,
+    void *client,
+    int idx,
+    const struct websocket_send_options *options);
+size_t websocket_broadcast(
+    struct websocket *self,
+    struct lua_State *L,
+    int idx,
+    const struct websocket_send_options *options);
+bool websocket_stats(
+    struct websocket *self,
+    void *client,
+    struct websocket_stats *stats);
 void websocket_register_callbacks(
     struct websocket *self,
     int connect_ref,
@@ -25,9 +25,11 @@
 #include <wlr/util/log.h>
 
 #include "desktop/desktop_surface.h"
+#include "desktop/hit_cache.h"
 #include "desktop/layer_shell.h"
 #include "desktop/output.h"
 #include "desktop/stratum.h"
+#include "desktop/transaction.h"
 #include "desktop/view.h"
 #include "desktop/xdg_shell.h"
 #include "input/cursor.h"
@@ -46,6 +48,7 @@ desktop_init(struct kiwmi_desktop *desktop)
     desktop->data_device_manager =
         wlr_data_device_manager_create(server->wl_display);
     desktop->output_layout = wlr_output_layout_create();
+    desktop->transaction   = NULL;
 
     wlr_export_dmabuf_manager_v1_create(server->wl_display);
     wlr_xdg_output_manager_v1_create(
@@ -70,6 +73,8 @@ desktop_init(struct kiwmi_desktop *desktop)
 
     wlr_scene_attach_output_layout(desktop->scene, desktop->output_layout);
 
+    hit_cache_init(&desktop->hit_cache);
+
     struct wlr_presentation *presentation =
         wlr_presentation_create(server->wl_display, server->backend);
     wlr_scene_set_presentation(desktop->scene, presentation);
@@ -114,8 +119,11 @@ desktop_init(struct kiwmi_desktop *desktop)
 void
 desktop_fini(struct kiwmi_desktop *desktop)
 {
+    transaction_flush(desktop);
+
     wlr_output_layout_destroy(desktop->output_layout);
     desktop->output_layout = NULL;
+    hit_cache_fini(&desktop->hit_cache);
     wlr_scene_node_destroy(&desktop->scene->tree.node);
     desktop->scene = NULL;
 }
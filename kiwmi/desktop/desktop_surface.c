@@ -13,12 +13,13 @@
 #include <wlr/types/wlr_xdg_shell.h>
 
 #include "desktop/desktop.h"
+#include "desktop/hit_cache.h"
 #include "desktop/layer_shell.h"
 #include "desktop/output.h"
 #include "desktop/popup.h"
 #include "desktop/view.h"
 
-static struct kiwmi_desktop_surface *
+struct kiwmi_desktop_surface *
 desktop_surface_from_wlr_surface(struct wlr_surface *surface)
 {
     struct wlr_subsurface *subsurface;
@@ -57,7 +58,7 @@ desktop_surface_at(struct kiwmi_desktop *desktop, double lx, double ly)
 {
     double sx, sy;
     struct wlr_scene_node *node_at =
-        wlr_scene_node_at(&desktop->scene->tree.node, lx, ly, &sx, &sy);
+        hit_cache_node_at(desktop, lx, ly, &sx, &sy);
 
     if (!node_at || node_at->type != WLR_SCENE_NODE_BUFFER) {
         return NULL;
@@ -0,0 +1,177 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "desktop/hit_cache.h"
+
+#include <pixman.h>
+#include <wayland-server.h>
+#include <wlr/types/wlr_scene.h>
+
+#include "desktop/desktop.h"
+
+static void
+hit_cache_clear(struct kiwmi_hit_cache *cache)
+{
+    if (cache->buffer) {
+        wl_list_remove(&cache->buffer_destroy.link);
+        wl_list_init(&cache->buffer_destroy.link);
+        cache->buffer = NULL;
+    }
+}
+
+static void
+hit_cache_buffer_destroy_notify(
+    struct wl_listener *listener,
+    void *UNUSED(data))
+{
+    struct kiwmi_hit_cache *cache =
+        wl_container_of(listener, cache, buffer_destroy);
+
+    hit_cache_clear(cache);
+}
+
+static void
+hit_cache_set(struct kiwmi_hit_cache *cache, struct wlr_scene_node *node)
+{
+    hit_cache_clear(cache);
+
+    if (!node || node->type != WLR_SCENE_NODE_BUFFER) {
+        return;
+    }
+
+    cache->buffer = wlr_scene_buffer_from_node(node);
+    cache->serial = cache->scene_serial;
+    wl_signal_add(&node->events.destroy, &cache->buffer_destroy);
+}
+
+static bool
+scene_has_damage(struct wlr_scene *scene)
+{
+    struct wlr_scene_output *scene_output;
+    wl_list_for_each (scene_output, &scene->outputs, link) {
+        if (pixman_region32_not_empty(&scene_output->damage_ring.current)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Whether a node stacked above `node` takes input at the point, like a popup
+// or an overlapping view. Those are on top, so this walk is short for the
+// buffers the cursor usually is over.
+static bool
+hit_cache_occluded(struct wlr_scene_node *node, double lx, double ly)
+{
+    double nx, ny; // unused
+    for (; node->parent; node = &node->parent->node) {
+        // later siblings are drawn on top
+        struct wl_list *link = node->link.next;
+        for (; link != &node->parent->children; link = link->next) {
+            struct wlr_scene_node *above = wl_container_of(link, above, link);
+            if (wlr_scene_node_at(above, lx, ly, &nx, &ny)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static bool
+hit_cache_lookup(
+    struct kiwmi_desktop *desktop,
+    double lx,
+    double ly,
+    double *sx,
+    double *sy)
+{
+    struct kiwmi_hit_cache *cache   = &desktop->hit_cache;
+    struct wlr_scene_buffer *buffer = cache->buffer;
+
+    if (!buffer || !buffer->buffer || cache->serial != cache->scene_serial) {
+        return false;
+    }
+
+    if (scene_has_damage(desktop->scene)) {
+        return false;
+    }
+
+    // the position is read every time, that's just a walk up the parents
+    int x, y;
+    if (!wlr_scene_node_coords(&buffer->node, &x, &y)) {
+        return false;
+    }
+
+    double bx = lx - x;
+    double by = ly - y;
+    if (bx < 0 || by < 0 || bx >= buffer->dst_width
+        || by >= buffer->dst_height) {
+        return false;
+    }
+
+    if (buffer->point_accepts_input
+        && !buffer->point_accepts_input(buffer, bx, by)) {
+        return false;
+    }
+
+    if (hit_cache_occluded(&buffer->node, lx, ly)) {
+        return false;
+    }
+
+    *sx = bx;
+    *sy = by;
+
+    return true;
+}
+
+void
+hit_cache_init(struct kiwmi_hit_cache *cache)
+{
+    cache->buffer       = NULL;
+    cache->serial       = 0;
+    cache->scene_serial = 0;
+
+    cache->buffer_destroy.notify = hit_cache_buffer_destroy_notify;
+    wl_list_init(&cache->buffer_destroy.link);
+}
+
+void
+hit_cache_fini(struct kiwmi_hit_cache *cache)
+{
+    hit_cache_clear(cache);
+}
+
+void
+hit_cache_output_frame(
+    struct kiwmi_hit_cache *cache,
+    struct wlr_scene_output *scene_output)
+{
+    // the damage is gone after the commit, remember that there was some
+    if (pixman_region32_not_empty(&scene_output->damage_ring.current)) {
+        ++cache->scene_serial;
+    }
+}
+
+struct wlr_scene_node *
+hit_cache_node_at(
+    struct kiwmi_desktop *desktop,
+    double lx,
+    double ly,
+    double *sx,
+    double *sy)
+{
+    if (hit_cache_lookup(desktop, lx, ly, sx, sy)) {
+        return &desktop->hit_cache.buffer->node;
+    }
+
+    struct wlr_scene_node *node =
+        wlr_scene_node_at(&desktop->scene->tree.node, lx, ly, sx, sy);
+    hit_cache_set(&desktop->hit_cache, node);
+
+    return node;
+}
@@ -24,6 +24,7 @@
 #include <wlr/util/log.h>
 
 #include "desktop/desktop.h"
+#include "desktop/hit_cache.h"
 #include "desktop/layer_shell.h"
 #include "desktop/lock.h"
 #include "desktop/view.h"
@@ -38,6 +39,15 @@ output_frame_notify(struct wl_listener *listener, void *data)
     struct kiwmi_output *output   = wl_container_of(listener, output, frame);
     struct wlr_output *wlr_output = data;
 
+    struct kiwmi_server *server =
+        wl_container_of(output->desktop, server, desktop);
+    struct kiwmi_cursor *cursor = server->input.cursor;
+
+    // coalesced motion goes out at the frame rate unless it has its own
+    if (cursor->coalesced.interval_ms == 0) {
+        cursor_flush_motion(cursor);
+    }
+
     struct wlr_scene_output *scene_output =
         wlr_scene_get_scene_output(output->desktop->scene, wlr_output);
 
@@ -45,6 +55,7 @@ output_frame_notify(struct wl_listener *listener, void *data)
         return;
     }
 
+    hit_cache_output_frame(&output->desktop->hit_cache, scene_output);
     wlr_scene_output_commit(scene_output);
 
     struct timespec now;
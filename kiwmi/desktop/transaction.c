@@ -0,0 +1,289 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "desktop/transaction.h"
+
+#include <stdlib.h>
+
+#include <wayland-server.h>
+#include <wlr/types/wlr_scene.h>
+#include <wlr/util/log.h>
+
+#include "desktop/desktop.h"
+#include "desktop/view.h"
+#include "input/cursor.h"
+#include "server.h"
+
+static void
+snapshot_buffer(struct wlr_scene_buffer *buffer, int sx, int sy, void *data)
+{
+    struct wlr_scene_tree *snapshot = data;
+
+    if (!buffer->buffer) {
+        return;
+    }
+
+    struct wlr_scene_buffer *copy =
+        wlr_scene_buffer_create(snapshot, buffer->buffer);
+    if (!copy) {
+        return;
+    }
+
+    wlr_scene_node_set_position(&copy->node, sx, sy);
+    wlr_scene_buffer_set_dest_size(copy, buffer->dst_width, buffer->dst_height);
+    wlr_scene_buffer_set_source_box(copy, &buffer->src_box);
+    wlr_scene_buffer_set_transform(copy, buffer->transform);
+}
+
+// Freezes what the view currently shows until the instruction is destroyed
+static void
+instruction_snapshot(struct kiwmi_transaction_instruction *instruction)
+{
+    struct kiwmi_view *view             = instruction->view;
+    struct wlr_scene_tree *surface_tree = view->desktop_surface.surface_tree;
+
+    instruction->snapshot = wlr_scene_tree_create(view->desktop_surface.tree);
+    if (!instruction->snapshot) {
+        return;
+    }
+
+    wlr_scene_node_for_each_buffer(
+        &surface_tree->node, snapshot_buffer, instruction->snapshot);
+    wlr_scene_node_place_above(
+        &instruction->snapshot->node, &surface_tree->node);
+    wlr_scene_node_set_enabled(&surface_tree->node, false);
+}
+
+static void
+instruction_destroy(struct kiwmi_transaction_instruction *instruction)
+{
+    struct kiwmi_view *view = instruction->view;
+
+    if (instruction->snapshot) {
+        wlr_scene_node_destroy(&instruction->snapshot->node);
+        wlr_scene_node_set_enabled(
+            &view->desktop_surface.surface_tree->node, true);
+    }
+
+    if (instruction->serial) {
+        --instruction->transaction->waiting;
+    }
+
+    view->transaction = NULL;
+    wl_list_remove(&instruction->link);
+    free(instruction);
+}
+
+static void
+transaction_apply(struct kiwmi_transaction *transaction)
+{
+    struct kiwmi_desktop *desktop = transaction->desktop;
+    struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
+
+    // Hiding a view can run Lua (focus changes), which may start the next
+    // transaction or take views out of this one. Detach it first, so that
+    // it can't be applied again from there.
+    if (desktop->transaction == transaction) {
+        desktop->transaction = NULL;
+    }
+
+    if (transaction->timeout) {
+        wl_event_source_remove(transaction->timeout);
+        transaction->timeout = NULL;
+    }
+
+    while (!wl_list_empty(&transaction->instructions)) {
+        struct kiwmi_transaction_instruction *instruction = wl_container_of(
+            transaction->instructions.next, instruction, link);
+        struct kiwmi_view *view = instruction->view;
+        bool move               = instruction->move;
+        int x                   = instruction->x;
+        int y                   = instruction->y;
+        bool hidden             = instruction->hidden;
+        instruction_destroy(instruction);
+
+        if (move) {
+            view_place(view, x, y);
+        }
+        view_set_hidden(view, hidden);
+        view_update_border(view);
+    }
+
+    free(transaction);
+
+    // what's under the cursor may have changed, once for all the views
+    cursor_refresh_focus(server->input.cursor, NULL, NULL, NULL);
+}
+
+static int
+transaction_timeout(void *data)
+{
+    struct kiwmi_transaction *transaction = data;
+
+    if (transaction->waiting > 0) {
+        wlr_log(
+            WLR_DEBUG,
+            "Transaction timed out waiting for %zu views",
+            transaction->waiting);
+    }
+
+    transaction_apply(transaction);
+
+    return 0;
+}
+
+struct kiwmi_transaction *
+transaction_create(struct kiwmi_desktop *desktop)
+{
+    transaction_flush(desktop);
+
+    struct kiwmi_transaction *transaction = malloc(sizeof(*transaction));
+    if (!transaction) {
+        wlr_log(WLR_ERROR, "Failed to allocate transaction");
+        return NULL;
+    }
+
+    transaction->desktop = desktop;
+    transaction->waiting = 0;
+    transaction->timeout = NULL;
+    wl_list_init(&transaction->instructions);
+
+    // registered right away, so a Lua error while filling it can't leak it
+    desktop->transaction = transaction;
+
+    return transaction;
+}
+
+void
+transaction_add_view(
+    struct kiwmi_transaction *transaction,
+    struct kiwmi_view *view,
+    bool move,
+    int x,
+    int y,
+    bool resize,
+    uint32_t width,
+    uint32_t height,
+    bool hidden)
+{
+    // the last entry for a view wins
+    if (view->transaction) {
+        instruction_destroy(view->transaction);
+    }
+
+    uint32_t serial = 0;
+    if (resize) {
+        bool changed = (int)width != view->geom.width
+            || (int)height != view->geom.height;
+        serial = view_set_size(view, width, height);
+        if (!changed || !view->mapped) {
+            serial = 0;
+        }
+    }
+
+    struct kiwmi_transaction_instruction *instruction =
+        malloc(sizeof(*instruction));
+    if (!instruction) {
+        wlr_log(WLR_ERROR, "Failed to allocate transaction instruction");
+        if (move) {
+            view_place(view, x, y);
+        }
+        view_set_hidden(view, hidden);
+        return;
+    }
+
+    instruction->transaction = transaction;
+    instruction->view        = view;
+    instruction->move        = move;
+    instruction->x           = x;
+    instruction->y           = y;
+    instruction->hidden      = hidden;
+    instruction->serial      = serial;
+    instruction->snapshot    = NULL;
+
+    if (serial) {
+        ++transaction->waiting;
+    }
+
+    view->transaction = instruction;
+    wl_list_insert(transaction->instructions.prev, &instruction->link);
+}
+
+void
+transaction_commit(struct kiwmi_transaction *transaction, int timeout_ms)
+{
+    struct kiwmi_desktop *desktop = transaction->desktop;
+    struct kiwmi_server *server   = wl_container_of(desktop, server, desktop);
+
+    if (timeout_ms <= 0 || transaction->waiting == 0) {
+        transaction_apply(transaction);
+        return;
+    }
+
+    struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+    transaction->timeout =
+        wl_event_loop_add_timer(loop, transaction_timeout, transaction);
+    if (!transaction->timeout
+        || wl_event_source_timer_update(transaction->timeout, timeout_ms) < 0) {
+        wlr_log(WLR_ERROR, "Failed to arm transaction timeout");
+        transaction_apply(transaction);
+        return;
+    }
+
+    struct kiwmi_transaction_instruction *instruction;
+    wl_list_for_each (instruction, &transaction->instructions, link) {
+        if (instruction->serial) {
+            instruction_snapshot(instruction);
+        }
+    }
+}
+
+void
+transaction_flush(struct kiwmi_desktop *desktop)
+{
+    if (desktop->transaction) {
+        transaction_apply(desktop->transaction);
+    }
+}
+
+void
+transaction_view_commit(struct kiwmi_view *view, uint32_t serial)
+{
+    struct kiwmi_transaction_instruction *instruction = view->transaction;
+    if (!instruction || !instruction->serial) {
+        return;
+    }
+
+    // serials wrap around
+    if ((int32_t)(serial - instruction->serial) < 0) {
+        return;
+    }
+
+    instruction->serial = 0;
+
+    struct kiwmi_transaction *transaction = instruction->transaction;
+    if (--transaction->waiting == 0) {
+        transaction_apply(transaction);
+    }
+}
+
+void
+transaction_view_cancel(struct kiwmi_view *view)
+{
+    struct kiwmi_transaction_instruction *instruction = view->transaction;
+    if (!instruction) {
+        return;
+    }
+
+    struct kiwmi_transaction *transaction = instruction->transaction;
+    instruction_destroy(instruction);
+
+    // don't apply from within the caller, but on the next dispatch
+    if (transaction->waiting == 0 && transaction->timeout) {
+        wl_event_source_timer_update(transaction->timeout, 1);
+    }
+}
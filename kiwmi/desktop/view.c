@@ -7,12 +7,15 @@
 
 #include "desktop/view.h"
 
+#include <string.h>
+
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/util/log.h>
 
 #include "desktop/output.h"
 #include "desktop/stratum.h"
+#include "desktop/transaction.h"
 #include "input/cursor.h"
 #include "input/seat.h"
 #include "server.h"
@@ -69,21 +72,40 @@ view_set_activated(struct kiwmi_view *view, bool activated)
     if (view->impl->set_activated) {
         view->impl->set_activated(view, activated);
     }
+
+    view->activated = activated;
+
+    if (view->border.tree) {
+        const float *color =
+            activated ? view->border.focused_color : view->border.color;
+        for (int i = 0; i < 4; ++i) {
+            wlr_scene_rect_set_color(view->border.rects[i], color);
+        }
+    }
 }
 
-void
+uint32_t
 view_set_size(struct kiwmi_view *view, uint32_t width, uint32_t height)
 {
     if (view->impl->set_size) {
-        view->impl->set_size(view, width, height);
+        return view->impl->set_size(view, width, height);
     }
+
+    return 0;
 }
 
 void
-view_set_pos(struct kiwmi_view *view, uint32_t x, uint32_t y)
+view_place(struct kiwmi_view *view, uint32_t x, uint32_t y)
 {
     wlr_scene_node_set_position(&view->desktop_surface.tree->node, x, y);
     wlr_scene_node_set_position(&view->desktop_surface.popups_tree->node, x, y);
+}
+
+void
+view_set_pos(struct kiwmi_view *view, uint32_t x, uint32_t y)
+{
+    transaction_view_cancel(view);
+    view_place(view, x, y);
 
     int lx, ly; // unused
     // If it is enabled (as well as all its parents)
@@ -105,6 +127,8 @@ view_set_tiled(struct kiwmi_view *view, enum wlr_edges edges)
 void
 view_set_hidden(struct kiwmi_view *view, bool hidden)
 {
+    transaction_view_cancel(view);
+
     if (!view->mapped) {
         return;
     }
@@ -113,12 +137,77 @@ view_set_hidden(struct kiwmi_view *view, bool hidden)
     wlr_scene_node_set_enabled(
         &view->desktop_surface.popups_tree->node, !hidden);
 
-    struct kiwmi_server *server =
-        wl_container_of(view->desktop, server, desktop);
-    struct kiwmi_seat *seat = server->input.seat;
-    if (seat->focused_view == view) {
-        seat->focused_view = NULL;
+    if (hidden) {
+        struct kiwmi_server *server =
+            wl_container_of(view->desktop, server, desktop);
+        seat_forget_view(server->input.seat, view);
+    }
+}
+
+void
+view_update_border(struct kiwmi_view *view)
+{
+    struct kiwmi_view_border *border = &view->border;
+    if (!border->tree) {
+        return;
+    }
+
+    int w      = border->width;
+    int width  = view->geom.width;
+    int height = view->geom.height;
+
+    // left, right, top, bottom
+    struct wlr_box boxes[4] = {
+        {-w, 0, w, height},
+        {width, 0, w, height},
+        {-w, -w, width + 2 * w, w},
+        {-w, height, width + 2 * w, w},
+    };
+
+    for (int i = 0; i < 4; ++i) {
+        struct wlr_scene_rect *rect = border->rects[i];
+        wlr_scene_node_set_position(&rect->node, boxes[i].x, boxes[i].y);
+        wlr_scene_rect_set_size(rect, boxes[i].width, boxes[i].height);
+    }
+}
+
+void
+view_set_border(
+    struct kiwmi_view *view,
+    int width,
+    const float color[static 4],
+    const float focused_color[static 4])
+{
+    struct kiwmi_view_border *border = &view->border;
+
+    if (width <= 0) {
+        if (border->tree) {
+            wlr_scene_node_destroy(&border->tree->node);
+            border->tree = NULL;
+        }
+        border->width = 0;
+        return;
     }
+
+    border->width = width;
+    memcpy(border->color, color, sizeof(border->color));
+    memcpy(border->focused_color, focused_color, sizeof(border->focused_color));
+
+    const float *current = view->activated ? focused_color : color;
+
+    if (!border->tree) {
+        border->tree = wlr_scene_tree_create(view->desktop_surface.tree);
+        for (int i = 0; i < 4; ++i) {
+            border->rects[i] =
+                wlr_scene_rect_create(border->tree, 0, 0, current);
+        }
+    } else {
+        for (int i = 0; i < 4; ++i) {
+            wlr_scene_rect_set_color(border->rects[i], current);
+        }
+    }
+
+    view_update_border(view);
 }
 
 struct kiwmi_view *
@@ -236,11 +325,14 @@ view_create(
         return NULL;
     }
 
-    view->desktop    = desktop;
-    view->type       = type;
-    view->impl       = impl;
-    view->mapped     = false;
-    view->decoration = NULL;
+    view->desktop     = desktop;
+    view->type        = type;
+    view->impl        = impl;
+    view->mapped      = false;
+    view->activated   = false;
+    view->decoration  = NULL;
+    view->border      = (struct kiwmi_view_border){0};
+    view->transaction = NULL;
 
     view->desktop_surface.type = KIWMI_DESKTOP_SURFACE_VIEW;
     view->desktop_surface.impl = &view_desktop_surface_impl;
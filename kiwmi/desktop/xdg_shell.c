@@ -20,6 +20,7 @@
 #include "desktop/desktop.h"
 #include "desktop/output.h"
 #include "desktop/popup.h"
+#include "desktop/transaction.h"
 #include "desktop/view.h"
 #include "input/cursor.h"
 #include "input/input.h"
@@ -52,10 +53,7 @@ xdg_surface_unmap_notify(struct wl_listener *listener, void *UNUSED(data))
             wl_container_of(view->desktop, server, desktop);
         cursor_refresh_focus(server->input.cursor, NULL, NULL, NULL);
 
-        struct kiwmi_seat *seat = server->input.seat;
-        if (seat->focused_view == view) {
-            seat->focused_view = NULL;
-        }
+        seat_forget_view(server->input.seat, view);
     }
 
     wl_signal_emit(&view->events.unmap, view);
@@ -72,10 +70,17 @@ xdg_surface_commit_notify(struct wl_listener *listener, void *UNUSED(data))
     if (memcmp(&view->geom, &geom, sizeof(geom)) != 0) {
         memcpy(&view->geom, &geom, sizeof(geom));
 
+        // a pending transaction updates it together with the position
+        if (!view->transaction) {
+            view_update_border(view);
+        }
+
         struct kiwmi_desktop *desktop = view->desktop;
         struct kiwmi_server *server = wl_container_of(desktop, server, desktop);
         cursor_refresh_focus(server->input.cursor, NULL, NULL, NULL);
     }
+
+    transaction_view_commit(view, view->xdg_surface->current.configure_serial);
 }
 
 static void
@@ -83,6 +88,8 @@ xdg_surface_destroy_notify(struct wl_listener *listener, void *UNUSED(data))
 {
     struct kiwmi_view *view = wl_container_of(listener, view, destroy);
 
+    transaction_view_cancel(view);
+
     wlr_scene_node_destroy(&view->desktop_surface.tree->node);
     wlr_scene_node_destroy(&view->desktop_surface.popups_tree->node);
 
@@ -169,13 +176,14 @@ xdg_shell_view_set_activated(struct kiwmi_view *view, bool activated)
     wlr_xdg_toplevel_set_activated(view->xdg_surface->toplevel, activated);
 }
 
-static void
+static uint32_t
 xdg_shell_view_set_size(
     struct kiwmi_view *view,
     uint32_t width,
     uint32_t height)
 {
-    wlr_xdg_toplevel_set_size(view->xdg_surface->toplevel, width, height);
+    return wlr_xdg_toplevel_set_size(
+        view->xdg_surface->toplevel, width, height);
 }
 
 static void
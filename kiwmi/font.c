@@ -0,0 +1,102 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "font.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <wlr/util/log.h>
+
+struct kiwmi_font {
+    struct wl_list link;
+    PangoFontDescription *description;
+};
+
+// A name Lua asked for, so asking again is a string compare, not a parse
+struct kiwmi_font_name {
+    struct wl_list link;
+    char *name;
+    PangoFontDescription *description; // owned by a kiwmi_font
+};
+
+void
+font_registry_init(struct font_registry *registry)
+{
+    wl_list_init(&registry->fonts);
+    wl_list_init(&registry->names);
+}
+
+void
+font_registry_fini(struct font_registry *registry)
+{
+    struct kiwmi_font_name *font_name;
+    struct kiwmi_font_name *tmp_name;
+    wl_list_for_each_safe (font_name, tmp_name, &registry->names, link) {
+        wl_list_remove(&font_name->link);
+        free(font_name->name);
+        free(font_name);
+    }
+
+    struct kiwmi_font *font;
+    struct kiwmi_font *tmp;
+    wl_list_for_each_safe (font, tmp, &registry->fonts, link) {
+        wl_list_remove(&font->link);
+        pango_font_description_free(font->description);
+        free(font);
+    }
+}
+
+// Names that describe the same font, like "sans 11" and "Sans 11", end up
+// with the same description, so text using either shares its caches. A name
+// is only parsed the first time it comes up.
+PangoFontDescription *
+font_registry_get(struct font_registry *registry, const char *name)
+{
+    struct kiwmi_font_name *font_name;
+    wl_list_for_each (font_name, &registry->names, link) {
+        if (strcmp(font_name->name, name) == 0) {
+            return font_name->description;
+        }
+    }
+
+    font_name = calloc(1, sizeof(*font_name));
+    if (!font_name || !(font_name->name = strdup(name))) {
+        wlr_log(WLR_ERROR, "Failed to allocate font name");
+        free(font_name);
+        return NULL;
+    }
+
+    PangoFontDescription *description =
+        pango_font_description_from_string(name);
+
+    struct kiwmi_font *font;
+    wl_list_for_each (font, &registry->fonts, link) {
+        if (pango_font_description_equal(font->description, description)) {
+            pango_font_description_free(description);
+            font_name->description = font->description;
+            wl_list_insert(&registry->names, &font_name->link);
+            return font->description;
+        }
+    }
+
+    font = calloc(1, sizeof(*font));
+    if (!font) {
+        wlr_log(WLR_ERROR, "Failed to allocate font");
+        pango_font_description_free(description);
+        free(font_name->name);
+        free(font_name);
+        return NULL;
+    }
+
+    font->description = description;
+    wl_list_insert(&registry->fonts, &font->link);
+    font_name->description = description;
+    wl_list_insert(&registry->names, &font_name->link);
+
+    return description;
+}
@@ -20,12 +20,16 @@
 #include <wlr/util/log.h>
 
 #include "desktop/desktop.h"
+#include "desktop/hit_cache.h"
 #include "desktop/layer_shell.h"
 #include "desktop/output.h"
 #include "desktop/view.h"
 #include "input/seat.h"
 #include "server.h"
 
+// How often motion_frame fires without an output frame to deliver on
+#define CURSOR_MOTION_FALLBACK_MS 16
+
 static void
 process_cursor_motion(struct kiwmi_server *server, uint32_t time)
 {
@@ -87,13 +91,79 @@ process_cursor_motion(struct kiwmi_server *server, uint32_t time)
     }
 
     struct wlr_surface *old_focus = seat->pointer_state.focused_surface;
-    struct wlr_surface *new_focus;
+    struct wlr_surface *new_focus = NULL;
     double sx, sy;
     cursor_refresh_focus(cursor, &new_focus, &sx, &sy);
     if (new_focus && new_focus == old_focus) {
         wlr_seat_pointer_notify_enter(seat, new_focus, sx, sy);
         wlr_seat_pointer_notify_motion(seat, time, sx, sy);
     }
+
+    // Only the pointer moving changes the hovered view, a view that ends up
+    // under a resting pointer (layouts, maps) doesn't take the focus
+    struct kiwmi_view *view = NULL;
+    if (new_focus) {
+        struct kiwmi_desktop_surface *desktop_surface =
+            desktop_surface_from_wlr_surface(new_focus);
+        if (desktop_surface
+            && desktop_surface->type == KIWMI_DESKTOP_SURFACE_VIEW) {
+            view = wl_container_of(desktop_surface, view, desktop_surface);
+        }
+    }
+    seat_hover_view(input->seat, view);
+}
+
+static void
+coalesce_motion(
+    struct kiwmi_cursor *cursor,
+    const struct kiwmi_cursor_motion_event *event,
+    double dx,
+    double dy)
+{
+    if (wl_list_empty(&cursor->events.motion_frame.listener_list)) {
+        return;
+    }
+
+    if (!cursor->coalesced.pending) {
+        cursor->coalesced.pending = true;
+        cursor->coalesced.oldx    = event->oldx;
+        cursor->coalesced.oldy    = event->oldy;
+        cursor->coalesced.dx      = 0;
+        cursor->coalesced.dy      = 0;
+
+        // the hardware cursor doesn't damage the output, so ask for a frame
+        // to deliver on
+        struct wlr_output *wlr_output = NULL;
+        if (cursor->coalesced.interval_ms == 0) {
+            wlr_output = wlr_output_layout_output_at(
+                cursor->server->desktop.output_layout,
+                event->newx,
+                event->newy);
+        }
+
+        if (wlr_output && wlr_output->enabled) {
+            wlr_output_schedule_frame(wlr_output);
+        } else {
+            // no frame is coming without an output to show the cursor on
+            int interval_ms = cursor->coalesced.interval_ms > 0
+                ? cursor->coalesced.interval_ms
+                : CURSOR_MOTION_FALLBACK_MS;
+            wl_event_source_timer_update(cursor->coalesced.timer, interval_ms);
+        }
+    }
+
+    cursor->coalesced.dx += dx;
+    cursor->coalesced.dy += dy;
+}
+
+static int
+coalesced_motion_timeout(void *data)
+{
+    struct kiwmi_cursor *cursor = data;
+
+    cursor_flush_motion(cursor);
+
+    return 0;
 }
 
 static void
@@ -116,6 +186,7 @@ cursor_motion_notify(struct wl_listener *listener, void *data)
     new_event.newy = cursor->cursor->y;
 
     wl_signal_emit(&cursor->events.motion, &new_event);
+    coalesce_motion(cursor, &new_event, event->delta_x, event->delta_y);
 
     process_cursor_motion(server, event->time_msec);
 }
@@ -140,6 +211,11 @@ cursor_motion_absolute_notify(struct wl_listener *listener, void *data)
     new_event.newy = cursor->cursor->y;
 
     wl_signal_emit(&cursor->events.motion, &new_event);
+    coalesce_motion(
+        cursor,
+        &new_event,
+        new_event.newx - new_event.oldx,
+        new_event.newy - new_event.oldy);
 
     process_cursor_motion(server, event->time_msec);
 }
@@ -237,6 +313,20 @@ cursor_create(
 
     cursor->xcursor_manager = wlr_xcursor_manager_create(NULL, 24);
 
+    cursor->coalesced.pending     = false;
+    cursor->coalesced.interval_ms = 0;
+    cursor->coalesced.timer       = wl_event_loop_add_timer(
+        wl_display_get_event_loop(server->wl_display),
+        coalesced_motion_timeout,
+        cursor);
+    if (!cursor->coalesced.timer) {
+        wlr_log(WLR_ERROR, "Failed to create motion timer");
+        wlr_xcursor_manager_destroy(cursor->xcursor_manager);
+        wlr_cursor_destroy(cursor->cursor);
+        free(cursor);
+        return NULL;
+    }
+
     cursor->cursor_motion.notify = cursor_motion_notify;
     wl_signal_add(&cursor->cursor->events.motion, &cursor->cursor_motion);
 
@@ -258,6 +348,7 @@ cursor_create(
     wl_signal_init(&cursor->events.button_up);
     wl_signal_init(&cursor->events.destroy);
     wl_signal_init(&cursor->events.motion);
+    wl_signal_init(&cursor->events.motion_frame);
     wl_signal_init(&cursor->events.scroll);
 
     return cursor;
@@ -268,6 +359,7 @@ cursor_destroy(struct kiwmi_cursor *cursor)
 {
     wl_signal_emit(&cursor->events.destroy, cursor);
 
+    wl_event_source_remove(cursor->coalesced.timer);
     wlr_cursor_destroy(cursor->cursor);
     wlr_xcursor_manager_destroy(cursor->xcursor_manager);
 
@@ -276,6 +368,37 @@ cursor_destroy(struct kiwmi_cursor *cursor)
     free(cursor);
 }
 
+void
+cursor_set_motion_interval(struct kiwmi_cursor *cursor, int interval_ms)
+{
+    // deliver what was collected under the old setting
+    cursor_flush_motion(cursor);
+
+    cursor->coalesced.interval_ms = interval_ms;
+}
+
+void
+cursor_flush_motion(struct kiwmi_cursor *cursor)
+{
+    if (!cursor->coalesced.pending) {
+        return;
+    }
+
+    cursor->coalesced.pending = false;
+    wl_event_source_timer_update(cursor->coalesced.timer, 0);
+
+    struct kiwmi_cursor_motion_frame_event event = {
+        .oldx = cursor->coalesced.oldx,
+        .oldy = cursor->coalesced.oldy,
+        .newx = cursor->cursor->x,
+        .newy = cursor->cursor->y,
+        .dx   = cursor->coalesced.dx,
+        .dy   = cursor->coalesced.dy,
+    };
+
+    wl_signal_emit(&cursor->events.motion_frame, &event);
+}
+
 void
 cursor_refresh_focus(
     struct kiwmi_cursor *cursor,
@@ -290,12 +413,8 @@ cursor_refresh_focus(
     double sx;
     double sy;
 
-    struct wlr_scene_node *node_at = wlr_scene_node_at(
-        &desktop->scene->tree.node,
-        cursor->cursor->x,
-        cursor->cursor->y,
-        &sx,
-        &sy);
+    struct wlr_scene_node *node_at = hit_cache_node_at(
+        desktop, cursor->cursor->x, cursor->cursor->y, &sx, &sy);
 
     if (node_at && node_at->type == WLR_SCENE_NODE_BUFFER) {
         struct wlr_scene_buffer *scene_buffer =
@@ -0,0 +1,159 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "input/keybind.h"
+
+#include <stdlib.h>
+
+#include <wlr/util/log.h>
+
+#define KEYBINDS_MIN_BUCKETS 16
+
+static size_t
+keybind_hash(uint32_t modifiers, xkb_keysym_t keysym)
+{
+    uint32_t hash = keysym * 2654435761u;
+    hash ^= modifiers * 40503u;
+    return hash ^ (hash >> 16);
+}
+
+static struct kiwmi_keybind **
+keybinds_slot(
+    const struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    xkb_keysym_t keysym)
+{
+    size_t mask  = keybinds->bucket_count - 1;
+    size_t index = keybind_hash(modifiers, keysym) & mask;
+
+    struct kiwmi_keybind **slot = &keybinds->buckets[index];
+    while (*slot) {
+        if ((*slot)->modifiers == modifiers && (*slot)->keysym == keysym) {
+            break;
+        }
+        slot = &(*slot)->next;
+    }
+
+    return slot;
+}
+
+static bool
+keybinds_resize(struct kiwmi_keybinds *keybinds, size_t bucket_count)
+{
+    struct kiwmi_keybind **buckets = calloc(bucket_count, sizeof(*buckets));
+    if (!buckets) {
+        wlr_log(WLR_ERROR, "Failed to allocate keybind table");
+        return false;
+    }
+
+    for (size_t i = 0; i < keybinds->bucket_count; ++i) {
+        struct kiwmi_keybind *keybind = keybinds->buckets[i];
+        while (keybind) {
+            struct kiwmi_keybind *next = keybind->next;
+            size_t index = keybind_hash(keybind->modifiers, keybind->keysym)
+                & (bucket_count - 1);
+            keybind->next  = buckets[index];
+            buckets[index] = keybind;
+            keybind        = next;
+        }
+    }
+
+    free(keybinds->buckets);
+    keybinds->buckets      = buckets;
+    keybinds->bucket_count = bucket_count;
+
+    return true;
+}
+
+void
+keybinds_init(struct kiwmi_keybinds *keybinds)
+{
+    keybinds->buckets      = NULL;
+    keybinds->bucket_count = 0;
+    keybinds->count        = 0;
+}
+
+void
+keybinds_fini(struct kiwmi_keybinds *keybinds)
+{
+    for (size_t i = 0; i < keybinds->bucket_count; ++i) {
+        struct kiwmi_keybind *keybind = keybinds->buckets[i];
+        while (keybind) {
+            struct kiwmi_keybind *next = keybind->next;
+            keybind->destroy(keybind);
+            keybind = next;
+        }
+    }
+
+    free(keybinds->buckets);
+    keybinds_init(keybinds);
+}
+
+bool
+keybinds_add(struct kiwmi_keybinds *keybinds, struct kiwmi_keybind *keybind)
+{
+    // keep the load factor at or below 1
+    if (keybinds->count >= keybinds->bucket_count) {
+        size_t bucket_count = keybinds->bucket_count
+            ? keybinds->bucket_count * 2
+            : KEYBINDS_MIN_BUCKETS;
+        if (!keybinds_resize(keybinds, bucket_count)) {
+            keybind->destroy(keybind);
+            return false;
+        }
+    }
+
+    struct kiwmi_keybind **slot =
+        keybinds_slot(keybinds, keybind->modifiers, keybind->keysym);
+
+    if (*slot) {
+        struct kiwmi_keybind *old = *slot;
+        keybind->next             = old->next;
+        old->destroy(old);
+    } else {
+        keybind->next = NULL;
+        ++keybinds->count;
+    }
+
+    *slot = keybind;
+
+    return true;
+}
+
+void
+keybinds_remove(
+    struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    xkb_keysym_t keysym)
+{
+    if (keybinds->count == 0) {
+        return;
+    }
+
+    struct kiwmi_keybind **slot   = keybinds_slot(keybinds, modifiers, keysym);
+    struct kiwmi_keybind *keybind = *slot;
+    if (!keybind) {
+        return;
+    }
+
+    *slot = keybind->next;
+    --keybinds->count;
+    keybind->destroy(keybind);
+}
+
+struct kiwmi_keybind *
+keybinds_find(
+    const struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    xkb_keysym_t keysym)
+{
+    if (keybinds->count == 0) {
+        return NULL;
+    }
+
+    return *keybinds_slot(keybinds, modifiers, keysym);
+}
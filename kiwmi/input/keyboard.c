@@ -14,10 +14,12 @@
 #include <wlr/backend.h>
 #include <wlr/backend/multi.h>
 #include <wlr/types/wlr_input_device.h>
+#include <wlr/types/wlr_keyboard.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/util/log.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "input/keymap.h"
 #include "input/seat.h"
 #include "server.h"
 
@@ -42,6 +44,9 @@ switch_vt(const xkb_keysym_t *syms, int nsyms, struct wlr_backend *backend)
     return false;
 }
 
+// Modifiers that shouldn't keep a keybind from matching
+#define KEYBIND_IGNORED_MODIFIERS (WLR_MODIFIER_CAPS | WLR_MODIFIER_MOD2)
+
 static void
 keyboard_modifiers_notify(struct wl_listener *listener, void *UNUSED(data))
 {
@@ -80,11 +85,31 @@ keyboard_key_notify(struct wl_listener *listener, void *data)
 
     bool handled = false;
 
-    if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+    bool pressed = event->state == WL_KEYBOARD_KEY_STATE_PRESSED;
+
+    if (pressed) {
         handled =
             switch_vt(translated_syms, translated_syms_len, server->backend);
     }
 
+    // releases still go through, to end taps and drop bound keys
+    if (!handled && (!input_inhibited || !pressed)) {
+        uint32_t modifiers = wlr_keyboard_get_modifiers(wlr_keyboard)
+            & ~KEYBIND_IGNORED_MODIFIERS;
+
+        struct kiwmi_keymap_key_event keymap_event = {
+            .keycode             = keycode,
+            .pressed             = pressed,
+            .modifiers           = modifiers,
+            .translated_syms     = translated_syms,
+            .translated_syms_len = translated_syms_len,
+            .raw_syms            = raw_syms,
+            .raw_syms_len        = raw_syms_len,
+        };
+
+        handled = keymap_handle_key(&keyboard->keymap, &keymap_event);
+    }
+
     if (!handled && !input_inhibited) {
         struct kiwmi_keyboard_key_event data = {
             .raw_syms            = raw_syms,
@@ -96,7 +121,7 @@ keyboard_key_notify(struct wl_listener *listener, void *data)
             .handled             = false,
         };
 
-        if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+        if (pressed) {
             wl_signal_emit(&keyboard->events.key_down, &data);
         } else {
             wl_signal_emit(&keyboard->events.key_up, &data);
@@ -137,6 +162,12 @@ keyboard_create(struct kiwmi_server *server, struct wlr_keyboard *wlr_keyboard)
     keyboard->server       = server;
     keyboard->wlr_keyboard = wlr_keyboard;
 
+    struct wl_event_loop *loop = wl_display_get_event_loop(server->wl_display);
+    if (!keymap_init(&keyboard->keymap, keyboard, loop)) {
+        free(keyboard);
+        return NULL;
+    }
+
     keyboard->modifiers.notify = keyboard_modifiers_notify;
     wl_signal_add(&wlr_keyboard->events.modifiers, &keyboard->modifiers);
 
@@ -180,5 +211,7 @@ keyboard_destroy(struct kiwmi_keyboard *keyboard)
 
     wl_list_remove(&keyboard->events.destroy.listener_list);
 
+    keymap_fini(&keyboard->keymap);
+
     free(keyboard);
 }
@@ -0,0 +1,496 @@
+/* Copyright (c), Niclas Meyer <niclas@countingsort.com>
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this file,
+ * You can obtain one at https://mozilla.org/MPL/2.0/.
+ */
+
+#include "input/keymap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server.h>
+#include <wlr/util/log.h>
+#include <xkbcommon/xkbcommon.h>
+
+#include "input/keybind.h"
+
+#define KEYMAP_CHORD_TIMEOUT_MS 1000
+
+static bool
+is_modifier_keysym(xkb_keysym_t sym)
+{
+    return (sym >= XKB_KEY_Shift_L && sym <= XKB_KEY_Hyper_R)
+        || (sym >= XKB_KEY_ISO_Lock && sym <= XKB_KEY_ISO_Last_Group_Lock);
+}
+
+static void
+add_bound_keycode(struct kiwmi_keymap *keymap, uint32_t keycode)
+{
+    if (keymap->bound_keycodes_len < KIWMI_KEYMAP_BOUND_KEYS_CAP) {
+        keymap->bound_keycodes[keymap->bound_keycodes_len++] = keycode;
+    }
+}
+
+static bool
+remove_bound_keycode(struct kiwmi_keymap *keymap, uint32_t keycode)
+{
+    for (size_t i = 0; i < keymap->bound_keycodes_len; ++i) {
+        if (keymap->bound_keycodes[i] == keycode) {
+            keymap->bound_keycodes[i] =
+                keymap->bound_keycodes[--keymap->bound_keycodes_len];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void
+cancel_chord(struct kiwmi_keymap *keymap)
+{
+    keymap->chord = NULL;
+    wl_event_source_timer_update(keymap->chord_timer, 0);
+}
+
+static int
+handle_chord_timeout(void *data)
+{
+    struct kiwmi_keymap *keymap = data;
+    keymap->chord               = NULL;
+    return 0;
+}
+
+static void
+cancel_tap(struct kiwmi_keymap *keymap)
+{
+    keymap->tap      = NULL;
+    keymap->tap_held = false;
+    wl_event_source_timer_update(keymap->tap_timer, 0);
+}
+
+static int
+handle_tap_timeout(void *data)
+{
+    struct kiwmi_keymap *keymap  = data;
+    struct kiwmi_keymap_tap *tap = keymap->tap;
+
+    if (tap && !keymap->tap_held) {
+        keymap->tap_held = true;
+        tap->handler(tap, keymap->keyboard, KIWMI_KEYMAP_HOLD);
+    }
+
+    return 0;
+}
+
+static struct kiwmi_keymap_tap *
+find_tap(struct kiwmi_keymap *keymap, const xkb_keysym_t *syms, int nsyms)
+{
+    struct kiwmi_keymap_tap *tap;
+    wl_list_for_each (tap, &keymap->taps, link) {
+        for (int i = 0; i < nsyms; ++i) {
+            if (tap->keysym == syms[i]) {
+                return tap;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static struct kiwmi_keybind *
+find_keybind(
+    struct kiwmi_keybinds *keybinds,
+    uint32_t modifiers,
+    const xkb_keysym_t *syms,
+    int nsyms)
+{
+    for (int i = 0; i < nsyms; ++i) {
+        struct kiwmi_keybind *keybind =
+            keybinds_find(keybinds, modifiers, syms[i]);
+        if (keybind) {
+            return keybind;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+prefix_destroy(struct kiwmi_keybind *keybind)
+{
+    keybinds_fini(keybind->children);
+    free(keybind->children);
+    free(keybind);
+}
+
+static struct kiwmi_keybind *
+prefix_create(const struct kiwmi_keymap_step *step)
+{
+    struct kiwmi_keybind *prefix = malloc(sizeof(*prefix));
+    if (!prefix) {
+        wlr_log(WLR_ERROR, "Failed to allocate chord prefix");
+        return NULL;
+    }
+
+    prefix->children = malloc(sizeof(*prefix->children));
+    if (!prefix->children) {
+        wlr_log(WLR_ERROR, "Failed to allocate chord prefix");
+        free(prefix);
+        return NULL;
+    }
+
+    keybinds_init(prefix->children);
+    prefix->modifiers = step->modifiers;
+    prefix->keysym    = step->keysym;
+    prefix->handler   = NULL;
+    prefix->destroy   = prefix_destroy;
+
+    return prefix;
+}
+
+static struct kiwmi_keymap_mode *
+get_mode(struct kiwmi_keymap *keymap, const char *name)
+{
+    struct kiwmi_keymap_mode *mode;
+    wl_list_for_each (mode, &keymap->modes, link) {
+        if (strcmp(mode->name, name) == 0) {
+            return mode;
+        }
+    }
+
+    mode = malloc(sizeof(*mode));
+    if (!mode) {
+        wlr_log(WLR_ERROR, "Failed to allocate keymap mode");
+        return NULL;
+    }
+
+    mode->name = strdup(name);
+    if (!mode->name) {
+        wlr_log(WLR_ERROR, "Failed to allocate keymap mode");
+        free(mode);
+        return NULL;
+    }
+
+    keybinds_init(&mode->keybinds);
+    wl_list_insert(keymap->modes.prev, &mode->link);
+
+    return mode;
+}
+
+static void
+mode_destroy(struct kiwmi_keymap_mode *mode)
+{
+    keybinds_fini(&mode->keybinds);
+    wl_list_remove(&mode->link);
+    free(mode->name);
+    free(mode);
+}
+
+static void
+handle_tap(
+    struct kiwmi_keymap *keymap,
+    const struct kiwmi_keymap_key_event *event)
+{
+    if (!event->pressed) {
+        if (!keymap->tap || event->keycode != keymap->tap_keycode) {
+            return;
+        }
+
+        struct kiwmi_keymap_tap *tap = keymap->tap;
+        bool held                    = keymap->tap_held;
+        cancel_tap(keymap);
+
+        tap->handler(
+            tap,
+            keymap->keyboard,
+            held ? KIWMI_KEYMAP_RELEASE : KIWMI_KEYMAP_TAP);
+        return;
+    }
+
+    // another key while the tap key is down makes it a plain modifier
+    if (keymap->tap) {
+        if (!keymap->tap_held) {
+            cancel_tap(keymap);
+        }
+        return;
+    }
+
+    struct kiwmi_keymap_tap *tap = find_tap(
+        keymap, event->translated_syms, event->translated_syms_len);
+    if (!tap) {
+        tap = find_tap(keymap, event->raw_syms, event->raw_syms_len);
+    }
+
+    if (!tap) {
+        return;
+    }
+
+    keymap->tap         = tap;
+    keymap->tap_keycode = event->keycode;
+    keymap->tap_held    = false;
+    if (tap->timeout_ms > 0) {
+        wl_event_source_timer_update(keymap->tap_timer, tap->timeout_ms);
+    } else {
+        // no tap to wait for, it's held as soon as it's down
+        keymap->tap_held = true;
+        tap->handler(tap, keymap->keyboard, KIWMI_KEYMAP_HOLD);
+    }
+}
+
+bool
+keymap_handle_key(
+    struct kiwmi_keymap *keymap,
+    const struct kiwmi_keymap_key_event *event)
+{
+    // the tap key itself is always sent on, it usually is a modifier
+    handle_tap(keymap, event);
+
+    if (!event->pressed) {
+        return remove_bound_keycode(keymap, event->keycode);
+    }
+
+    struct kiwmi_keybinds *keybinds =
+        keymap->chord ? keymap->chord : &keymap->mode->keybinds;
+    if (keybinds->count == 0) {
+        return false;
+    }
+
+    // translated first, so that a binding on e.g. "exclam" beats "1"
+    struct kiwmi_keybind *keybind = find_keybind(
+        keybinds,
+        event->modifiers,
+        event->translated_syms,
+        event->translated_syms_len);
+    if (!keybind) {
+        keybind = find_keybind(
+            keybinds, event->modifiers, event->raw_syms, event->raw_syms_len);
+    }
+    if (!keybind) {
+        keybind = keybinds_find(
+            keybinds,
+            event->modifiers,
+            KIWMI_KEYBIND_KEYCODE | event->keycode);
+    }
+
+    if (!keybind) {
+        if (!keymap->chord) {
+            return false;
+        }
+
+        // modifiers are part of the next step
+        for (int i = 0; i < event->translated_syms_len; ++i) {
+            if (is_modifier_keysym(event->translated_syms[i])) {
+                return false;
+            }
+        }
+
+        // any other key ends the chord and isn't sent on
+        cancel_chord(keymap);
+        add_bound_keycode(keymap, event->keycode);
+        return true;
+    }
+
+    add_bound_keycode(keymap, event->keycode);
+
+    if (keybind->children) {
+        keymap->chord = keybind->children;
+        wl_event_source_timer_update(
+            keymap->chord_timer, keymap->chord_timeout_ms);
+        return true;
+    }
+
+    cancel_chord(keymap);
+    keybind->handler(keybind, keymap->keyboard);
+
+    return true;
+}
+
+bool
+keymap_init(
+    struct kiwmi_keymap *keymap,
+    struct kiwmi_keyboard *keyboard,
+    struct wl_event_loop *loop)
+{
+    keymap->keyboard           = keyboard;
+    keymap->chord              = NULL;
+    keymap->chord_timeout_ms   = KEYMAP_CHORD_TIMEOUT_MS;
+    keymap->tap                = NULL;
+    keymap->tap_keycode        = 0;
+    keymap->tap_held           = false;
+    keymap->bound_keycodes_len = 0;
+
+    wl_list_init(&keymap->modes);
+    wl_list_init(&keymap->taps);
+
+    keymap->mode = get_mode(keymap, KIWMI_KEYMAP_DEFAULT_MODE);
+    if (!keymap->mode) {
+        return false;
+    }
+
+    keymap->chord_timer =
+        wl_event_loop_add_timer(loop, handle_chord_timeout, keymap);
+    if (!keymap->chord_timer) {
+        wlr_log(WLR_ERROR, "Failed to create chord timer");
+        mode_destroy(keymap->mode);
+        return false;
+    }
+
+    keymap->tap_timer =
+        wl_event_loop_add_timer(loop, handle_tap_timeout, keymap);
+    if (!keymap->tap_timer) {
+        wlr_log(WLR_ERROR, "Failed to create tap timer");
+        wl_event_source_remove(keymap->chord_timer);
+        mode_destroy(keymap->mode);
+        return false;
+    }
+
+    return true;
+}
+
+void
+keymap_fini(struct kiwmi_keymap *keymap)
+{
+    wl_event_source_remove(keymap->chord_timer);
+    wl_event_source_remove(keymap->tap_timer);
+    keymap->chord = NULL;
+    keymap->tap   = NULL;
+
+    struct kiwmi_keymap_tap *tap;
+    struct kiwmi_keymap_tap *tmp_tap;
+    wl_list_for_each_safe (tap, tmp_tap, &keymap->taps, link) {
+        wl_list_remove(&tap->link);
+        tap->destroy(tap);
+    }
+
+    struct kiwmi_keymap_mode *mode;
+    struct kiwmi_keymap_mode *tmp_mode;
+    wl_list_for_each_safe (mode, tmp_mode, &keymap->modes, link) {
+        mode_destroy(mode);
+    }
+    keymap->mode = NULL;
+}
+
+bool
+keymap_bind(
+    struct kiwmi_keymap *keymap,
+    const char *mode_name,
+    const struct kiwmi_keymap_step *steps,
+    size_t steps_len,
+    struct kiwmi_keybind *keybind)
+{
+    // the tables are about to change
+    cancel_chord(keymap);
+
+    struct kiwmi_keymap_mode *mode = get_mode(keymap, mode_name);
+    if (!mode || steps_len == 0) {
+        keybind->destroy(keybind);
+        return false;
+    }
+
+    struct kiwmi_keybinds *keybinds = &mode->keybinds;
+    for (size_t i = 0; i + 1 < steps_len; ++i) {
+        struct kiwmi_keybind *prefix =
+            keybinds_find(keybinds, steps[i].modifiers, steps[i].keysym);
+
+        // a shorter binding on the same keys is replaced
+        if (!prefix || !prefix->children) {
+            prefix = prefix_create(&steps[i]);
+            if (!prefix || !keybinds_add(keybinds, prefix)) {
+                keybind->destroy(keybind);
+                return false;
+            }
+        }
+
+        keybinds = prefix->children;
+    }
+
+    keybind->modifiers = steps[steps_len - 1].modifiers;
+    keybind->keysym    = steps[steps_len - 1].keysym;
+    keybind->children  = NULL;
+
+    return keybinds_add(keybinds, keybind);
+}
+
+static void
+unbind_steps(
+    struct kiwmi_keybinds *keybinds,
+    const struct kiwmi_keymap_step *steps,
+    size_t steps_len)
+{
+    if (steps_len == 1) {
+        keybinds_remove(keybinds, steps[0].modifiers, steps[0].keysym);
+        return;
+    }
+
+    struct kiwmi_keybind *prefix =
+        keybinds_find(keybinds, steps[0].modifiers, steps[0].keysym);
+    if (!prefix || !prefix->children) {
+        return;
+    }
+
+    unbind_steps(prefix->children, steps + 1, steps_len - 1);
+
+    // a chord without continuations would swallow its first key for nothing
+    if (prefix->children->count == 0) {
+        keybinds_remove(keybinds, steps[0].modifiers, steps[0].keysym);
+    }
+}
+
+void
+keymap_unbind(
+    struct kiwmi_keymap *keymap,
+    const char *mode_name,
+    const struct kiwmi_keymap_step *steps,
+    size_t steps_len)
+{
+    cancel_chord(keymap);
+
+    struct kiwmi_keymap_mode *mode;
+    wl_list_for_each (mode, &keymap->modes, link) {
+        if (strcmp(mode->name, mode_name) == 0) {
+            if (steps_len > 0) {
+                unbind_steps(&mode->keybinds, steps, steps_len);
+            }
+            return;
+        }
+    }
+}
+
+bool
+keymap_set_mode(struct kiwmi_keymap *keymap, const char *mode_name)
+{
+    struct kiwmi_keymap_mode *mode = get_mode(keymap, mode_name);
+    if (!mode) {
+        return false;
+    }
+
+    cancel_chord(keymap);
+    keymap->mode = mode;
+
+    return true;
+}
+
+void
+keymap_add_tap(struct kiwmi_keymap *keymap, struct kiwmi_keymap_tap *tap)
+{
+    keymap_remove_tap(keymap, tap->keysym);
+    wl_list_insert(keymap->taps.prev, &tap->link);
+}
+
+void
+keymap_remove_tap(struct kiwmi_keymap *keymap, xkb_keysym_t keysym)
+{
+    struct kiwmi_keymap_tap *tap;
+    wl_list_for_each (tap, &keymap->taps, link) {
+        if (tap->keysym == keysym) {
+            if (keymap->tap == tap) {
+                cancel_tap(keymap);
+            }
+            wl_list_remove(&tap->link);
+            tap->destroy(tap);
+            return;
+        }
+    }
+}
@@ -70,14 +70,18 @@ seat_focus_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
 {
     if (!view) {
         seat_focus_surface(seat, NULL);
-        seat->focused_view = NULL;
+        if (seat->focused_view) {
+            seat->focused_view = NULL;
+            wl_signal_emit(&seat->events.focus_change, NULL);
+        }
         return;
     }
 
     struct kiwmi_desktop *desktop = view->desktop;
+    struct kiwmi_view *old_view   = seat->focused_view;
 
-    if (seat->focused_view) {
-        view_set_activated(seat->focused_view, false);
+    if (old_view) {
+        view_set_activated(old_view, false);
     }
 
     // move view to front
@@ -87,11 +91,79 @@ seat_focus_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
     wlr_scene_node_raise_to_top(&view->desktop_surface.tree->node);
     wlr_scene_node_raise_to_top(&view->desktop_surface.popups_tree->node);
 
-    cursor_refresh_focus(seat->input->cursor, NULL, NULL, NULL);
-
     seat->focused_view = view;
     view_set_activated(view, true);
     seat_focus_surface(seat, view->wlr_surface);
+
+    // after the focus is set, so that following the mouse doesn't nest
+    cursor_refresh_focus(seat->input->cursor, NULL, NULL, NULL);
+
+    if (view != old_view && seat->focused_view == view) {
+        wl_signal_emit(&seat->events.focus_change, view);
+    }
+}
+
+void
+seat_forget_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
+{
+    if (!view) {
+        return;
+    }
+
+    if (seat->follow_mouse.hovered == view) {
+        seat->follow_mouse.hovered = NULL;
+        wl_event_source_timer_update(seat->follow_mouse.timer, 0);
+    }
+
+    if (seat->focused_view == view) {
+        seat->focused_view = NULL;
+        wl_signal_emit(&seat->events.focus_change, NULL);
+    }
+}
+
+void
+seat_hover_view(struct kiwmi_seat *seat, struct kiwmi_view *view)
+{
+    if (seat->follow_mouse.hovered == view) {
+        return;
+    }
+
+    seat->follow_mouse.hovered = view;
+    wl_event_source_timer_update(seat->follow_mouse.timer, 0);
+
+    if (!seat->follow_mouse.enabled || !view || view == seat->focused_view) {
+        return;
+    }
+
+    if (seat->follow_mouse.delay_ms > 0) {
+        wl_event_source_timer_update(
+            seat->follow_mouse.timer, seat->follow_mouse.delay_ms);
+        return;
+    }
+
+    seat_focus_view(seat, view);
+}
+
+static int
+follow_mouse_timeout(void *data)
+{
+    struct kiwmi_seat *seat = data;
+    struct kiwmi_view *view = seat->follow_mouse.hovered;
+
+    if (seat->follow_mouse.enabled && view && view != seat->focused_view) {
+        seat_focus_view(seat, view);
+    }
+
+    return 0;
+}
+
+void
+seat_set_follow_mouse(struct kiwmi_seat *seat, bool enabled, int delay_ms)
+{
+    seat->follow_mouse.enabled  = enabled;
+    seat->follow_mouse.delay_ms = delay_ms;
+
+    wl_event_source_timer_update(seat->follow_mouse.timer, 0);
 }
 
 void
@@ -183,6 +255,20 @@ seat_create(struct kiwmi_input *input)
     seat->focused_layer    = NULL;
     seat->exclusive_client = NULL;
 
+    seat->follow_mouse.enabled  = false;
+    seat->follow_mouse.delay_ms = 0;
+    seat->follow_mouse.hovered  = NULL;
+    seat->follow_mouse.timer    = wl_event_loop_add_timer(
+        server->wl_event_loop, follow_mouse_timeout, seat);
+    if (!seat->follow_mouse.timer) {
+        wlr_log(WLR_ERROR, "Failed to create follow mouse timer");
+        wlr_seat_destroy(seat->seat);
+        free(seat);
+        return NULL;
+    }
+
+    wl_signal_init(&seat->events.focus_change);
+
     seat->request_set_cursor.notify = request_set_cursor_notify;
     wl_signal_add(
         &seat->seat->events.request_set_cursor, &seat->request_set_cursor);
@@ -208,5 +294,7 @@ seat_destroy(struct kiwmi_seat *seat)
     wl_list_remove(&seat->request_set_selection.link);
     wl_list_remove(&seat->request_set_primary_selection.link);
 
+    wl_event_source_remove(seat->follow_mouse.timer);
+
     free(seat);
 }
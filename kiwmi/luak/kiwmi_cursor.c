@@ -62,6 +62,24 @@ l_kiwmi_cursor_pos(lua_State *L)
     return 2;
 }
 
+static int
+l_kiwmi_cursor_set_motion_interval(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_cursor");
+    int interval = luaL_checkinteger(L, 2);
+
+    if (interval < 0) {
+        return luaL_argerror(L, 2, "must not be negative");
+    }
+
+    struct kiwmi_cursor *cursor = obj->object;
+
+    cursor_set_motion_interval(cursor, interval);
+
+    return 0;
+}
+
 static int
 l_kiwmi_cursor_view_at_pos(lua_State *L)
 {
@@ -94,6 +112,7 @@ static const luaL_Reg kiwmi_cursor_methods[] = {
     {"on", luaK_callback_register_dispatch},
     {"output_at_pos", l_kiwmi_cursor_output_at_pos},
     {"pos", l_kiwmi_cursor_pos},
+    {"set_motion_interval", l_kiwmi_cursor_set_motion_interval},
     {"view_at_pos", l_kiwmi_cursor_view_at_pos},
     {NULL, NULL},
 };
@@ -152,6 +171,42 @@ kiwmi_cursor_on_motion_notify(struct wl_listener *listener, void *data)
     }
 }
 
+static void
+kiwmi_cursor_on_motion_frame_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_lua_callback *lc = wl_container_of(listener, lc, listener);
+    struct kiwmi_server *server   = lc->server;
+    lua_State *L                  = server->lua->L;
+    struct kiwmi_cursor_motion_frame_event *event = data;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+
+    lua_newtable(L);
+
+    lua_pushnumber(L, event->oldx);
+    lua_setfield(L, -2, "oldx");
+
+    lua_pushnumber(L, event->oldy);
+    lua_setfield(L, -2, "oldy");
+
+    lua_pushnumber(L, event->newx);
+    lua_setfield(L, -2, "newx");
+
+    lua_pushnumber(L, event->newy);
+    lua_setfield(L, -2, "newy");
+
+    lua_pushnumber(L, event->dx);
+    lua_setfield(L, -2, "dx");
+
+    lua_pushnumber(L, event->dy);
+    lua_setfield(L, -2, "dy");
+
+    if (lua_pcall(L, 1, 0, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
 static void
 kiwmi_cursor_on_scroll_notify(struct wl_listener *listener, void *data)
 {
@@ -257,6 +312,31 @@ l_kiwmi_cursor_on_motion(lua_State *L)
     return 0;
 }
 
+static int
+l_kiwmi_cursor_on_motion_frame(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_cursor");
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    struct kiwmi_cursor *cursor = obj->object;
+    struct kiwmi_server *server = cursor->server;
+
+    lua_pushcfunction(L, luaK_kiwmi_lua_callback_new);
+    lua_pushlightuserdata(L, server);
+    lua_pushvalue(L, 2);
+    lua_pushlightuserdata(L, kiwmi_cursor_on_motion_frame_notify);
+    lua_pushlightuserdata(L, &cursor->events.motion_frame);
+    lua_pushlightuserdata(L, obj);
+
+    if (lua_pcall(L, 5, 0, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        return 0;
+    }
+
+    return 0;
+}
+
 static int
 l_kiwmi_cursor_on_scroll(lua_State *L)
 {
@@ -286,6 +366,7 @@ static const luaL_Reg kiwmi_cursor_events[] = {
     {"button_down", l_kiwmi_cursor_on_button_down},
     {"button_up", l_kiwmi_cursor_on_button_up},
     {"motion", l_kiwmi_cursor_on_motion},
+    {"motion_frame", l_kiwmi_cursor_on_motion_frame},
     {"scroll", l_kiwmi_cursor_on_scroll},
     {NULL, NULL},
 };
@@ -9,6 +9,8 @@
 
 #include <lua.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <lauxlib.h>
 #include <wayland-server.h>
@@ -20,6 +22,448 @@
 #include "input/keyboard.h"
 #include "luak/kiwmi_lua_callback.h"
 
+static const struct {
+    const char *name;
+    enum wlr_keyboard_modifier modifier;
+} modifier_names[] = {
+    {"shift", WLR_MODIFIER_SHIFT},
+    {"caps", WLR_MODIFIER_CAPS},
+    {"ctrl", WLR_MODIFIER_CTRL},
+    {"alt", WLR_MODIFIER_ALT},
+    {"mod2", WLR_MODIFIER_MOD2},
+    {"mod3", WLR_MODIFIER_MOD3},
+    {"super", WLR_MODIFIER_LOGO},
+    {"mod5", WLR_MODIFIER_MOD5},
+};
+
+#define KEYBOARD_CHORD_MAX_STEPS 8
+#define KEYBOARD_TAP_TIMEOUT_MS 200
+
+struct kiwmi_lua_keybind {
+    struct kiwmi_keybind base;
+    struct kiwmi_server *server;
+    int callback_ref;
+};
+
+struct kiwmi_lua_tap {
+    struct kiwmi_keymap_tap base;
+    struct kiwmi_server *server;
+    int tap_ref;
+    int hold_ref;
+    int release_ref;
+};
+
+// Calls the function in the registry with the keyboard as argument
+static void
+call_with_keyboard(
+    struct kiwmi_server *server,
+    int ref,
+    struct kiwmi_keyboard *keyboard)
+{
+    lua_State *L = server->lua->L;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+
+    lua_pushcfunction(L, luaK_kiwmi_keyboard_new);
+    lua_pushlightuserdata(L, server->lua);
+    lua_pushlightuserdata(L, keyboard);
+    if (lua_pcall(L, 2, 1, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 2);
+        return;
+    }
+
+    if (lua_pcall(L, 1, 0, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static void
+lua_keybind_handler(
+    struct kiwmi_keybind *keybind,
+    struct kiwmi_keyboard *keyboard)
+{
+    struct kiwmi_lua_keybind *lk = wl_container_of(keybind, lk, base);
+
+    // the callback may rebind its own key, don't touch lk after the call
+    call_with_keyboard(lk->server, lk->callback_ref, keyboard);
+}
+
+static void
+lua_keybind_destroy(struct kiwmi_keybind *keybind)
+{
+    struct kiwmi_lua_keybind *lk = wl_container_of(keybind, lk, base);
+
+    luaL_unref(lk->server->lua->L, LUA_REGISTRYINDEX, lk->callback_ref);
+    free(lk);
+}
+
+static struct kiwmi_keybind *
+lua_keybind_create(lua_State *L, struct kiwmi_keyboard *keyboard, int idx)
+{
+    luaL_checktype(L, idx, LUA_TFUNCTION);
+
+    struct kiwmi_lua_keybind *lk = malloc(sizeof(*lk));
+    if (!lk) {
+        luaL_error(L, "failed to allocate keybind");
+        return NULL;
+    }
+
+    lk->base.handler = lua_keybind_handler;
+    lk->base.destroy = lua_keybind_destroy;
+    lk->server       = keyboard->server;
+
+    lua_pushvalue(L, idx);
+    lk->callback_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    return &lk->base;
+}
+
+static void
+lua_tap_handler(
+    struct kiwmi_keymap_tap *tap,
+    struct kiwmi_keyboard *keyboard,
+    enum kiwmi_keymap_tap_event event)
+{
+    struct kiwmi_lua_tap *lt = wl_container_of(tap, lt, base);
+
+    int ref = LUA_NOREF;
+    switch (event) {
+    case KIWMI_KEYMAP_TAP:
+        ref = lt->tap_ref;
+        break;
+    case KIWMI_KEYMAP_HOLD:
+        ref = lt->hold_ref;
+        break;
+    case KIWMI_KEYMAP_RELEASE:
+        ref = lt->release_ref;
+        break;
+    }
+
+    if (ref != LUA_NOREF) {
+        call_with_keyboard(lt->server, ref, keyboard);
+    }
+}
+
+static void
+lua_tap_destroy(struct kiwmi_keymap_tap *tap)
+{
+    struct kiwmi_lua_tap *lt = wl_container_of(tap, lt, base);
+    lua_State *L             = lt->server->lua->L;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, lt->tap_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lt->hold_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, lt->release_ref);
+    free(lt);
+}
+
+static int
+get_function_ref(lua_State *L, int idx, const char *key)
+{
+    lua_getfield(L, idx, key);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return LUA_NOREF;
+    }
+
+    luaL_checktype(L, -1, LUA_TFUNCTION);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static bool
+modifier_from_name(const char *name, size_t len, uint32_t *modifier)
+{
+    for (size_t i = 0; i < sizeof(modifier_names) / sizeof(*modifier_names);
+         ++i) {
+        if (strlen(modifier_names[i].name) == len
+            && strncmp(name, modifier_names[i].name, len) == 0) {
+            *modifier = modifier_names[i].modifier;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint32_t
+check_modifiers(lua_State *L, int idx)
+{
+    if (lua_isnoneornil(L, idx)) {
+        return 0;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    uint32_t modifiers = 0;
+
+    size_t len = lua_objlen(L, idx);
+    for (size_t i = 1; i <= len; ++i) {
+        lua_rawgeti(L, idx, i);
+
+        size_t name_len;
+        const char *name = luaL_checklstring(L, -1, &name_len);
+
+        uint32_t modifier;
+        if (!modifier_from_name(name, name_len, &modifier)) {
+            return luaL_argerror(L, idx, "unknown modifier");
+        }
+        modifiers |= modifier;
+
+        lua_pop(L, 1);
+    }
+
+    return modifiers;
+}
+
+static xkb_keysym_t
+keysym_from_name(const char *name)
+{
+    xkb_keysym_t keysym = xkb_keysym_from_name(name, XKB_KEYSYM_NO_FLAGS);
+    if (keysym == XKB_KEY_NoSymbol) {
+        keysym = xkb_keysym_from_name(name, XKB_KEYSYM_CASE_INSENSITIVE);
+    }
+    return keysym;
+}
+
+// Parses "super+shift+x" (the key comes last)
+static bool
+parse_step(const char *spec, struct kiwmi_keymap_step *step)
+{
+    step->modifiers = 0;
+
+    const char *plus;
+    while ((plus = strchr(spec, '+')) && plus[1] != '\0') {
+        uint32_t modifier;
+        if (!modifier_from_name(spec, plus - spec, &modifier)) {
+            return false;
+        }
+        step->modifiers |= modifier;
+        spec = plus + 1;
+    }
+
+    step->keysym = keysym_from_name(spec);
+    return step->keysym != XKB_KEY_NoSymbol;
+}
+
+// The `mode` field of an optional options table
+static const char *
+check_mode(lua_State *L, int idx)
+{
+    if (lua_isnoneornil(L, idx)) {
+        return KIWMI_KEYMAP_DEFAULT_MODE;
+    }
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    // still referenced by the options table after the pop
+    lua_getfield(L, idx, "mode");
+    const char *mode = luaL_optstring(L, -1, KIWMI_KEYMAP_DEFAULT_MODE);
+    lua_pop(L, 1);
+
+    return mode;
+}
+
+static int
+l_kiwmi_keyboard_bind(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+    uint32_t modifiers = check_modifiers(L, 2);
+    const char *mode   = check_mode(L, 5);
+
+    struct kiwmi_keymap_step step = {
+        .modifiers = modifiers,
+    };
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+        lua_Integer keycode = lua_tointeger(L, 3);
+        if (keycode < 0 || keycode >= KIWMI_KEYBIND_KEYCODE) {
+            return luaL_argerror(L, 3, "invalid keycode");
+        }
+        step.keysym = KIWMI_KEYBIND_KEYCODE | keycode;
+    } else {
+        step.keysym = keysym_from_name(luaL_checkstring(L, 3));
+        if (step.keysym == XKB_KEY_NoSymbol) {
+            return luaL_argerror(L, 3, "unknown keysym");
+        }
+    }
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    if (lua_isnoneornil(L, 4)) {
+        keymap_unbind(&keyboard->keymap, mode, &step, 1);
+        return 0;
+    }
+
+    struct kiwmi_keybind *keybind = lua_keybind_create(L, keyboard, 4);
+    if (!keymap_bind(&keyboard->keymap, mode, &step, 1, keybind)) {
+        return luaL_error(L, "failed to add keybind");
+    }
+
+    return 0;
+}
+
+static int
+l_kiwmi_keyboard_bind_chord(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const char *mode = check_mode(L, 4);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    struct kiwmi_keymap_step steps[KEYBOARD_CHORD_MAX_STEPS];
+    size_t steps_len = lua_objlen(L, 2);
+    if (steps_len == 0 || steps_len > KEYBOARD_CHORD_MAX_STEPS) {
+        return luaL_argerror(L, 2, "expected 1 to 8 steps");
+    }
+
+    for (size_t i = 0; i < steps_len; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!parse_step(luaL_checkstring(L, -1), &steps[i])) {
+            return luaL_argerror(L, 2, "invalid step");
+        }
+        lua_pop(L, 1);
+    }
+
+    if (lua_isnoneornil(L, 3)) {
+        keymap_unbind(&keyboard->keymap, mode, steps, steps_len);
+        return 0;
+    }
+
+    struct kiwmi_keybind *keybind = lua_keybind_create(L, keyboard, 3);
+    if (!keymap_bind(&keyboard->keymap, mode, steps, steps_len, keybind)) {
+        return luaL_error(L, "failed to add keybind");
+    }
+
+    return 0;
+}
+
+static int
+l_kiwmi_keyboard_mode(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    lua_pushstring(L, keyboard->keymap.mode->name);
+
+    return 1;
+}
+
+static int
+l_kiwmi_keyboard_set_chord_timeout(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+    int timeout = luaL_checkinteger(L, 2);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    if (timeout <= 0) {
+        return luaL_argerror(L, 2, "must be positive");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    keyboard->keymap.chord_timeout_ms = timeout;
+
+    return 0;
+}
+
+static int
+l_kiwmi_keyboard_set_mode(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+    const char *mode = luaL_checkstring(L, 2);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    if (!keymap_set_mode(&keyboard->keymap, mode)) {
+        return luaL_error(L, "failed to switch mode");
+    }
+
+    return 0;
+}
+
+static int
+l_kiwmi_keyboard_tap(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_keyboard");
+    const char *key = luaL_checkstring(L, 2);
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_keyboard no longer valid");
+    }
+
+    struct kiwmi_keyboard *keyboard = obj->object;
+
+    xkb_keysym_t keysym = keysym_from_name(key);
+    if (keysym == XKB_KEY_NoSymbol) {
+        return luaL_argerror(L, 2, "unknown keysym");
+    }
+
+    if (lua_isnoneornil(L, 3)) {
+        keymap_remove_tap(&keyboard->keymap, keysym);
+        return 0;
+    }
+
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    lua_getfield(L, 3, "timeout");
+    int timeout = luaL_optinteger(L, -1, KEYBOARD_TAP_TIMEOUT_MS);
+    lua_pop(L, 1);
+
+    if (timeout < 0) {
+        return luaL_argerror(L, 3, "timeout must not be negative");
+    }
+
+    struct kiwmi_lua_tap *lt = malloc(sizeof(*lt));
+    if (!lt) {
+        return luaL_error(L, "failed to allocate tap");
+    }
+
+    lt->base.keysym     = keysym;
+    lt->base.timeout_ms = timeout;
+    lt->base.handler    = lua_tap_handler;
+    lt->base.destroy    = lua_tap_destroy;
+    lt->server          = keyboard->server;
+    lt->tap_ref         = LUA_NOREF;
+    lt->hold_ref        = LUA_NOREF;
+    lt->release_ref     = LUA_NOREF;
+
+    // added first, so that a type error doesn't leak it
+    keymap_add_tap(&keyboard->keymap, &lt->base);
+
+    lt->tap_ref     = get_function_ref(L, 3, "tap");
+    lt->hold_ref    = get_function_ref(L, 3, "hold");
+    lt->release_ref = get_function_ref(L, 3, "release");
+
+    return 0;
+}
+
 static int
 l_kiwmi_keyboard_keymap(lua_State *L)
 {
@@ -87,37 +531,25 @@ l_kiwmi_keyboard_modifiers(lua_State *L)
 
     lua_newtable(L);
 
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_SHIFT);
-    lua_setfield(L, -2, "shift");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_CAPS);
-    lua_setfield(L, -2, "caps");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_CTRL);
-    lua_setfield(L, -2, "ctrl");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_ALT);
-    lua_setfield(L, -2, "alt");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_MOD2);
-    lua_setfield(L, -2, "mod2");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_MOD3);
-    lua_setfield(L, -2, "mod3");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_LOGO);
-    lua_setfield(L, -2, "super");
-
-    lua_pushboolean(L, modifiers & WLR_MODIFIER_MOD5);
-    lua_setfield(L, -2, "mod5");
+    for (size_t i = 0; i < sizeof(modifier_names) / sizeof(*modifier_names);
+         ++i) {
+        lua_pushboolean(L, modifiers & modifier_names[i].modifier);
+        lua_setfield(L, -2, modifier_names[i].name);
+    }
 
     return 1;
 }
 
 static const luaL_Reg kiwmi_keyboard_methods[] = {
+    {"bind", l_kiwmi_keyboard_bind},
+    {"bind_chord", l_kiwmi_keyboard_bind_chord},
     {"keymap", l_kiwmi_keyboard_keymap},
+    {"mode", l_kiwmi_keyboard_mode},
     {"modifiers", l_kiwmi_keyboard_modifiers},
     {"on", luaK_callback_register_dispatch},
+    {"set_chord_timeout", l_kiwmi_keyboard_set_chord_timeout},
+    {"set_mode", l_kiwmi_keyboard_set_mode},
+    {"tap", l_kiwmi_keyboard_tap},
     {NULL, NULL},
 };
 
@@ -90,10 +90,61 @@ set_color(lua_State *L)
     return 0;
 }
 
+// Moves the node, and resizes it if it's a rect and both sizes are >= 0
+bool
+scene_node_set_geometry(
+    struct wlr_scene_node *node,
+    int x,
+    int y,
+    int width,
+    int height)
+{
+    bool resize = width >= 0 && height >= 0;
+    if (resize && node->type != WLR_SCENE_NODE_RECT) {
+        return false;
+    }
+
+    wlr_scene_node_set_position(node, x, y);
+    if (resize) {
+        struct wlr_scene_rect *rect = wl_container_of(node, rect, node);
+        wlr_scene_rect_set_size(rect, width, height);
+    }
+
+    return true;
+}
+
+// node:set_geometry(x, y[, width, height])
+static int
+set_geometry(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, tname);
+    luaL_checktype(L, 2, LUA_TNUMBER); // x
+    luaL_checktype(L, 3, LUA_TNUMBER); // y
+
+    if (!obj->valid) {
+        return luaL_error(L, "%s no longer valid", tname);
+    }
+
+    struct wlr_scene_node *node = obj->object;
+
+    lua_Number x      = lua_tonumber(L, 2);
+    lua_Number y      = lua_tonumber(L, 3);
+    lua_Number width  = luaL_optnumber(L, 4, -1);
+    lua_Number height = luaL_optnumber(L, 5, -1);
+
+    if (!scene_node_set_geometry(node, x, y, width, height)) {
+        return luaL_error(L, "node must be a rect");
+    }
+
+    return 0;
+}
+
 static const luaL_Reg methods[] = {
     {"set_position", set_position},
     {"set_size", set_size},
     {"set_color", set_color},
+    {"set_geometry", set_geometry},
     {NULL, NULL},
 };
 
@@ -48,6 +48,7 @@ add_rect(lua_State *L)
     return 1;
 }
 
+// tree:add_text(text, color[, {font = "sans 11"}])
 static int
 add_text(lua_State *L)
 {
@@ -69,8 +70,25 @@ add_text(lua_State *L)
 
     const char *text = lua_tostring(L, 2);
 
-    struct text_node *text_node = text_node_create(
-        tree, obj->lua->server->font_description, text, color, false);
+    struct kiwmi_server *server = obj->lua->server;
+
+    PangoFontDescription *font_description = server->font_description;
+    if (!lua_isnoneornil(L, 4)) {
+        luaL_checktype(L, 4, LUA_TTABLE);
+
+        lua_getfield(L, 4, "font");
+        if (!lua_isnil(L, -1)) {
+            const char *font = luaL_checkstring(L, -1);
+            font_description = font_registry_get(&server->fonts, font);
+            if (!font_description) {
+                return luaL_error(L, "failed to load font '%s'", font);
+            }
+        }
+        lua_pop(L, 1);
+    }
+
+    struct text_node *text_node =
+        text_node_create(tree, font_description, text, color, false);
 
     lua_pushcfunction(L, luaK_kiwmi_scene_node_new);
     lua_pushlightuserdata(L, obj->lua);
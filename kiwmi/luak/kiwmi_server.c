@@ -7,8 +7,10 @@
 
 #include "luak/kiwmi_server.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <unistd.h>
 
@@ -19,6 +21,7 @@
 #include <wlr/util/log.h>
 
 #include "color.h"
+#include "desktop/transaction.h"
 #include "desktop/view.h"
 #include "input/cursor.h"
 #include "input/input.h"
@@ -28,6 +31,7 @@
 #include "luak/kiwmi_keyboard.h"
 #include "luak/kiwmi_lua_callback.h"
 #include "luak/kiwmi_output.h"
+#include "luak/kiwmi_scene_node.h"
 #include "luak/kiwmi_view.h"
 #include "server.h"
 #include "websocket.h"
@@ -53,6 +57,180 @@ l_kiwmi_server_active_output(lua_State *L)
     return 1;
 }
 
+static bool
+get_number_field(lua_State *L, int idx, const char *key, lua_Number *value)
+{
+    lua_getfield(L, idx, key);
+    bool present = !lua_isnil(L, -1);
+    if (present) {
+        *value = luaL_checknumber(L, -1);
+    }
+    lua_pop(L, 1);
+    return present;
+}
+
+// One `nodes` entry of kiwmi:apply_layout(), {node, x, y[, w, h]}
+struct layout_node {
+    // kept alive by the layout table, checked again when applying
+    struct kiwmi_object *obj;
+    lua_Number geometry[4];
+};
+
+static void
+read_node_geometry(lua_State *L, int idx, struct layout_node *item)
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    lua_rawgeti(L, idx, 1);
+    item->obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, -1, "kiwmi_scene_node");
+    lua_pop(L, 1);
+
+    for (int i = 0; i < 4; ++i) {
+        lua_rawgeti(L, idx, i + 2);
+        item->geometry[i] = i < 2 ? luaL_checknumber(L, -1)
+                                  : luaL_optnumber(L, -1, -1);
+        lua_pop(L, 1);
+    }
+
+    struct wlr_scene_node *node = item->obj->object;
+    bool resize = item->geometry[2] >= 0 && item->geometry[3] >= 0;
+    if (item->obj->valid && resize && node->type != WLR_SCENE_NODE_RECT) {
+        luaL_error(L, "node must be a rect");
+    }
+}
+
+// One view of kiwmi:apply_layout(), as read from Lua
+struct layout_entry {
+    struct kiwmi_view *view; // NULL if it went away
+    bool move;
+    bool resize;
+    bool hidden;
+    lua_Number x, y, w, h;
+};
+
+// kiwmi:apply_layout({{view = v, x = 0, y = 0, w = 640, h = 480,
+//                      hidden = false, nodes = {{node, x, y, w, h}, ...}},
+//                     ...}, {timeout = 200})
+// The views are moved in one transaction, once the resized clients have
+// committed their new size or after timeout ms. The nodes are applied right
+// away. Views and nodes that went away in the meantime are skipped.
+static int
+l_kiwmi_server_apply_layout(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    struct kiwmi_server *server = obj->lua->server;
+
+    lua_Number timeout = KIWMI_TRANSACTION_TIMEOUT_MS;
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+        get_number_field(L, 3, "timeout", &timeout);
+    }
+
+    // Read everything first, a Lua error must neither leave a transaction
+    // behind nor move the nodes without their views
+    size_t len                 = lua_objlen(L, 2);
+    struct layout_entry *items = lua_newuserdata(L, len * sizeof(*items));
+    size_t node_count          = 0;
+    for (size_t i = 1; i <= len; ++i) {
+        lua_rawgeti(L, 2, i);
+        int entry = lua_gettop(L);
+        luaL_checktype(L, entry, LUA_TTABLE);
+
+        struct layout_entry *item = &items[i - 1];
+
+        lua_getfield(L, entry, "view");
+        struct kiwmi_object *view_obj =
+            *(struct kiwmi_object **)luaL_checkudata(L, -1, "kiwmi_view");
+        item->view = view_obj->valid ? view_obj->object : NULL;
+        lua_pop(L, 1);
+
+        lua_getfield(L, entry, "hidden");
+        item->hidden = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        item->x = item->y = item->w = item->h = 0;
+        item->move   = get_number_field(L, entry, "x", &item->x);
+        item->move   = get_number_field(L, entry, "y", &item->y) && item->move;
+        item->resize = get_number_field(L, entry, "w", &item->w);
+        item->resize =
+            get_number_field(L, entry, "h", &item->h) && item->resize;
+
+        if (item->view) {
+            lua_getfield(L, entry, "nodes");
+            if (!lua_isnil(L, -1)) {
+                luaL_checktype(L, -1, LUA_TTABLE);
+                node_count += lua_objlen(L, -1);
+            }
+            lua_pop(L, 1);
+        }
+
+        lua_pop(L, 1);
+    }
+
+    struct layout_node *nodes = lua_newuserdata(L, node_count * sizeof(*nodes));
+    size_t node_index         = 0;
+    for (size_t i = 1; i <= len; ++i) {
+        if (!items[i - 1].view) {
+            continue;
+        }
+
+        lua_rawgeti(L, 2, i);
+        lua_getfield(L, -1, "nodes");
+        if (!lua_isnil(L, -1)) {
+            int entry_nodes = lua_gettop(L);
+            size_t nnodes   = lua_objlen(L, entry_nodes);
+            for (size_t j = 1; j <= nnodes && node_index < node_count; ++j) {
+                lua_rawgeti(L, entry_nodes, j);
+                read_node_geometry(L, lua_gettop(L), &nodes[node_index++]);
+                lua_pop(L, 1);
+            }
+        }
+        lua_pop(L, 2);
+    }
+
+    struct kiwmi_transaction *transaction =
+        transaction_create(&server->desktop);
+    if (!transaction) {
+        return luaL_error(L, "failed to create layout transaction");
+    }
+
+    for (size_t i = 0; i < len; ++i) {
+        struct layout_entry *item = &items[i];
+        if (item->view) {
+            transaction_add_view(
+                transaction,
+                item->view,
+                item->move,
+                item->x,
+                item->y,
+                item->resize,
+                item->w,
+                item->h,
+                item->hidden);
+        }
+    }
+
+    for (size_t i = 0; i < node_index; ++i) {
+        struct layout_node *item = &nodes[i];
+        if (item->obj->valid) {
+            scene_node_set_geometry(
+                item->obj->object,
+                item->geometry[0],
+                item->geometry[1],
+                item->geometry[2],
+                item->geometry[3]);
+        }
+    }
+
+    transaction_commit(transaction, timeout);
+
+    return 0;
+}
+
 static int
 l_kiwmi_server_bg_color(lua_State *L)
 {
@@ -96,6 +274,93 @@ l_kiwmi_server_cursor(lua_State *L)
     return 1;
 }
 
+static void
+kiwmi_server_on_focus_change_notify(struct wl_listener *listener, void *data)
+{
+    struct kiwmi_lua_callback *lc = wl_container_of(listener, lc, listener);
+    struct kiwmi_server *server   = lc->server;
+    lua_State *L                  = server->lua->L;
+    struct kiwmi_view *view       = data;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lc->callback_ref);
+
+    if (view) {
+        lua_pushcfunction(L, luaK_kiwmi_view_new);
+        lua_pushlightuserdata(L, server->lua);
+        lua_pushlightuserdata(L, view);
+        if (lua_pcall(L, 2, 1, 0)) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+            lua_pop(L, 2);
+            return;
+        }
+    } else {
+        lua_pushnil(L);
+    }
+
+    if (lua_pcall(L, 1, 0, 0)) {
+        wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+}
+
+static int
+l_kiwmi_server_focus_policy(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    struct kiwmi_server *server = obj->object;
+    struct kiwmi_seat *seat     = server->input.seat;
+
+    lua_getfield(L, 2, "follow_mouse");
+    bool follow_mouse = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "delay_ms");
+    int delay_ms = luaL_optinteger(L, -1, 0);
+    lua_pop(L, 1);
+
+    if (delay_ms < 0) {
+        return luaL_argerror(L, 2, "delay_ms must not be negative");
+    }
+
+    lua_getfield(L, 2, "on_change");
+    if (!lua_isnil(L, -1)) {
+        luaL_checktype(L, -1, LUA_TFUNCTION);
+    }
+
+    // a new policy replaces the previous on_change
+    struct kiwmi_lua_callback *lc;
+    struct kiwmi_lua_callback *tmp;
+    wl_list_for_each_safe (lc, tmp, &obj->callbacks, link) {
+        if (lc->listener.notify == kiwmi_server_on_focus_change_notify) {
+            wl_list_remove(&lc->listener.link);
+            wl_list_remove(&lc->link);
+            luaL_unref(L, LUA_REGISTRYINDEX, lc->callback_ref);
+            free(lc);
+        }
+    }
+
+    if (!lua_isnil(L, -1)) {
+        lua_pushcfunction(L, luaK_kiwmi_lua_callback_new);
+        lua_pushlightuserdata(L, server);
+        lua_pushvalue(L, -3);
+        lua_pushlightuserdata(L, kiwmi_server_on_focus_change_notify);
+        lua_pushlightuserdata(L, &seat->events.focus_change);
+        lua_pushlightuserdata(L, obj);
+
+        if (lua_pcall(L, 5, 0, 0)) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(L, -1));
+            return 0;
+        }
+    }
+
+    seat_set_follow_mouse(seat, follow_mouse, delay_ms);
+
+    return 0;
+}
+
 static int
 l_kiwmi_server_focused_view(lua_State *L)
 {
@@ -357,10 +622,207 @@ ws_register(lua_State *L)
     return 0;
 }
 
+// kiwmi:ws_listen{address = "127.0.0.1", port = 8000} for tcp,
+// kiwmi:ws_listen{unix = true | "name"} for a socket in $XDG_RUNTIME_DIR,
+// kiwmi:ws_listen(false) to stop listening.
+// Configs that never call it listen on 127.0.0.1:8000 after ws_register.
+// Called from a ws handler, it takes effect once the handler has returned.
+// deflate = true | 1-9 compresses for clients that support it.
+static int
+ws_listen(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    struct kiwmi_server *server = obj->lua->server;
+
+    if (lua_isboolean(L, 2) && !lua_toboolean(L, 2)) {
+        lua_pushboolean(L, websocket_listen(server->websocket, NULL));
+        return 1;
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    struct websocket_listen_options options = {
+        .address = "127.0.0.1",
+        .port    = 8000,
+    };
+
+    lua_getfield(L, 2, "address");
+    if (lua_isstring(L, -1)) {
+        options.address = luaL_checkstring(L, -1);
+    }
+
+    lua_getfield(L, 2, "port");
+    if (!lua_isnil(L, -1)) {
+        options.port = luaL_checkinteger(L, -1);
+    }
+
+    lua_getfield(L, 2, "deflate");
+    if (lua_isnumber(L, -1)) {
+        options.deflate = lua_tointeger(L, -1);
+        if (options.deflate < 1 || options.deflate > 9) {
+            return luaL_argerror(L, 2, "deflate level must be 1-9");
+        }
+    } else if (lua_toboolean(L, -1)) {
+        // zlib's own default level
+        options.deflate = 6;
+    }
+
+    char path[PATH_MAX];
+    lua_getfield(L, 2, "unix");
+    if (lua_isstring(L, -1) || lua_toboolean(L, -1)) {
+        char name[64];
+        const char *file = name;
+        if (lua_isstring(L, -1)) {
+            file = lua_tostring(L, -1);
+        } else {
+            // one per compositor, so nested instances don't collide
+            snprintf(name, sizeof(name), "kiwmi-ws-%s.sock", server->socket);
+        }
+
+        if (file[0] == '/') {
+            options.unix_path = file;
+        } else {
+            const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+            if (!runtime_dir) {
+                return luaL_error(L, "XDG_RUNTIME_DIR is not set");
+            }
+
+            int len = snprintf(path, sizeof(path), "%s/%s", runtime_dir, file);
+            if (len < 0 || (size_t)len >= sizeof(path)) {
+                return luaL_error(L, "websocket path too long");
+            }
+            options.unix_path = path;
+        }
+    }
+
+    lua_pushboolean(L, websocket_listen(server->websocket, &options));
+
+    return 1;
+}
+
+// Messages of kind "layout_state" are sent as state by default, everything
+// else as is, unless the options at `idx` say otherwise
+static void
+ws_send_options(
+    lua_State *L,
+    int msg,
+    int idx,
+    struct websocket_send_options *options)
+{
+    bool state = false;
+    if (lua_istable(L, msg)) {
+        lua_getfield(L, msg, "kind");
+        state = lua_type(L, -1) == LUA_TSTRING
+                && strcmp(lua_tostring(L, -1), "layout_state") == 0;
+        lua_pop(L, 1);
+    }
+
+    options->coalesce = state;
+    options->diff     = state;
+
+    if (lua_isnoneornil(L, idx)) {
+        return;
+    }
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    lua_getfield(L, idx, "coalesce");
+    if (!lua_isnil(L, -1)) {
+        options->coalesce = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, idx, "diff");
+    if (!lua_isnil(L, -1)) {
+        options->diff = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+}
+
+// kiwmi:ws_send(client, msg, {coalesce = true}) lets a table with a string
+// `kind` replace a message of the same kind that is still queued for the
+// client, which then is never sent. Only do that for state, where the newest
+// message is all that matters. Defaults to true for kind "layout_state".
+static int
+ws_send(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA); // client
+    luaL_checkany(L, 3);                      // msg
+
+    struct websocket_send_options options;
+    ws_send_options(L, 3, 4, &options);
+
+    bool sent = websocket_send(
+        obj->lua->server->websocket, L, lua_touserdata(L, 2), 3, &options);
+
+    lua_pushboolean(L, sent);
+
+    return 1;
+}
+
+// kiwmi:ws_broadcast(msg, {coalesce = true, diff = true}), coalesce as for
+// ws_send. With diff, a table with a string `kind` is sent as a diff stream
+// to clients that connected with ?diff=1. Only do that for state, repeating
+// an unchanged message sends nothing to those clients. Both default to true
+// for kind "layout_state".
+static int
+ws_broadcast(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+    luaL_checkany(L, 2); // msg
+
+    struct websocket_send_options options;
+    ws_send_options(L, 2, 3, &options);
+
+    size_t count =
+        websocket_broadcast(obj->lua->server->websocket, L, 2, &options);
+
+    lua_pushinteger(L, count);
+
+    return 1;
+}
+
+static int
+ws_stats(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_server");
+
+    void *client = NULL;
+    if (!lua_isnoneornil(L, 2)) {
+        luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
+        client = lua_touserdata(L, 2);
+    }
+
+    struct websocket_stats stats;
+    if (!websocket_stats(obj->lua->server->websocket, client, &stats)) {
+        return 0;
+    }
+
+    lua_newtable(L);
+    lua_pushinteger(L, stats.clients);
+    lua_setfield(L, -2, "clients");
+    lua_pushinteger(L, stats.queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, stats.queued_bytes);
+    lua_setfield(L, -2, "queued_bytes");
+    lua_pushnumber(L, stats.dropped);
+    lua_setfield(L, -2, "dropped");
+    lua_pushnumber(L, stats.coalesced);
+    lua_setfield(L, -2, "coalesced");
+
+    return 1;
+}
+
 static const luaL_Reg kiwmi_server_methods[] = {
     {"active_output", l_kiwmi_server_active_output},
+    {"apply_layout", l_kiwmi_server_apply_layout},
     {"bg_color", l_kiwmi_server_bg_color},
     {"cursor", l_kiwmi_server_cursor},
+    {"focus_policy", l_kiwmi_server_focus_policy},
     {"focused_view", l_kiwmi_server_focused_view},
     {"on", luaK_callback_register_dispatch},
     {"output_at", l_kiwmi_server_output_at},
@@ -372,8 +834,11 @@ static const luaL_Reg kiwmi_server_methods[] = {
     {"unfocus", l_kiwmi_server_unfocus},
     {"verbosity", l_kiwmi_server_verbosity},
     {"view_at", l_kiwmi_server_view_at},
+    {"ws_broadcast", ws_broadcast},
+    {"ws_listen", ws_listen},
     {"ws_register", ws_register},
-    {"ws_send", websocket_send_msg},
+    {"ws_send", ws_send},
+    {"ws_stats", ws_stats},
     {NULL, NULL},
 };
 
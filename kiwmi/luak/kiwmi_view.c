@@ -16,6 +16,7 @@
 #include <wlr/util/edges.h>
 #include <wlr/util/log.h>
 
+#include "color.h"
 #include "desktop/desktop_surface.h"
 #include "desktop/output.h"
 #include "desktop/view.h"
@@ -441,6 +442,50 @@ l_kiwmi_view_title(lua_State *L)
     return 1;
 }
 
+static int
+l_kiwmi_view_set_border(lua_State *L)
+{
+    struct kiwmi_object *obj =
+        *(struct kiwmi_object **)luaL_checkudata(L, 1, "kiwmi_view");
+
+    if (!obj->valid) {
+        return luaL_error(L, "kiwmi_view no longer valid");
+    }
+
+    struct kiwmi_view *view = obj->object;
+
+    if (!lua_toboolean(L, 2)) {
+        view_set_border(view, 0, (float[4]){0}, (float[4]){0});
+        return 0;
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    lua_getfield(L, 2, "width");
+    int width = luaL_optinteger(L, -1, 1);
+    lua_pop(L, 1);
+
+    float color[4];
+    lua_getfield(L, 2, "color");
+    if (!color_parse(luaL_checkstring(L, -1), color)) {
+        return luaL_argerror(L, 2, "color is not a valid color");
+    }
+    lua_pop(L, 1);
+
+    float focused_color[4];
+    memcpy(focused_color, color, sizeof(focused_color));
+    lua_getfield(L, 2, "focused_color");
+    if (!lua_isnil(L, -1)
+        && !color_parse(luaL_checkstring(L, -1), focused_color)) {
+        return luaL_argerror(L, 2, "focused_color is not a valid color");
+    }
+    lua_pop(L, 1);
+
+    view_set_border(view, width, color, focused_color);
+
+    return 0;
+}
+
 static int
 l_kiwmi_view_set_debug_text(lua_State *L)
 {
@@ -453,9 +498,10 @@ l_kiwmi_view_set_debug_text(lua_State *L)
 
     struct kiwmi_view *view = obj->object;
 
-    const char *string = luaL_checkstring(L, 2);
+    size_t len;
+    const char *string = luaL_checklstring(L, 2, &len);
 
-    text_node_set_text(view->debug_text, string);
+    text_node_set_text(view->debug_text, string, len);
 
     return 0;
 }
@@ -502,6 +548,7 @@ static const luaL_Reg kiwmi_view_methods[] = {
     {"size", l_kiwmi_view_size},
     {"tiled", l_kiwmi_view_tiled},
     {"title", l_kiwmi_view_title},
+    {"set_border", l_kiwmi_view_set_border},
     {"set_debug_text", l_kiwmi_view_set_debug_text},
     {"scene_tree", scene_tree},
     {NULL, NULL},
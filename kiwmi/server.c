@@ -26,6 +26,7 @@
 #include "desktop/lock.h"
 #include "luak/luak.h"
 #include "pango/pango-font.h"
+#include "text_buffer.h"
 #include "websocket.h"
 
 bool
@@ -35,8 +36,9 @@ server_init(struct kiwmi_server *server, char *config_path)
 
     server->session_lock.lock = NULL;
 
+    font_registry_init(&server->fonts);
     server->font_description =
-        pango_font_description_from_string("monospace 15");
+        font_registry_get(&server->fonts, "monospace 15");
 
     server->wl_display = wl_display_create();
     if (!server->wl_display) {
@@ -46,6 +48,11 @@ server_init(struct kiwmi_server *server, char *config_path)
 
     server->wl_event_loop = wl_display_get_event_loop(server->wl_display);
 
+    if (!text_renderer_init(server->wl_event_loop)) {
+        // not fatal, text just gets rendered on the main thread
+        wlr_log(WLR_ERROR, "Failed to start the text renderer");
+    }
+
     server->backend = wlr_backend_autocreate(server->wl_display);
     if (!server->backend) {
         wlr_log(WLR_ERROR, "Failed to create backend");
@@ -118,7 +125,15 @@ server_init(struct kiwmi_server *server, char *config_path)
         return false;
     }
 
+    // starts listening once the config calls kiwmi:ws_listen(), or on
+    // 127.0.0.1:8000 if it only calls kiwmi:ws_register()
     server->websocket = websocket_init(server->lua->L, server->wl_event_loop);
+    if (!server->websocket) {
+        wlr_log(WLR_ERROR, "Failed to initialize websocket");
+        luaK_destroy(server->lua);
+        wl_display_destroy(server->wl_display);
+        return false;
+    }
 
     return true;
 }
@@ -160,6 +175,7 @@ server_fini(struct kiwmi_server *server)
     input_fini(&server->input);
 
     websocket_fini(server->websocket);
+    text_renderer_fini();
 
     wl_display_destroy(server->wl_display);
 
@@ -167,5 +183,5 @@ server_fini(struct kiwmi_server *server)
 
     free(server->config_path);
 
-    pango_font_description_free(server->font_description);
+    font_registry_fini(&server->fonts);
 }
@@ -4,13 +4,19 @@
 #include <cairo.h>
 #include <drm_fourcc.h>
 #include <pango/pangocairo.h>
+#include <pixman.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 #include <wayland-client-protocol.h>
+#include <wayland-server.h>
 #include <wlr/interfaces/wlr_buffer.h>
 #include <wlr/types/wlr_buffer.h>
 #include <wlr/types/wlr_scene.h>
+#include <wlr/util/box.h>
 #include <wlr/util/log.h>
 
 #include "text_buffer.h"
@@ -66,20 +72,79 @@ escape_markup_text(const char *src, char *dest)
     return length;
 }
 
-static PangoLayout *
-get_pango_layout(
-    cairo_t *cairo,
+// Text with its length and hash, shared by reference between a text node,
+// its render jobs and the buffers it ends up in. Only ever touched on the
+// main thread, the workers just read `data`.
+struct text_string {
+    int refcount;
+    size_t len;
+    uint32_t hash;
+    char data[];
+};
+
+static uint32_t
+hash_bytes(const char *data, size_t len)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct text_string *
+text_string_create(const char *data, size_t len)
+{
+    struct text_string *string = malloc(sizeof(*string) + len + 1);
+    if (!string) {
+        return NULL;
+    }
+
+    memcpy(string->data, data, len);
+    string->data[len] = '\0';
+    string->refcount  = 1;
+    string->len       = len;
+    string->hash      = hash_bytes(data, len);
+    return string;
+}
+
+static struct text_string *
+text_string_ref(struct text_string *string)
+{
+    ++string->refcount;
+    return string;
+}
+
+static void
+text_string_unref(struct text_string *string)
+{
+    if (string && --string->refcount == 0) {
+        free(string);
+    }
+}
+
+static bool
+text_string_equal(const struct text_string *a, const char *data, size_t len)
+{
+    return a->len == len && memcmp(a->data, data, len) == 0;
+}
+
+static void
+set_layout_text(
+    PangoLayout *layout,
     const PangoFontDescription *desc,
-    const char *text,
+    const struct text_string *string,
     double scale,
     bool markup)
 {
-    PangoLayout *layout = pango_cairo_create_layout(cairo);
+    const char *text = string->data;
     PangoAttrList *attrs;
     if (markup) {
         char *buf;
         GError *error = NULL;
-        if (pango_parse_markup(text, -1, 0, &attrs, &buf, NULL, &error)) {
+        if (pango_parse_markup(
+                text, string->len, 0, &attrs, &buf, NULL, &error)) {
             pango_layout_set_text(layout, buf, -1);
             free(buf);
         } else {
@@ -94,7 +159,7 @@ get_pango_layout(
     }
     if (!markup) {
         attrs = pango_attr_list_new();
-        pango_layout_set_text(layout, text, -1);
+        pango_layout_set_text(layout, text, string->len);
     }
 
     pango_attr_list_insert(attrs, pango_attr_scale_new(scale));
@@ -102,44 +167,20 @@ get_pango_layout(
     // pango_layout_set_single_paragraph_mode(layout, 1);
     pango_layout_set_attributes(layout, attrs);
     pango_attr_list_unref(attrs);
-    return layout;
 }
 
-static void
-get_text_size(
-    cairo_t *cairo,
-    const PangoFontDescription *desc,
-    int *width,
-    int *height,
-    int *baseline,
-    double scale,
-    bool markup,
-    const char *fmt,
-    ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    // Add one since vsnprintf excludes null terminator.
-    int length = vsnprintf(NULL, 0, fmt, args) + 1;
-    va_end(args);
-
-    char *buf = malloc(length);
-    if (buf == NULL) {
-        wlr_log(WLR_ERROR, "Failed to allocate memory");
-        return;
-    }
-    va_start(args, fmt);
-    vsnprintf(buf, length, fmt, args);
-    va_end(args);
+// Measuring happens on the main thread only, so one context is enough
+static PangoContext *measure_context;
 
-    PangoLayout *layout = get_pango_layout(cairo, desc, buf, scale, markup);
-    pango_cairo_update_layout(cairo, layout);
-    pango_layout_get_pixel_size(layout, width, height);
-    if (baseline) {
-        *baseline = pango_layout_get_baseline(layout) / PANGO_SCALE;
+static PangoContext *
+get_measure_context(void)
+{
+    if (!measure_context) {
+        measure_context =
+            pango_font_map_create_context(pango_cairo_font_map_get_default());
     }
-    g_object_unref(layout);
-    free(buf);
+
+    return measure_context;
 }
 
 void
@@ -148,53 +189,49 @@ get_text_metrics(
     int *height,
     int *baseline)
 {
-    cairo_t *cairo      = cairo_create(NULL);
-    PangoContext *pango = pango_cairo_create_context(cairo);
     // When passing NULL as a language, pango uses the current locale.
     PangoFontMetrics *metrics =
-        pango_context_get_metrics(pango, description, NULL);
+        pango_context_get_metrics(get_measure_context(), description, NULL);
 
     *baseline = pango_font_metrics_get_ascent(metrics) / PANGO_SCALE;
     *height = *baseline + pango_font_metrics_get_descent(metrics) / PANGO_SCALE;
 
     pango_font_metrics_unref(metrics);
-    g_object_unref(pango);
-    cairo_destroy(cairo);
 }
 
+// Pango objects can't be shared between threads, so every thread that
+// renders keeps its own layout around
+static _Thread_local PangoLayout *render_layout;
+
 static void
 render_text(
     cairo_t *cairo,
     const PangoFontDescription *desc,
+    const struct text_string *text,
     double scale,
-    bool markup,
-    const char *fmt,
-    ...)
-{
-    va_list args;
-    va_start(args, fmt);
-    // Add one since vsnprintf excludes null terminator.
-    int length = vsnprintf(NULL, 0, fmt, args) + 1;
-    va_end(args);
-
-    char *buf = malloc(length);
-    if (buf == NULL) {
-        wlr_log(WLR_ERROR, "Failed to allocate memory");
-        return;
+    bool markup)
+{
+    if (!render_layout) {
+        render_layout = pango_cairo_create_layout(cairo);
     }
-    va_start(args, fmt);
-    vsnprintf(buf, length, fmt, args);
-    va_end(args);
 
-    PangoLayout *layout = get_pango_layout(cairo, desc, buf, scale, markup);
+    PangoLayout *layout = render_layout;
+    set_layout_text(layout, desc, text, scale, markup);
     cairo_font_options_t *fo = cairo_font_options_create();
     cairo_get_font_options(cairo, fo);
     pango_cairo_context_set_font_options(pango_layout_get_context(layout), fo);
     cairo_font_options_destroy(fo);
     pango_cairo_update_layout(cairo, layout);
     pango_cairo_show_layout(cairo, layout);
-    g_object_unref(layout);
-    free(buf);
+}
+
+static void
+render_text_fini(void)
+{
+    if (render_layout) {
+        g_object_unref(render_layout);
+        render_layout = NULL;
+    }
 }
 
 static cairo_subpixel_order_t
@@ -215,19 +252,149 @@ to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
     return CAIRO_SUBPIXEL_ORDER_DEFAULT;
 }
 
+// Everything a rendered text depends on
+struct text_params {
+    struct text_string *text;
+    // Not a copy, these outlive the text nodes, see font_registry_get()
+    const PangoFontDescription *font_description;
+    bool pango_markup;
+    float color[4];
+    float scale;
+    enum wl_output_subpixel subpixel;
+    uint32_t hash;               // see text_hash()
+    int width, height, baseline; // unscaled, see text_calc_size()
+};
+
 struct cairo_buffer {
     struct wlr_buffer base;
-    cairo_surface_t *surface;
-    cairo_t *cairo;
+    cairo_surface_t *surface; // can be larger than the text, see surface_pool
+    // The text drawn in white, shared by every color, see recolor_mask()
+    cairo_surface_t *mask;
+
+    // What was rendered, so text nodes showing the same thing can share it
+    struct text_params params;
+    struct wl_list cache_link; // text_cache bucket
 };
 
+// Every cairo_buffer that is still alive, keyed by text_hash(). Buffers
+// aren't kept around once the last node showing them lets go, this only
+// makes identical labels share one layout and one surface.
+#define TEXT_CACHE_BUCKETS 256
+static struct wl_list text_cache[TEXT_CACHE_BUCKETS];
+
+static uint32_t
+text_hash(
+    const struct text_string *text,
+    const PangoFontDescription *font_description,
+    bool pango_markup)
+{
+    uint32_t hash = text->hash;
+    hash ^= pango_font_description_hash(font_description);
+    return hash ^ pango_markup;
+}
+
+static struct wl_list *
+text_cache_bucket(uint32_t hash)
+{
+    static bool initialized = false;
+    if (!initialized) {
+        for (size_t i = 0; i < TEXT_CACHE_BUCKETS; ++i) {
+            wl_list_init(&text_cache[i]);
+        }
+        initialized = true;
+    }
+
+    return &text_cache[hash % TEXT_CACHE_BUCKETS];
+}
+
+static void
+text_params_fini(struct text_params *params)
+{
+    text_string_unref(params->text);
+    params->text = NULL;
+}
+
+// Surfaces of destroyed buffers, handed out again by surface_pool_take().
+// Only used on the main thread.
+#define SURFACE_POOL_SIZE 8
+static struct {
+    cairo_surface_t *surfaces[SURFACE_POOL_SIZE];
+    size_t len;
+} surface_pool;
+
+static void
+surface_pool_put(cairo_surface_t *surface)
+{
+    if (surface_pool.len == SURFACE_POOL_SIZE) {
+        // the oldest one is the least likely to fit anything soon
+        cairo_surface_destroy(surface_pool.surfaces[0]);
+        memmove(
+            &surface_pool.surfaces[0],
+            &surface_pool.surfaces[1],
+            (SURFACE_POOL_SIZE - 1) * sizeof(surface_pool.surfaces[0]));
+        --surface_pool.len;
+    }
+
+    surface_pool.surfaces[surface_pool.len++] = surface;
+}
+
+// Anything at least width x height goes, up to twice the area. Only the
+// top left corner is ever shown, so the rest doesn't have to be cleared.
+static cairo_surface_t *
+surface_pool_take(int width, int height)
+{
+    size_t best    = surface_pool.len;
+    long best_area = 2L * MAX(width, 1) * MAX(height, 1) + 1;
+    for (size_t i = 0; i < surface_pool.len; ++i) {
+        cairo_surface_t *surface = surface_pool.surfaces[i];
+        int w = cairo_image_surface_get_width(surface);
+        int h = cairo_image_surface_get_height(surface);
+        if (w >= width && h >= height && (long)w * h < best_area) {
+            best      = i;
+            best_area = (long)w * h;
+        }
+    }
+
+    if (best < surface_pool.len) {
+        cairo_surface_t *surface    = surface_pool.surfaces[best];
+        surface_pool.surfaces[best] = surface_pool.surfaces[--surface_pool.len];
+        return surface;
+    }
+
+    cairo_surface_t *surface =
+        cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+    cairo_status_t status = cairo_surface_status(surface);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        wlr_log(
+            WLR_ERROR,
+            "cairo_image_surface_create failed: %s",
+            cairo_status_to_string(status));
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+
+    return surface;
+}
+
+static void
+surface_pool_fini(void)
+{
+    for (size_t i = 0; i < surface_pool.len; ++i) {
+        cairo_surface_destroy(surface_pool.surfaces[i]);
+    }
+    surface_pool.len = 0;
+}
+
 static void
 cairo_buffer_handle_destroy(struct wlr_buffer *wlr_buffer)
 {
     struct cairo_buffer *buffer = wl_container_of(wlr_buffer, buffer, base);
 
-    cairo_surface_destroy(buffer->surface);
-    cairo_destroy(buffer->cairo);
+    wl_list_remove(&buffer->cache_link);
+    text_params_fini(&buffer->params);
+
+    surface_pool_put(buffer->surface);
+    cairo_surface_destroy(buffer->mask);
     free(buffer);
 }
 
@@ -258,18 +425,29 @@ static const struct wlr_buffer_impl cairo_buffer_impl = {
     .end_data_ptr_access   = cairo_buffer_handle_end_data_ptr_access,
 };
 
+struct text_render_job;
+
 struct text_buffer {
     struct wlr_scene_buffer *buffer_node;
-    char *text;
+    struct text_string *text;
+    uint32_t hash; // text_hash() of the current text
     struct text_node props;
+    PangoLayout *layout; // for measuring, see text_calc_size()
 
+    // Rendered for this output, see ensure_backing_buffer()
+    struct text_buffer_output *target;
     float scale;
     enum wl_output_subpixel subpixel;
 
+    // What's on screen, it stays there until `pending` is done
+    struct cairo_buffer *shown;
+    struct text_render_job *pending;
+
     struct wl_list outputs; // text_buffer_output.link
 
     struct wl_listener output_enter;
     struct wl_listener output_leave;
+    struct wl_listener output_present;
     struct wl_listener destroy;
 };
 
@@ -278,45 +456,221 @@ struct text_buffer_output {
     struct wlr_output *output;
     struct text_buffer *text_buffer;
 
+    // What was last shown for this output, locked so that moving back to
+    // it doesn't rasterize again
+    struct cairo_buffer *variant;
+
     struct wl_listener commit;
 };
 
-static int
-get_text_width(struct text_node *props)
+struct text_render_job {
+    struct wl_list link; // text_renderer.queue or text_renderer.done
+
+    // Only touched on the main thread, NULL once superseded
+    struct text_buffer *buffer;
+    bool queued; // still in text_renderer.queue, protected by its lock
+
+    // Read-only while the job is out of the main thread's hands
+    struct text_params params;
+
+    // Taken from the surface_pool when queued, drawn by the worker
+    cairo_surface_t *surface;
+    cairo_surface_t *mask; // filled in by the worker, NULL on failure
+};
+
+// Rasterizes text off the main thread, so a label changing in the middle
+// of an input event doesn't hold up the next frame. Pango gives every
+// thread its own font map, so the workers share nothing but the queues.
+#define TEXT_RENDER_THREADS 2
+static struct {
+    bool running;
+    bool stopping;
+
+    pthread_t threads[TEXT_RENDER_THREADS];
+    size_t thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct wl_list queue; // text_render_job.link, newest first
+    struct wl_list done;  // text_render_job.link
+
+    // Signalled by the workers whenever they add to `done`
+    int eventfd;
+    struct wl_event_source *event_source;
+} text_renderer;
+
+enum text_match {
+    TEXT_MATCH_SIZE,  // same text and font, so the same size
+    TEXT_MATCH_MASK,  // rasterized the same way, maybe in another color
+    TEXT_MATCH_EXACT, // the same pixels
+};
+
+static bool
+text_params_match(
+    const struct text_params *params,
+    struct text_buffer *buffer,
+    enum text_match match)
 {
-    if (props->max_width) {
-        return MIN(props->max_width, props->width);
+    struct text_node *props = &buffer->props;
+
+    if (params->hash != buffer->hash
+        || params->pango_markup != props->pango_markup
+        || (params->text != buffer->text
+            && !text_string_equal(
+                params->text, buffer->text->data, buffer->text->len))
+        || (params->font_description != props->font_description
+            && !pango_font_description_equal(
+                params->font_description, props->font_description))) {
+        return false;
+    }
+
+    if (match == TEXT_MATCH_SIZE) {
+        return true;
     }
 
-    return props->width;
+    if (params->scale != buffer->scale
+        || params->subpixel != buffer->subpixel) {
+        return false;
+    }
+
+    return match == TEXT_MATCH_MASK
+           || memcmp(params->color, props->color, sizeof(float) * 4) == 0;
+}
+
+// Finds a live buffer showing the same text in the same font
+static struct cairo_buffer *
+text_cache_find(struct text_buffer *buffer, enum text_match match)
+{
+    struct cairo_buffer *cached;
+    wl_list_for_each (cached, text_cache_bucket(buffer->hash), cache_link) {
+        if (text_params_match(&cached->params, buffer, match)) {
+            return cached;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+text_params_init(struct text_params *params, struct text_buffer *buffer)
+{
+    struct text_node *props = &buffer->props;
+
+    *params = (struct text_params){
+        .text             = text_string_ref(buffer->text),
+        .font_description = props->font_description,
+        .pango_markup     = props->pango_markup,
+        .scale            = buffer->scale,
+        .subpixel         = buffer->subpixel,
+        .hash             = buffer->hash,
+        .width            = props->width,
+        .height           = props->height,
+        .baseline         = props->baseline,
+    };
+    memcpy(params->color, props->color, sizeof(float) * 4);
 }
 
+// Sizes the node after what is shown, which lags behind `props` while a
+// render is pending
 static void
-update_source_box(struct text_buffer *buffer)
+update_geometry(struct text_buffer *buffer)
 {
     struct text_node *props    = &buffer->props;
+    struct cairo_buffer *shown = buffer->shown;
+    if (!shown) {
+        // nothing to show yet, but it needs a size to enter any outputs
+        int width = props->width;
+        if (props->max_width) {
+            width = MIN(props->max_width, width);
+        }
+        wlr_scene_buffer_set_dest_size(
+            buffer->buffer_node, width, props->height);
+        return;
+    }
+
+    int width = shown->params.width;
+    if (props->max_width) {
+        width = MIN(props->max_width, width);
+    }
+
     struct wlr_fbox source_box = {
         .x      = 0,
         .y      = 0,
-        .width  = ceil(get_text_width(props) * buffer->scale),
-        .height = ceil(props->height * buffer->scale),
+        .width  = ceil(width * shown->params.scale),
+        .height = ceil(shown->params.height * shown->params.scale),
     };
 
     wlr_scene_buffer_set_source_box(buffer->buffer_node, &source_box);
+    wlr_scene_buffer_set_dest_size(
+        buffer->buffer_node, width, shown->params.height);
 }
 
 static void
-render_backing_buffer(struct text_buffer *buffer)
+text_buffer_output_set_variant(
+    struct text_buffer_output *output,
+    struct cairo_buffer *variant)
 {
-    float scale         = buffer->scale;
-    int width           = ceil(buffer->props.width * scale);
-    int height          = ceil(buffer->props.height * scale);
-    float *color        = (float *)&buffer->props.color;
-    PangoContext *pango = NULL;
+    if (output->variant == variant) {
+        return;
+    }
+
+    if (variant) {
+        wlr_buffer_lock(&variant->base);
+    }
+    if (output->variant) {
+        wlr_buffer_unlock(&output->variant->base);
+    }
+    output->variant = variant;
+}
+
+// Remembers what's shown as the target output's variant
+static void
+text_buffer_keep(struct text_buffer *buffer)
+{
+    if (buffer->target && buffer->shown && !buffer->pending) {
+        text_buffer_output_set_variant(buffer->target, buffer->shown);
+    }
+}
+
+// The content changed, the variants won't be shown again
+static void
+text_buffer_release_variants(struct text_buffer *buffer)
+{
+    struct text_buffer_output *output;
+    wl_list_for_each (output, &buffer->outputs, link) {
+        text_buffer_output_set_variant(output, NULL);
+    }
+}
+
+static void
+text_buffer_show(struct text_buffer *buffer, struct cairo_buffer *cairo_buffer)
+{
+    // set_buffer() unlocks the old buffer first, which may be this one
+    wlr_buffer_lock(&cairo_buffer->base);
+    wlr_scene_buffer_set_buffer(buffer->buffer_node, &cairo_buffer->base);
+    wlr_buffer_unlock(&cairo_buffer->base);
+    buffer->shown = cairo_buffer;
+    update_geometry(buffer);
+    text_buffer_keep(buffer);
+}
+
+static void
+text_params_size(const struct text_params *params, int *width, int *height)
+{
+    *width  = ceil(params->width * params->scale);
+    *height = ceil(params->height * params->scale);
+}
+
+// Runs on the worker threads too, must not touch anything shared
+static cairo_surface_t *
+render_mask(const struct text_params *params)
+{
+    int width, height;
+    text_params_size(params, &width, &height);
 
     cairo_font_options_t *fo = cairo_font_options_create();
     cairo_font_options_set_hint_style(fo, CAIRO_HINT_STYLE_FULL);
-    enum wl_output_subpixel subpixel = buffer->subpixel;
+    enum wl_output_subpixel subpixel = params->subpixel;
     if (subpixel == WL_OUTPUT_SUBPIXEL_NONE
         || subpixel == WL_OUTPUT_SUBPIXEL_UNKNOWN) {
         cairo_font_options_set_antialias(fo, CAIRO_ANTIALIAS_GRAY);
@@ -334,79 +688,498 @@ render_backing_buffer(struct text_buffer *buffer)
             WLR_ERROR,
             "cairo_image_surface_create failed: %s",
             cairo_status_to_string(status));
-        goto err;
+        cairo_surface_destroy(surface);
+        cairo_font_options_destroy(fo);
+        return NULL;
     }
 
     cairo_t *cairo = cairo_create(surface);
     cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
     cairo_set_font_options(cairo, fo);
-    pango = pango_cairo_create_context(cairo);
-    cairo_set_source_rgba(cairo, color[0], color[1], color[2], color[3]);
+    cairo_set_source_rgba(cairo, 1, 1, 1, 1);
     cairo_move_to(cairo, 0, 0);
 
     render_text(
         cairo,
-        buffer->props.font_description,
-        scale,
-        buffer->props.pango_markup,
-        "%s",
-        buffer->text);
+        params->font_description,
+        params->text,
+        params->scale,
+        params->pango_markup);
+
+    cairo_surface_flush(surface);
+    cairo_destroy(cairo);
+    cairo_font_options_destroy(fo);
+
+    return surface;
+}
+
+// Text drawn over transparency is linear in the color, even with subpixel
+// coverage, so tinting the white mask channel by channel gives the same
+// pixels as drawing in that color. Optionally returns the bounding box of
+// the pixels that aren't transparent, which are the only ones a recolor
+// changes.
+static void
+recolor_mask(
+    cairo_surface_t *mask,
+    cairo_surface_t *surface,
+    const float *color,
+    struct wlr_box *changed)
+{
+    // premultiplied, scaled to 0-255
+    uint32_t a = color[3] * 255 + 0.5f;
+    uint32_t r = color[0] * color[3] * 255 + 0.5f;
+    uint32_t g = color[1] * color[3] * 255 + 0.5f;
+    uint32_t b = color[2] * color[3] * 255 + 0.5f;
+
+    int width  = cairo_image_surface_get_width(mask);
+    int height = cairo_image_surface_get_height(mask);
+    int x1 = width, y1 = height, x2 = 0, y2 = 0;
 
     cairo_surface_flush(surface);
+    unsigned char *src = cairo_image_surface_get_data(mask);
+    unsigned char *dst = cairo_image_surface_get_data(surface);
+    int src_stride     = cairo_image_surface_get_stride(mask);
+    int dst_stride     = cairo_image_surface_get_stride(surface);
+
+    for (int y = 0; y < height; ++y) {
+        const uint32_t *in = (const uint32_t *)(src + y * src_stride);
+        uint32_t *out      = (uint32_t *)(dst + y * dst_stride);
+        for (int x = 0; x < width; ++x) {
+            uint32_t p = in[x];
+            if (!p) {
+                out[x] = 0;
+                continue;
+            }
 
+            x1 = MIN(x1, x);
+            x2 = MAX(x2, x + 1);
+            y1 = MIN(y1, y);
+            y2 = y + 1;
+
+            out[x] = ((p >> 24) * a + 127) / 255 << 24
+                     | (((p >> 16) & 0xff) * r + 127) / 255 << 16
+                     | (((p >> 8) & 0xff) * g + 127) / 255 << 8
+                     | ((p & 0xff) * b + 127) / 255;
+        }
+    }
+    cairo_surface_mark_dirty(surface);
+
+    if (changed) {
+        *changed = (struct wlr_box){
+            .x      = x1,
+            .y      = y1,
+            .width  = MAX(x2 - x1, 0),
+            .height = MAX(y2 - y1, 0),
+        };
+    }
+}
+
+// Takes ownership of everything passed in, even on failure
+static struct cairo_buffer *
+cairo_buffer_create(
+    struct text_params *params,
+    cairo_surface_t *surface,
+    cairo_surface_t *mask)
+{
     struct cairo_buffer *cairo_buffer = calloc(1, sizeof(*cairo_buffer));
     if (!cairo_buffer) {
-        goto err;
+        text_params_fini(params);
+        surface_pool_put(surface);
+        cairo_surface_destroy(mask);
+        return NULL;
     }
 
-    wlr_buffer_init(&cairo_buffer->base, &cairo_buffer_impl, width, height);
+    wlr_buffer_init(
+        &cairo_buffer->base,
+        &cairo_buffer_impl,
+        cairo_image_surface_get_width(surface),
+        cairo_image_surface_get_height(surface));
     cairo_buffer->surface = surface;
-    cairo_buffer->cairo   = cairo;
+    cairo_buffer->mask    = mask;
+    cairo_buffer->params  = *params;
+    *params               = (struct text_params){0};
 
-    wlr_scene_buffer_set_buffer(buffer->buffer_node, &cairo_buffer->base);
-    wlr_buffer_drop(&cairo_buffer->base);
-    update_source_box(buffer);
+    wl_list_insert(
+        text_cache_bucket(cairo_buffer->params.hash),
+        &cairo_buffer->cache_link);
 
-err:
-    if (pango)
-        g_object_unref(pango);
-    cairo_font_options_destroy(fo);
+    return cairo_buffer;
 }
 
 static void
-ensure_backing_buffer(struct text_buffer *buffer)
+text_render_job_destroy(struct text_render_job *job)
 {
-    float scale                      = 0;
-    enum wl_output_subpixel subpixel = WL_OUTPUT_SUBPIXEL_UNKNOWN;
+    if (job->surface) {
+        surface_pool_put(job->surface);
+    }
+    if (job->mask) {
+        cairo_surface_destroy(job->mask);
+    }
+    text_params_fini(&job->params);
+    free(job);
+}
 
-    struct text_buffer_output *output;
-    wl_list_for_each (output, &buffer->outputs, link) {
-        if (subpixel == WL_OUTPUT_SUBPIXEL_UNKNOWN) {
-            subpixel = output->output->subpixel;
-        } else if (subpixel != output->output->subpixel) {
-            subpixel = WL_OUTPUT_SUBPIXEL_NONE;
+// The old job's result would only be thrown away
+static void
+text_render_cancel(struct text_buffer *buffer)
+{
+    struct text_render_job *job = buffer->pending;
+    if (!job) {
+        return;
+    }
+    buffer->pending = NULL;
+
+    pthread_mutex_lock(&text_renderer.lock);
+    bool queued = job->queued;
+    if (queued) {
+        wl_list_remove(&job->link);
+    }
+    pthread_mutex_unlock(&text_renderer.lock);
+
+    if (queued) {
+        text_render_job_destroy(job);
+    } else {
+        // a worker has it, handle_render_done() frees it
+        job->buffer = NULL;
+    }
+}
+
+// Only the color changed and nobody else shows this buffer, so it can be
+// tinted in place. Nothing gets allocated and only the glyphs are damaged.
+static void
+text_buffer_recolor(struct text_buffer *buffer)
+{
+    struct cairo_buffer *shown = buffer->shown;
+
+    struct wlr_box changed;
+    recolor_mask(shown->mask, shown->surface, buffer->props.color, &changed);
+    memcpy(shown->params.color, buffer->props.color, sizeof(float) * 4);
+
+    pixman_region32_t damage;
+    pixman_region32_init_rect(
+        &damage, changed.x, changed.y, changed.width, changed.height);
+    // the node holds the only lock, which set_buffer() drops first
+    wlr_buffer_lock(&shown->base);
+    wlr_scene_buffer_set_buffer_with_damage(
+        buffer->buffer_node, &shown->base, &damage);
+    wlr_buffer_unlock(&shown->base);
+    pixman_region32_fini(&damage);
+
+    text_buffer_keep(buffer);
+}
+
+static void
+render_backing_buffer(struct text_buffer *buffer)
+{
+    // not on any output yet, ensure_backing_buffer() renders on output_enter
+    if (buffer->scale == 0) {
+        return;
+    }
+
+    struct cairo_buffer *cached = text_cache_find(buffer, TEXT_MATCH_EXACT);
+    if (cached) {
+        text_render_cancel(buffer);
+        if (cached == buffer->shown) {
+            // only showing it again would unlock it first, maybe for good
+            text_buffer_keep(buffer);
+        } else {
+            text_buffer_show(buffer, cached);
         }
+        return;
+    }
 
-        if (scale != 0 && scale != output->output->scale) {
-            // drop down to gray scale if we encounter outputs with different
-            // scales or else we will have chromatic aberations
-            subpixel = WL_OUTPUT_SUBPIXEL_NONE;
+    struct cairo_buffer *shown = buffer->shown;
+    if (shown && shown->base.n_locks == 1
+        && text_params_match(&shown->params, buffer, TEXT_MATCH_MASK)) {
+        text_render_cancel(buffer);
+        text_buffer_recolor(buffer);
+        return;
+    }
+
+    // the pending render already has what's asked for
+    struct text_render_job *pending = buffer->pending;
+    if (pending
+        && text_params_match(&pending->params, buffer, TEXT_MATCH_EXACT)) {
+        return;
+    }
+    text_render_cancel(buffer);
+
+    struct text_params params;
+    text_params_init(&params, buffer);
+
+    int width, height;
+    text_params_size(&params, &width, &height);
+    cairo_surface_t *surface = surface_pool_take(width, height);
+    if (!surface) {
+        text_params_fini(&params);
+        return;
+    }
+
+    // some other node has it in another color, no need for Pango
+    cached = text_cache_find(buffer, TEXT_MATCH_MASK);
+    if (cached || !text_renderer.running) {
+        cairo_surface_t *mask = cached ? cairo_surface_reference(cached->mask)
+                                       : render_mask(&params);
+        if (!mask) {
+            surface_pool_put(surface);
+            text_params_fini(&params);
+            return;
         }
+        recolor_mask(mask, surface, params.color, NULL);
 
-        if (scale < output->output->scale) {
-            scale = output->output->scale;
+        struct cairo_buffer *cairo_buffer =
+            cairo_buffer_create(&params, surface, mask);
+        if (!cairo_buffer) {
+            return;
         }
+
+        text_buffer_show(buffer, cairo_buffer);
+        wlr_buffer_drop(&cairo_buffer->base);
+        return;
+    }
+
+    struct text_render_job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        surface_pool_put(surface);
+        text_params_fini(&params);
+        return;
     }
 
+    job->buffer     = buffer;
+    job->params     = params;
+    job->surface    = surface;
+    job->queued     = true;
+    buffer->pending = job;
+
+    pthread_mutex_lock(&text_renderer.lock);
+    wl_list_insert(&text_renderer.queue, &job->link);
+    pthread_cond_signal(&text_renderer.cond);
+    pthread_mutex_unlock(&text_renderer.lock);
+}
+
+static void *
+text_render_worker(void *UNUSED(data))
+{
+    pthread_mutex_lock(&text_renderer.lock);
+    while (true) {
+        while (!text_renderer.stopping && wl_list_empty(&text_renderer.queue)) {
+            pthread_cond_wait(&text_renderer.cond, &text_renderer.lock);
+        }
+        if (text_renderer.stopping) {
+            break;
+        }
+
+        // oldest first
+        struct text_render_job *job =
+            wl_container_of(text_renderer.queue.prev, job, link);
+        wl_list_remove(&job->link);
+        job->queued = false;
+        pthread_mutex_unlock(&text_renderer.lock);
+
+        job->mask = render_mask(&job->params);
+        if (job->mask) {
+            recolor_mask(job->mask, job->surface, job->params.color, NULL);
+        }
+
+        pthread_mutex_lock(&text_renderer.lock);
+        wl_list_insert(&text_renderer.done, &job->link);
+
+        uint64_t one = 1;
+        if (write(text_renderer.eventfd, &one, sizeof(one)) < 0) {
+            wlr_log_errno(WLR_ERROR, "Failed to wake up the event loop");
+        }
+    }
+    pthread_mutex_unlock(&text_renderer.lock);
+
+    render_text_fini();
+
+    return NULL;
+}
+
+static int
+handle_render_done(int fd, uint32_t UNUSED(mask), void *UNUSED(data))
+{
+    uint64_t count;
+    if (read(fd, &count, sizeof(count)) < 0) {
+        return 0;
+    }
+
+    struct wl_list done;
+    wl_list_init(&done);
+    pthread_mutex_lock(&text_renderer.lock);
+    wl_list_insert_list(&done, &text_renderer.done);
+    wl_list_init(&text_renderer.done);
+    pthread_mutex_unlock(&text_renderer.lock);
+
+    struct text_render_job *job, *tmp;
+    wl_list_for_each_safe (job, tmp, &done, link) {
+        wl_list_remove(&job->link);
+
+        struct text_buffer *buffer = job->buffer;
+        if (!buffer || !job->mask) {
+            if (buffer) {
+                buffer->pending = NULL;
+            }
+            text_render_job_destroy(job);
+            continue;
+        }
+        buffer->pending = NULL;
+
+        // another node may have finished the same text in the meantime
+        struct cairo_buffer *cached = text_cache_find(buffer, TEXT_MATCH_EXACT);
+        if (cached) {
+            text_buffer_show(buffer, cached);
+            text_render_job_destroy(job);
+            continue;
+        }
+
+        struct cairo_buffer *cairo_buffer =
+            cairo_buffer_create(&job->params, job->surface, job->mask);
+        job->surface = NULL;
+        job->mask    = NULL;
+        text_render_job_destroy(job);
+        if (!cairo_buffer) {
+            continue;
+        }
+
+        text_buffer_show(buffer, cairo_buffer);
+        wlr_buffer_drop(&cairo_buffer->base);
+    }
+
+    return 0;
+}
+
+bool
+text_renderer_init(struct wl_event_loop *event_loop)
+{
+    wl_list_init(&text_renderer.queue);
+    wl_list_init(&text_renderer.done);
+    text_renderer.stopping = false;
+
+    text_renderer.eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (text_renderer.eventfd < 0) {
+        wlr_log_errno(WLR_ERROR, "Failed to create eventfd");
+        return false;
+    }
+
+    text_renderer.event_source = wl_event_loop_add_fd(
+        event_loop,
+        text_renderer.eventfd,
+        WL_EVENT_READABLE,
+        handle_render_done,
+        NULL);
+    if (!text_renderer.event_source) {
+        close(text_renderer.eventfd);
+        return false;
+    }
+
+    pthread_mutex_init(&text_renderer.lock, NULL);
+    pthread_cond_init(&text_renderer.cond, NULL);
+
+    text_renderer.thread_count = 0;
+    for (size_t i = 0; i < TEXT_RENDER_THREADS; ++i) {
+        if (pthread_create(
+                &text_renderer.threads[i], NULL, text_render_worker, NULL)
+            != 0) {
+            break;
+        }
+        ++text_renderer.thread_count;
+    }
+
+    if (text_renderer.thread_count == 0) {
+        wlr_log(WLR_ERROR, "Failed to start text rendering threads");
+        text_renderer_fini();
+        return false;
+    }
+
+    text_renderer.running = true;
+    return true;
+}
+
+void
+text_renderer_fini(void)
+{
+    if (!text_renderer.event_source) {
+        return;
+    }
+
+    pthread_mutex_lock(&text_renderer.lock);
+    text_renderer.stopping = true;
+    pthread_cond_broadcast(&text_renderer.cond);
+    pthread_mutex_unlock(&text_renderer.lock);
+
+    for (size_t i = 0; i < text_renderer.thread_count; ++i) {
+        pthread_join(text_renderer.threads[i], NULL);
+    }
+    text_renderer.thread_count = 0;
+
+    // text nodes that outlive this render synchronously from now on
+    text_renderer.running = false;
+
+    struct wl_list *lists[] = {&text_renderer.queue, &text_renderer.done};
+    for (size_t i = 0; i < 2; ++i) {
+        struct text_render_job *job, *tmp;
+        wl_list_for_each_safe (job, tmp, lists[i], link) {
+            if (job->buffer) {
+                job->buffer->pending = NULL;
+            }
+            wl_list_remove(&job->link);
+            text_render_job_destroy(job);
+        }
+    }
+
+    surface_pool_fini();
+
+    pthread_cond_destroy(&text_renderer.cond);
+    pthread_mutex_destroy(&text_renderer.lock);
+
+    wl_event_source_remove(text_renderer.event_source);
+    text_renderer.event_source = NULL;
+    close(text_renderer.eventfd);
+}
+
+// The output showing most of the node. wlroots only picks one once the
+// node has been laid out, until then any output will do.
+static struct text_buffer_output *
+get_primary_output(struct text_buffer *buffer)
+{
+    struct wlr_scene_output *primary = buffer->buffer_node->primary_output;
+
+    struct text_buffer_output *output;
+    wl_list_for_each (output, &buffer->outputs, link) {
+        if (!primary || output->output == primary->output) {
+            return output;
+        }
+    }
+
+    return NULL;
+}
+
+// A scene buffer shows the same buffer on every output, so render for the
+// one showing most of the node, at exactly its scale and subpixel order.
+// The other outputs get that scaled, like any client buffer. Every output
+// keeps what was last rendered for it, so a node moving back and forth
+// between outputs only rasterizes once per output.
+static void
+ensure_backing_buffer(struct text_buffer *buffer)
+{
+    struct text_buffer_output *target = get_primary_output(buffer);
+
     // no outputs
-    if (scale == 0) {
+    if (!target) {
         return;
     }
 
+    float scale                      = target->output->scale;
+    enum wl_output_subpixel subpixel = target->output->subpixel;
+
+    buffer->target = target;
     if (scale != buffer->scale || subpixel != buffer->subpixel) {
         buffer->scale    = scale;
         buffer->subpixel = subpixel;
         render_backing_buffer(buffer);
+    } else {
+        text_buffer_keep(buffer);
     }
 }
 
@@ -419,10 +1192,23 @@ handle_output_commit(struct wl_listener *listener, void *data)
 
     if (event->committed
         & (WLR_OUTPUT_STATE_SCALE | WLR_OUTPUT_STATE_SUBPIXEL)) {
+        text_buffer_output_set_variant(output, NULL);
         ensure_backing_buffer(output->text_buffer);
     }
 }
 
+static void
+handle_output_present(struct wl_listener *listener, void *UNUSED(data))
+{
+    struct text_buffer *buffer =
+        wl_container_of(listener, buffer, output_present);
+
+    // the primary output changes as the node moves, without enter or leave
+    if (get_primary_output(buffer) != buffer->target) {
+        ensure_backing_buffer(buffer);
+    }
+}
+
 static void
 handle_output_enter(struct wl_listener *listener, void *data)
 {
@@ -452,6 +1238,11 @@ text_buffer_output_destroy(struct text_buffer_output *output)
         return;
     }
 
+    if (output->text_buffer->target == output) {
+        output->text_buffer->target = NULL;
+    }
+    text_buffer_output_set_variant(output, NULL);
+
     wl_list_remove(&output->link);
     wl_list_remove(&output->commit.link);
     free(output);
@@ -491,6 +1282,7 @@ handle_destroy(struct wl_listener *listener, void *UNUSED(data))
 
     wl_list_remove(&buffer->output_enter.link);
     wl_list_remove(&buffer->output_leave.link);
+    wl_list_remove(&buffer->output_present.link);
     wl_list_remove(&buffer->destroy.link);
 
     struct text_buffer_output *output, *tmp_output;
@@ -498,7 +1290,12 @@ handle_destroy(struct wl_listener *listener, void *UNUSED(data))
         text_buffer_output_destroy(output);
     }
 
-    free(buffer->text);
+    text_render_cancel(buffer);
+
+    if (buffer->layout) {
+        g_object_unref(buffer->layout);
+    }
+    text_string_unref(buffer->text);
     free(buffer);
 }
 
@@ -507,22 +1304,35 @@ text_calc_size(struct text_buffer *buffer)
 {
     struct text_node *props = &buffer->props;
 
-    cairo_t *c = cairo_create(NULL);
-    cairo_set_antialias(c, CAIRO_ANTIALIAS_BEST);
-    get_text_size(
-        c,
-        props->font_description,
-        &props->width,
-        &props->height,
-        &props->baseline,
-        1,
-        props->pango_markup,
-        "%s",
-        buffer->text);
-    cairo_destroy(c);
+    buffer->hash = text_hash(
+        buffer->text, props->font_description, props->pango_markup);
 
-    wlr_scene_buffer_set_dest_size(
-        buffer->buffer_node, get_text_width(props), props->height);
+    // the size doesn't depend on color or scale, any match will do
+    struct cairo_buffer *cached = text_cache_find(buffer, TEXT_MATCH_SIZE);
+    if (cached) {
+        props->width    = cached->params.width;
+        props->height   = cached->params.height;
+        props->baseline = cached->params.baseline;
+    } else {
+        if (!buffer->layout) {
+            buffer->layout = pango_layout_new(get_measure_context());
+        }
+
+        set_layout_text(
+            buffer->layout,
+            props->font_description,
+            buffer->text,
+            1,
+            props->pango_markup);
+        pango_layout_get_pixel_size(
+            buffer->layout, &props->width, &props->height);
+        props->baseline =
+            pango_layout_get_baseline(buffer->layout) / PANGO_SCALE;
+    }
+
+    if (!buffer->shown) {
+        update_geometry(buffer);
+    }
 }
 
 static bool
@@ -558,7 +1368,7 @@ text_node_create(
     buffer->buffer_node            = node;
     buffer->props.node             = &node->node;
     buffer->props.font_description = font_description;
-    buffer->text                   = strdup(text);
+    buffer->text                   = text_string_create(text, strlen(text));
     if (!buffer->text) {
         free(buffer);
         wlr_scene_node_destroy(&node->node);
@@ -576,6 +1386,8 @@ text_node_create(
     wl_signal_add(&node->events.output_enter, &buffer->output_enter);
     buffer->output_leave.notify = handle_output_leave;
     wl_signal_add(&node->events.output_leave, &buffer->output_leave);
+    buffer->output_present.notify = handle_output_present;
+    wl_signal_add(&node->events.output_present, &buffer->output_present);
 
     text_calc_size(buffer);
 
@@ -592,26 +1404,29 @@ text_node_set_color(struct text_node *node, const float *color)
     memcpy(&node->color, color, sizeof(float) * 4);
     struct text_buffer *buffer = wl_container_of(node, buffer, props);
 
+    text_buffer_release_variants(buffer);
     render_backing_buffer(buffer);
 }
 
 void
-text_node_set_text(struct text_node *node, const char *text)
+text_node_set_text(struct text_node *node, const char *text, size_t len)
 {
     struct text_buffer *buffer = wl_container_of(node, buffer, props);
-    if (strcmp(buffer->text, text) == 0) {
+    if (text_string_equal(buffer->text, text, len)) {
         return;
     }
 
-    char *new_text = strdup(text);
-    if (!new_text) {
+    // the shown buffer and pending jobs keep the old one
+    struct text_string *string = text_string_create(text, len);
+    if (!string) {
         return;
     }
 
-    free(buffer->text);
-    buffer->text = new_text;
+    text_string_unref(buffer->text);
+    buffer->text = string;
 
     text_calc_size(buffer);
+    text_buffer_release_variants(buffer);
     render_backing_buffer(buffer);
 }
 
@@ -620,9 +1435,5 @@ text_node_set_max_width(struct text_node *node, int max_width)
 {
     struct text_buffer *buffer = wl_container_of(node, buffer, props);
     buffer->props.max_width    = max_width;
-    wlr_scene_buffer_set_dest_size(
-        buffer->buffer_node,
-        get_text_width(&buffer->props),
-        buffer->props.height);
-    update_source_box(buffer);
+    update_geometry(buffer);
 }
@@ -6,161 +6,1631 @@
 #include <lauxlib.h>
 #include <libwebsockets.h>
 #include <lua.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <time.h>
 #include <wayland-util.h>
 #include <wlr/util/log.h>
 
 const size_t RX_BUFFER_BYTES = 512;
 
+// Larger binary messages are dropped instead of buffered
+static const size_t RX_MAX_BYTES = 1024 * 1024;
+
+// Each protocol speaks one format, the `id` of the lws_protocols entry
+enum ws_format {
+    WS_FORMAT_JSON,    // text frames on `main`
+    WS_FORMAT_MSGPACK, // binary frames on `main.msgpack`
+    WS_FORMAT_COUNT,
+};
+
+// Queued outgoing messages live back to back in a per-session bump arena.
+// Each record is a `struct send_msg` header, followed by `LWS_PRE` bytes of
+// headroom for lws, followed by the payload. Broadcast records only carry a
+// reference to a shared payload instead. The arena is reset once the queue
+// drains, but its memory is kept around for the next messages.
+struct ws_arena {
+    unsigned char *data;
+    size_t len;      // end of the last committed record
+    size_t cap;
+    size_t head;     // offset of the first record that has not been sent yet
+    size_t last_len; // payload length of the last encoded message
+};
+
+// A message that was encoded once and is queued for several sessions. The
+// lws headroom is shared as well, which is fine since writes never overlap.
+struct ws_payload {
+    size_t refcount;
+    size_t len;
+    size_t cap;           // usable bytes in `data`, including LWS_PRE
+    unsigned char data[]; // LWS_PRE bytes of headroom, then the payload
+};
+
+struct send_msg {
+    size_t len;                // payload length
+    struct ws_payload *shared; // NULL if the payload follows inline
+    uint32_t kind;             // see message_kind(), 0 if never superseded
+    bool superseded;           // a newer message of the same kind is queued
+};
+
+// Messages with more distinct kinds than this are never coalesced
+#define MAX_KINDS 64
+
 struct context_user_data {
     lua_State *L;
 
-    int connect_ref, recv_ref, close_ref;
+    int connect_ref, recv_ref, close_ref;
+
+    struct lws_context *context; // NULL while not listening
+    struct wl_event_loop *event_loop;
+    // what the context was created with, see websocket_listen()
+    char *listen_address;
+    char *listen_unix_path;
+    int listen_port;
+    int listen_deflate;
+    struct lws_protocols protocols[4];
+    // websocket_listen() was called, so the default listener stays off
+    bool listen_configured;
+    struct wl_event_source *listen_default; // see listen_default_cb()
+    // A websocket_listen() from inside lws waits for this, see listen_defer()
+    struct wl_event_source *listen_deferred;
+    struct websocket_listen_options listen_next; // owns its strings
+    bool listen_next_stop;
+    int servicing; // lws is on the stack, so its context must stay alive
+
+    // Servicing that didn't fit in SERVICE_BUDGET_NSEC continues from these
+    struct wl_event_source *service_idle;
+    struct wl_event_source *service_timer;
+    uint64_t service_deadline; // of the servicing that is running
+    size_t throttled;          // sessions with rx paused, see done_message()
+
+    struct wl_list sessions; // per_session_storage::link
+
+    // Event loop state of every socket lws hands us, indexed by fd
+    struct wsi_eventlibs_custom *fds;
+    size_t fds_len;
+
+    // Broadcasts are encoded here once, then copied into a ws_payload
+    struct ws_arena scratch;
+    // The largest payload that was released, reused by the next broadcast
+    struct ws_payload *spare;
+
+    // Interned `kind`s of outgoing messages, see message_kind()
+    char *kinds[MAX_KINDS];
+    size_t kind_count;
+
+    struct wl_list diff_streams; // ws_diff_stream::link
+    size_t diff_stream_count;
+    size_t diff_sessions; // sessions that asked for diffs
+    char *diff_path;      // json pointer scratch space for diffing
+    size_t diff_path_cap;
+};
+
+// Incoming json is built up directly on the stack of a per-session thread:
+// every open container, and above it the key of the value being parsed if
+// the container is an object. Once the outermost container is closed, it is
+// the only thing left on the stack.
+struct json_parse {
+    lua_State *T;
+    int thread_ref; // keeps `T` alive
+    struct lejp_ctx lejp_ctx;
+    bool rejected;
+    bool done;    // the document is complete and at the bottom of the stack
+    bool chunked; // part of a long string value is already on the stack
+    int depth;
+    struct {
+        bool object;
+        int len; // items stored so far, if it is an array
+    } levels[LEJP_MAX_DEPTH];
+};
+
+// Upper bound on the time spent servicing lws from one event loop callback,
+// so a busy client can't hold up input and frames for long
+static const uint64_t SERVICE_BUDGET_NSEC = 500 * 1000;
+
+// Don't hold on to more than this if the messages have gotten a lot smaller
+static const size_t ARENA_KEEP_BYTES = 64 * 1024;
+
+// A client that can't keep up gets new messages dropped once this much is
+// queued for it. A message is always accepted into an empty queue.
+static const size_t SEND_HIGH_WATER_BYTES = 4 * 1024 * 1024;
+
+// Bound on table nesting, also protects the C stack from cyclic tables
+#define MESSAGE_MAX_DEPTH 128
+
+struct per_session_storage {
+    struct wl_list link; // context_user_data::sessions
+    struct lws *wsi;
+    enum ws_format format;
+    struct json_parse json_parse;
+    struct ws_arena arena;
+
+    // Messages and payload bytes in `arena` that still have to be sent
+    size_t queued;
+    size_t queued_bytes;
+    uint64_t dropped;   // did not fit below SEND_HIGH_WATER_BYTES
+    uint64_t coalesced; // replaced by a newer message of the same kind
+
+    // Offset + 1 of the queued record of every kind, 0 if there is none.
+    // Each message supersedes the older one, so there is at most one.
+    size_t live[MAX_KINDS + 1];
+
+    // msgpack messages are collected here, then decoded in one go
+    unsigned char *rx;
+    size_t rx_len;
+    size_t rx_cap;
+    bool rx_rejected;
+
+    bool diff;       // connected with `?diff=1`
+    uint32_t synced; // ws_diff_stream::bit of the streams it is in sync with
+
+    bool throttled; // rx paused until the next servicing, see done_message()
+};
+
+static size_t
+send_msg_size(size_t len, bool shared)
+{
+    const size_t align = _Alignof(max_align_t);
+    size_t size        = sizeof(struct send_msg);
+    if (!shared) {
+        size += LWS_PRE + len;
+    }
+    return (size + align - 1) & ~(align - 1);
+}
+
+static unsigned char *
+send_msg_payload(struct send_msg *msg)
+{
+    if (msg->shared) {
+        return msg->shared->data + LWS_PRE;
+    }
+    return (unsigned char *)(msg + 1) + LWS_PRE;
+}
+
+static struct ws_payload *
+payload_create(struct context_user_data *ctx, size_t len)
+{
+    struct ws_payload *payload = ctx->spare;
+    if (payload && payload->cap >= LWS_PRE + len) {
+        ctx->spare = NULL;
+    } else {
+        payload = malloc(sizeof(*payload) + LWS_PRE + len);
+        if (!payload) {
+            return NULL;
+        }
+        payload->cap = LWS_PRE + len;
+    }
+
+    payload->refcount = 0;
+    payload->len      = len;
+    return payload;
+}
+
+static void
+payload_unref(struct context_user_data *ctx, struct ws_payload *payload)
+{
+    if (--payload->refcount > 0) {
+        return;
+    }
+
+    if (!ctx->spare) {
+        ctx->spare = payload;
+    } else if (ctx->spare->cap < payload->cap) {
+        free(ctx->spare);
+        ctx->spare = payload;
+    } else {
+        free(payload);
+    }
+}
+
+static bool
+arena_reserve(struct ws_arena *arena, size_t end)
+{
+    if (end <= arena->cap) {
+        return true;
+    }
+
+    size_t cap = arena->cap ? arena->cap : 1024;
+    while (cap < end) {
+        cap *= 2;
+    }
+
+    unsigned char *data = realloc(arena->data, cap);
+    if (!data) {
+        return false;
+    }
+
+    arena->data = data;
+    arena->cap  = cap;
+    return true;
+}
+
+static void
+arena_reset(struct ws_arena *arena)
+{
+    arena->len  = 0;
+    arena->head = 0;
+
+    size_t want = send_msg_size(arena->last_len, false);
+    if (arena->cap > ARENA_KEEP_BYTES && arena->cap > 4 * want) {
+        free(arena->data);
+        arena->data = NULL;
+        arena->cap  = 0;
+    }
+}
+
+static void
+arena_fini(struct context_user_data *ctx, struct ws_arena *arena)
+{
+    while (arena->head < arena->len) {
+        struct send_msg *msg = (struct send_msg *)(arena->data + arena->head);
+        if (msg->shared) {
+            payload_unref(ctx, msg->shared);
+        }
+        arena->head += send_msg_size(msg->len, msg->shared);
+    }
+
+    free(arena->data);
+    *arena = (struct ws_arena){0};
+}
+
+struct ws_writer {
+    lua_State *L;
+    struct ws_arena *arena;
+    size_t start; // offset of the record being written
+    size_t pos;   // write position, only committed to the arena when done
+};
+
+static void
+writer_reserve(struct ws_writer *w, size_t n)
+{
+    if (!arena_reserve(w->arena, w->pos + n)) {
+        luaL_error(w->L, "failed to allocate message buffer");
+    }
+}
+
+static void
+writer_putc(struct ws_writer *w, char c)
+{
+    writer_reserve(w, 1);
+    w->arena->data[w->pos++] = c;
+}
+
+static void
+writer_write(struct ws_writer *w, const char *str, size_t len)
+{
+    writer_reserve(w, len);
+    memcpy(w->arena->data + w->pos, str, len);
+    w->pos += len;
+}
+
+static void
+json_write_string(struct ws_writer *w, const char *str, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    // escapes are rare, reserve for the common case
+    writer_reserve(w, len + 2);
+    w->arena->data[w->pos++] = '"';
+
+    size_t run = 0;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = str[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        writer_write(w, str + run, i - run);
+        run = i + 1;
+
+        writer_reserve(w, 6);
+        unsigned char *out = w->arena->data + w->pos;
+        switch (c) {
+        case '"':
+        case '\\':
+            out[0] = '\\';
+            out[1] = c;
+            w->pos += 2;
+            break;
+        case '\n':
+            memcpy(out, "\\n", 2);
+            w->pos += 2;
+            break;
+        case '\t':
+            memcpy(out, "\\t", 2);
+            w->pos += 2;
+            break;
+        case '\r':
+            memcpy(out, "\\r", 2);
+            w->pos += 2;
+            break;
+        default:
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[c >> 4];
+            out[5] = hex[c & 0xf];
+            w->pos += 6;
+            break;
+        }
+    }
+    writer_write(w, str + run, len - run);
+
+    writer_putc(w, '"');
+}
+
+static void
+json_write_number(struct ws_writer *w, lua_Number n)
+{
+    char tmp[32];
+    int len;
+
+    if (n != n || n == HUGE_VAL || n == -HUGE_VAL) {
+        // not representable in json
+        writer_write(w, "null", 4);
+        return;
+    }
+
+    if (n < 9007199254740992.0 && n > -9007199254740992.0
+        && n == (lua_Number)(long long)n) {
+        // integers (e.g. view ids) must not lose digits to %.14g
+        len = snprintf(tmp, sizeof(tmp), "%lld", (long long)n);
+    } else {
+        len = snprintf(tmp, sizeof(tmp), "%.17g", n);
+    }
+
+    writer_write(w, tmp, len);
+}
+
+static void
+json_write_value(struct ws_writer *w, int idx, int depth)
+{
+    lua_State *L = w->L;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        writer_write(w, "null", 4);
+        return;
+    case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx)) {
+            writer_write(w, "true", 4);
+        } else {
+            writer_write(w, "false", 5);
+        }
+        return;
+    case LUA_TNUMBER:
+        json_write_number(w, lua_tonumber(L, idx));
+        return;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(L, idx, &len);
+        json_write_string(w, str, len);
+        return;
+    }
+    case LUA_TTABLE:
+        break;
+    default:
+        luaL_error(L, "cannot encode %s as json", luaL_typename(L, idx));
+        return;
+    }
+
+    if (depth >= MESSAGE_MAX_DEPTH) {
+        luaL_error(L, "json nesting too deep");
+    }
+
+    luaL_checkstack(L, 3, "json nesting too deep");
+
+    lua_rawgeti(L, idx, 1);
+    bool is_array = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+
+    if (is_array) {
+        size_t len = lua_objlen(L, idx);
+        writer_putc(w, '[');
+        for (size_t i = 1; i <= len; ++i) {
+            if (i > 1) {
+                writer_putc(w, ',');
+            }
+            lua_rawgeti(L, idx, i);
+            json_write_value(w, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        writer_putc(w, ']');
+        return;
+    }
+
+    bool first = true;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        writer_putc(w, first ? '{' : ',');
+        first = false;
+
+        // Don't use lua_tolstring on the key itself, that would confuse
+        // lua_next if it is a number.
+        size_t len;
+        const char *key;
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            key = lua_tolstring(L, -2, &len);
+            json_write_string(w, key, len);
+        } else {
+            lua_pushvalue(L, -2);
+            key = lua_tolstring(L, -1, &len);
+            if (!key) {
+                luaL_error(L, "cannot encode %s key", luaL_typename(L, -1));
+            }
+            json_write_string(w, key, len);
+            lua_pop(L, 1);
+        }
+        writer_putc(w, ':');
+
+        json_write_value(w, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+    }
+
+    if (first) {
+        // special case: this was an empty table, treat it like an array
+        writer_write(w, "[]", 2);
+    } else {
+        writer_putc(w, '}');
+    }
+}
+
+// MessagePack encoding for sessions on the `main.msgpack` protocol. Tables
+// follow the same rules as for json, keys included, so both kinds of clients
+// see the same structure. Numbers that are integers are sent as such.
+static void
+writer_put_be(struct ws_writer *w, unsigned char tag, uint64_t n, int bytes)
+{
+    writer_reserve(w, 1 + bytes);
+    unsigned char *out = w->arena->data + w->pos;
+
+    out[0] = tag;
+    for (int i = bytes; i > 0; --i) {
+        out[i] = n & 0xff;
+        n >>= 8;
+    }
+    w->pos += 1 + bytes;
+}
+
+static void
+msgpack_write_string(struct ws_writer *w, const char *str, size_t len)
+{
+    if (len < 32) {
+        writer_putc(w, 0xa0 | len);
+    } else if (len <= 0xff) {
+        writer_put_be(w, 0xd9, len, 1);
+    } else if (len <= 0xffff) {
+        writer_put_be(w, 0xda, len, 2);
+    } else if (len <= 0xffffffff) {
+        writer_put_be(w, 0xdb, len, 4);
+    } else {
+        luaL_error(w->L, "string too long for msgpack");
+    }
+    writer_write(w, str, len);
+}
+
+static void
+msgpack_write_container(struct ws_writer *w, bool map, size_t n)
+{
+    if (n < 16) {
+        writer_putc(w, (map ? 0x80 : 0x90) | n);
+    } else if (n <= 0xffff) {
+        writer_put_be(w, map ? 0xde : 0xdc, n, 2);
+    } else if (n <= 0xffffffff) {
+        writer_put_be(w, map ? 0xdf : 0xdd, n, 4);
+    } else {
+        luaL_error(w->L, "table too large for msgpack");
+    }
+}
+
+static void
+msgpack_write_number(struct ws_writer *w, lua_Number n)
+{
+    // the range checks come first, casting anything else is undefined
+    if (n >= 0 && n < 18446744073709551616.0 && n == floor(n)) {
+        uint64_t u = n;
+        if (u < 0x80) {
+            writer_putc(w, u);
+        } else if (u <= 0xff) {
+            writer_put_be(w, 0xcc, u, 1);
+        } else if (u <= 0xffff) {
+            writer_put_be(w, 0xcd, u, 2);
+        } else if (u <= 0xffffffff) {
+            writer_put_be(w, 0xce, u, 4);
+        } else {
+            writer_put_be(w, 0xcf, u, 8);
+        }
+    } else if (n < 0 && n >= -9223372036854775808.0 && n == floor(n)) {
+        int64_t i = n;
+        if (i >= -32) {
+            writer_putc(w, (unsigned char)i);
+        } else if (i >= INT8_MIN) {
+            writer_put_be(w, 0xd0, (uint64_t)i, 1);
+        } else if (i >= INT16_MIN) {
+            writer_put_be(w, 0xd1, (uint64_t)i, 2);
+        } else if (i >= INT32_MIN) {
+            writer_put_be(w, 0xd2, (uint64_t)i, 4);
+        } else {
+            writer_put_be(w, 0xd3, (uint64_t)i, 8);
+        }
+    } else {
+        double d = n;
+        uint64_t bits;
+        memcpy(&bits, &d, sizeof(bits));
+        writer_put_be(w, 0xcb, bits, 8);
+    }
+}
+
+static void
+msgpack_write_value(struct ws_writer *w, int idx, int depth)
+{
+    lua_State *L = w->L;
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        writer_putc(w, 0xc0);
+        return;
+    case LUA_TBOOLEAN:
+        writer_putc(w, lua_toboolean(L, idx) ? 0xc3 : 0xc2);
+        return;
+    case LUA_TNUMBER:
+        msgpack_write_number(w, lua_tonumber(L, idx));
+        return;
+    case LUA_TSTRING: {
+        size_t len;
+        const char *str = lua_tolstring(L, idx, &len);
+        msgpack_write_string(w, str, len);
+        return;
+    }
+    case LUA_TTABLE:
+        break;
+    default:
+        luaL_error(L, "cannot encode %s as msgpack", luaL_typename(L, idx));
+        return;
+    }
+
+    if (depth >= MESSAGE_MAX_DEPTH) {
+        luaL_error(L, "msgpack nesting too deep");
+    }
+
+    luaL_checkstack(L, 3, "msgpack nesting too deep");
+
+    lua_rawgeti(L, idx, 1);
+    bool is_array = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+
+    if (is_array) {
+        size_t len = lua_objlen(L, idx);
+        msgpack_write_container(w, false, len);
+        for (size_t i = 1; i <= len; ++i) {
+            lua_rawgeti(L, idx, i);
+            msgpack_write_value(w, lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+
+    // the header needs the count up front
+    size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        ++count;
+        lua_pop(L, 1);
+    }
+
+    // an empty table is an array, same as for json
+    msgpack_write_container(w, count > 0, count);
+
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        // lua_tolstring() would confuse lua_next() by converting the key
+        size_t len;
+        lua_pushvalue(L, -2);
+        const char *key = lua_tolstring(L, -1, &len);
+        if (!key) {
+            luaL_error(L, "cannot encode %s key", luaL_typename(L, -1));
+        }
+        msgpack_write_string(w, key, len);
+        lua_pop(L, 1);
+
+        msgpack_write_value(w, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+    }
+}
+
+// Starts a new record at the end of the arena. Nothing is committed until
+// record_end(), so an error half way through leaves the arena untouched.
+static struct ws_writer
+record_begin(struct ws_arena *arena, lua_State *L)
+{
+    if (arena->head == arena->len) {
+        arena_reset(arena);
+    }
+
+    size_t start = arena->len;
+
+    // Most messages are about as long as the previous one, so try to get all
+    // the space we need up front.
+    if (!arena_reserve(arena, start + send_msg_size(arena->last_len, false))) {
+        luaL_error(L, "failed to allocate message buffer");
+    }
+
+    return (struct ws_writer){
+        .L     = L,
+        .arena = arena,
+        .start = start,
+        .pos   = start + sizeof(struct send_msg) + LWS_PRE,
+    };
+}
+
+// Commits the record and returns its offset in the arena
+static size_t
+record_end(struct ws_writer *w)
+{
+    struct ws_arena *arena = w->arena;
+    size_t start           = w->start;
+
+    size_t len = w->pos - (start + sizeof(struct send_msg) + LWS_PRE);
+    writer_reserve(w, send_msg_size(len, false) - (w->pos - start));
+
+    struct send_msg *msg = (struct send_msg *)(arena->data + start);
+    msg->len             = len;
+    msg->shared          = NULL;
+    msg->kind            = 0;
+    msg->superseded      = false;
+
+    arena->len      = start + send_msg_size(len, false);
+    arena->last_len = len;
+
+    return start;
+}
+
+// Encodes the value at `idx` into a new record at the end of the arena and
+// returns its offset. On error the arena is left untouched.
+static size_t
+arena_push_value(
+    struct ws_arena *arena,
+    lua_State *L,
+    int idx,
+    enum ws_format format)
+{
+    struct ws_writer w = record_begin(arena, L);
+
+    idx = idx > 0 ? idx : lua_gettop(L) + idx + 1;
+    if (format == WS_FORMAT_MSGPACK) {
+        msgpack_write_value(&w, idx, 0);
+    } else {
+        json_write_value(&w, idx, 0);
+    }
+
+    return record_end(&w);
+}
+
+static bool
+arena_push_shared(
+    struct ws_arena *arena,
+    struct ws_payload *payload,
+    uint32_t kind)
+{
+    if (arena->head == arena->len) {
+        arena_reset(arena);
+    }
+
+    size_t start = arena->len;
+    size_t size  = send_msg_size(payload->len, true);
+    if (!arena_reserve(arena, start + size)) {
+        return false;
+    }
+
+    struct send_msg *msg = (struct send_msg *)(arena->data + start);
+    msg->len             = payload->len;
+    msg->shared          = payload;
+    msg->kind            = kind;
+    msg->superseded      = false;
+    ++payload->refcount;
+
+    arena->len = start + size;
+    return true;
+}
+
+static struct ws_payload *
+payload_from_scratch(struct context_user_data *ctx, size_t offset)
+{
+    struct send_msg *msg = (struct send_msg *)(ctx->scratch.data + offset);
+
+    struct ws_payload *payload = payload_create(ctx, msg->len);
+    if (!payload) {
+        return NULL;
+    }
+    memcpy(payload->data + LWS_PRE, send_msg_payload(msg), msg->len);
+
+    // Hold a reference of our own, so a failing push can't free it early
+    payload->refcount = 1;
+    return payload;
+}
+
+// Returns the interned id of the `kind` of a table message, or 0. Only
+// messages sent with websocket_send_options::coalesce have one.
+static uint32_t
+message_kind(struct context_user_data *ctx, lua_State *L, int idx)
+{
+    if (!lua_istable(L, idx)) {
+        return 0;
+    }
+
+    lua_pushliteral(L, "kind");
+    lua_rawget(L, idx);
+    const char *kind = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1)
+                                                      : NULL;
+
+    uint32_t id = 0;
+    for (size_t i = 0; kind && i < ctx->kind_count; ++i) {
+        if (strcmp(ctx->kinds[i], kind) == 0) {
+            id = i + 1;
+            break;
+        }
+    }
+    if (kind && id == 0 && ctx->kind_count < MAX_KINDS) {
+        char *copy = strdup(kind);
+        if (copy) {
+            ctx->kinds[ctx->kind_count++] = copy;
+            id                            = ctx->kind_count;
+        }
+    }
+
+    lua_pop(L, 1);
+    return id;
+}
+
+// The queued record of `kind` that a new message of that kind supersedes
+static struct send_msg *
+session_live(struct per_session_storage *pss, uint32_t kind)
+{
+    if (kind == 0 || pss->live[kind] == 0) {
+        return NULL;
+    }
+    return (struct send_msg *)(pss->arena.data + pss->live[kind] - 1);
+}
+
+// Decides whether a message of `kind` may be queued, before anything is
+// encoded for it. Superseding counts as sent already, so the latest message
+// of a kind always makes it in once its predecessor does.
+static bool
+session_admit(struct per_session_storage *pss, uint32_t kind)
+{
+    size_t queued = pss->queued, queued_bytes = pss->queued_bytes;
+
+    struct send_msg *stale = session_live(pss, kind);
+    if (stale) {
+        --queued;
+        queued_bytes -= stale->len;
+    }
+
+    if (queued > 0 && queued_bytes >= SEND_HIGH_WATER_BYTES) {
+        ++pss->dropped;
+        return false;
+    }
+    return true;
+}
+
+// Accounts for the record at `offset`, which session_admit() let in, and
+// supersedes the queued message of the same kind
+static void
+session_queued(struct per_session_storage *pss, size_t offset)
+{
+    struct send_msg *msg = (struct send_msg *)(pss->arena.data + offset);
+
+    struct send_msg *stale = session_live(pss, msg->kind);
+    if (stale) {
+        stale->superseded = true;
+        --pss->queued;
+        pss->queued_bytes -= stale->len;
+        ++pss->coalesced;
+    }
+    if (msg->kind != 0) {
+        pss->live[msg->kind] = offset + 1;
+    }
+
+    ++pss->queued;
+    pss->queued_bytes += msg->len;
+    lws_callback_on_writable(pss->wsi);
+}
+
+static bool
+session_queue(
+    struct per_session_storage *pss,
+    struct ws_payload *payload,
+    uint32_t kind)
+{
+    if (!session_admit(pss, kind)) {
+        return false;
+    }
+
+    if (!arena_push_shared(&pss->arena, payload, kind)) {
+        wlr_log(WLR_ERROR, "%s: failed to queue message", __func__);
+        return false;
+    }
+
+    session_queued(pss, pss->arena.len - send_msg_size(payload->len, true));
+    return true;
+}
+
+// Sessions that connect with `?diff=1` in the url get broadcasts of tables
+// with a string `kind` that ask for it (websocket_send_options::diff) as a
+// stream of JSON Patch style deltas instead:
+//
+//   {"kind":"snapshot","stream":<kind>,"seq":<n>,"msg":<message>}
+//   {"kind":"patch","stream":<kind>,"seq":<n>,"ops":[<op>...]}
+//
+// A patch with `seq` n applies to the message of `seq` n - 1. The ops are
+// `add`, `remove` and `replace` with a json pointer `path` into the message.
+// Broadcasts that didn't change anything are not sent at all. A client that
+// lost track sends {"kind":"resync"} and gets a snapshot of every stream.
+// Sessions on `main.msgpack` always get the full messages.
+//
+// The last broadcast of every stream is kept as a tree of ws_nodes. Nodes
+// are carved out of two pools, one for the current snapshot, one for the
+// next, which swap roles after every change.
+enum ws_node_type {
+    WS_NODE_NULL,
+    WS_NODE_BOOLEAN,
+    WS_NODE_NUMBER,
+    WS_NODE_STRING,
+    WS_NODE_ARRAY,
+    WS_NODE_OBJECT,
+};
+
+struct ws_member;
+
+struct ws_node {
+    enum ws_node_type type;
+    size_t len; // string length, or number of items or members
+    union {
+        bool boolean;
+        lua_Number number;
+        const char *string;
+        struct ws_node *items;     // WS_NODE_ARRAY
+        struct ws_member *members; // WS_NODE_OBJECT, sorted by key
+    };
+};
+
+struct ws_member {
+    const char *key;
+    size_t key_len;
+    struct ws_node value;
+};
+
+struct ws_pool_chunk {
+    struct ws_pool_chunk *next;
+    size_t len;
+    size_t cap;
+    max_align_t data[];
+};
+
+struct ws_pool {
+    struct ws_pool_chunk *first, *current, *last;
+};
+
+// Only this many streams can be tracked by per_session_storage::synced, the
+// rest are sent as is.
+#define DIFF_MAX_STREAMS 32
+
+static const size_t POOL_CHUNK_BYTES = 16 * 1024;
+
+struct ws_diff_stream {
+    struct wl_list link; // context_user_data::diff_streams
+    char *kind;
+    uint32_t bit;
+    uint64_t seq; // 0 until the first snapshot
+    struct ws_node snapshot;
+    struct ws_pool pools[2];
+    int current; // index of the pool `snapshot` lives in
+};
+
+static void *
+pool_alloc(struct ws_pool *pool, lua_State *L, size_t size)
+{
+    const size_t align = _Alignof(max_align_t);
+    size               = (size + align - 1) & ~(align - 1);
+
+    while (pool->current && pool->current->len + size > pool->current->cap) {
+        pool->current = pool->current->next;
+    }
+
+    if (!pool->current) {
+        size_t cap = pool->last ? 2 * pool->last->cap : POOL_CHUNK_BYTES;
+        if (cap < size) {
+            cap = size;
+        }
+
+        struct ws_pool_chunk *chunk = malloc(sizeof(*chunk) + cap);
+        if (!chunk) {
+            luaL_error(L, "failed to allocate diff snapshot");
+        }
+        chunk->next = NULL;
+        chunk->len  = 0;
+        chunk->cap  = cap;
+
+        if (pool->last) {
+            pool->last->next = chunk;
+        } else {
+            pool->first = chunk;
+        }
+        pool->last    = chunk;
+        pool->current = chunk;
+    }
+
+    void *ptr = (unsigned char *)pool->current->data + pool->current->len;
+    pool->current->len += size;
+    return ptr;
+}
+
+static void
+pool_reset(struct ws_pool *pool)
+{
+    struct ws_pool_chunk *chunk;
+    for (chunk = pool->first; chunk; chunk = chunk->next) {
+        chunk->len = 0;
+    }
+    pool->current = pool->first;
+}
+
+static void
+pool_fini(struct ws_pool *pool)
+{
+    struct ws_pool_chunk *chunk = pool->first;
+    while (chunk) {
+        struct ws_pool_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    *pool = (struct ws_pool){0};
+}
+
+static const char *
+pool_strdup(struct ws_pool *pool, lua_State *L, const char *str, size_t len)
+{
+    char *copy = pool_alloc(pool, L, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static int
+member_cmp(const void *a, const void *b)
+{
+    const struct ws_member *ma = a;
+    const struct ws_member *mb = b;
+
+    size_t len = ma->key_len < mb->key_len ? ma->key_len : mb->key_len;
+    int cmp    = memcmp(ma->key, mb->key, len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (ma->key_len > mb->key_len) - (ma->key_len < mb->key_len);
+}
+
+// Same rules as json_write_value(), so both encode to the same json
+static void
+node_from_lua(
+    struct ws_pool *pool,
+    lua_State *L,
+    struct ws_node *node,
+    int idx,
+    int depth)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        node->type = WS_NODE_NULL;
+        return;
+    case LUA_TBOOLEAN:
+        node->type    = WS_NODE_BOOLEAN;
+        node->boolean = lua_toboolean(L, idx);
+        return;
+    case LUA_TNUMBER:
+        node->type   = WS_NODE_NUMBER;
+        node->number = lua_tonumber(L, idx);
+        return;
+    case LUA_TSTRING: {
+        const char *str = lua_tolstring(L, idx, &node->len);
+        node->type      = WS_NODE_STRING;
+        node->string    = pool_strdup(pool, L, str, node->len);
+        return;
+    }
+    case LUA_TTABLE:
+        break;
+    default:
+        luaL_error(L, "cannot encode %s as json", luaL_typename(L, idx));
+        return;
+    }
+
+    if (depth >= MESSAGE_MAX_DEPTH) {
+        luaL_error(L, "json nesting too deep");
+    }
+    luaL_checkstack(L, 3, "json nesting too deep");
+
+    lua_rawgeti(L, idx, 1);
+    bool is_array = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+
+    if (is_array) {
+        node->type  = WS_NODE_ARRAY;
+        node->len   = lua_objlen(L, idx);
+        node->items = pool_alloc(pool, L, node->len * sizeof(*node->items));
+        for (size_t i = 0; i < node->len; ++i) {
+            lua_rawgeti(L, idx, i + 1);
+            node_from_lua(pool, L, &node->items[i], lua_gettop(L), depth + 1);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+
+    size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        ++count;
+        lua_pop(L, 1);
+    }
+
+    if (count == 0) {
+        // special case: this was an empty table, treat it like an array
+        node->type  = WS_NODE_ARRAY;
+        node->len   = 0;
+        node->items = NULL;
+        return;
+    }
+
+    node->type    = WS_NODE_OBJECT;
+    node->len     = count;
+    node->members = pool_alloc(pool, L, count * sizeof(*node->members));
+
+    struct ws_member *member = node->members;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+        // lua_tolstring() would confuse lua_next() by converting the key
+        lua_pushvalue(L, -2);
+        const char *key = lua_tolstring(L, -1, &member->key_len);
+        if (!key) {
+            luaL_error(L, "cannot encode %s key", luaL_typename(L, -1));
+        }
+        member->key = pool_strdup(pool, L, key, member->key_len);
+        lua_pop(L, 1);
+
+        node_from_lua(pool, L, &member->value, lua_gettop(L), depth + 1);
+        lua_pop(L, 1);
+        ++member;
+    }
+
+    qsort(node->members, count, sizeof(*node->members), member_cmp);
+}
+
+static void
+json_write_node(struct ws_writer *w, const struct ws_node *node)
+{
+    switch (node->type) {
+    case WS_NODE_NULL:
+        writer_write(w, "null", 4);
+        break;
+    case WS_NODE_BOOLEAN:
+        if (node->boolean) {
+            writer_write(w, "true", 4);
+        } else {
+            writer_write(w, "false", 5);
+        }
+        break;
+    case WS_NODE_NUMBER:
+        json_write_number(w, node->number);
+        break;
+    case WS_NODE_STRING:
+        json_write_string(w, node->string, node->len);
+        break;
+    case WS_NODE_ARRAY:
+        writer_putc(w, '[');
+        for (size_t i = 0; i < node->len; ++i) {
+            if (i > 0) {
+                writer_putc(w, ',');
+            }
+            json_write_node(w, &node->items[i]);
+        }
+        writer_putc(w, ']');
+        break;
+    case WS_NODE_OBJECT:
+        writer_putc(w, '{');
+        for (size_t i = 0; i < node->len; ++i) {
+            const struct ws_member *member = &node->members[i];
+            if (i > 0) {
+                writer_putc(w, ',');
+            }
+            json_write_string(w, member->key, member->key_len);
+            writer_putc(w, ':');
+            json_write_node(w, &member->value);
+        }
+        writer_putc(w, '}');
+        break;
+    }
+}
+
+static void
+msgpack_write_node(struct ws_writer *w, const struct ws_node *node)
+{
+    switch (node->type) {
+    case WS_NODE_NULL:
+        writer_putc(w, 0xc0);
+        break;
+    case WS_NODE_BOOLEAN:
+        writer_putc(w, node->boolean ? 0xc3 : 0xc2);
+        break;
+    case WS_NODE_NUMBER:
+        msgpack_write_number(w, node->number);
+        break;
+    case WS_NODE_STRING:
+        msgpack_write_string(w, node->string, node->len);
+        break;
+    case WS_NODE_ARRAY:
+        msgpack_write_container(w, false, node->len);
+        for (size_t i = 0; i < node->len; ++i) {
+            msgpack_write_node(w, &node->items[i]);
+        }
+        break;
+    case WS_NODE_OBJECT:
+        msgpack_write_container(w, true, node->len);
+        for (size_t i = 0; i < node->len; ++i) {
+            const struct ws_member *member = &node->members[i];
+            msgpack_write_string(w, member->key, member->key_len);
+            msgpack_write_node(w, &member->value);
+        }
+        break;
+    }
+}
+
+static size_t
+push_node(
+    struct context_user_data *ctx,
+    lua_State *L,
+    const struct ws_node *node,
+    enum ws_format format)
+{
+    struct ws_writer w = record_begin(&ctx->scratch, L);
+    if (format == WS_FORMAT_MSGPACK) {
+        msgpack_write_node(&w, node);
+    } else {
+        json_write_node(&w, node);
+    }
+    return record_end(&w);
+}
+
+struct ws_diff {
+    struct context_user_data *ctx;
+    struct ws_writer *w;
+    size_t path_len;
+    size_t ops;
+};
+
+static void
+diff_path_reserve(struct ws_diff *d, size_t n)
+{
+    struct context_user_data *ctx = d->ctx;
+
+    if (d->path_len + n <= ctx->diff_path_cap) {
+        return;
+    }
+
+    size_t cap = ctx->diff_path_cap ? 2 * ctx->diff_path_cap : 256;
+    while (cap < d->path_len + n) {
+        cap *= 2;
+    }
+
+    char *path = realloc(ctx->diff_path, cap);
+    if (!path) {
+        luaL_error(d->w->L, "failed to allocate diff path");
+    }
+    ctx->diff_path     = path;
+    ctx->diff_path_cap = cap;
+}
+
+// Appends a json pointer segment, returns the length to restore afterwards
+static size_t
+diff_path_push(struct ws_diff *d, const char *key, size_t len)
+{
+    size_t prev = d->path_len;
+
+    // worst case every character needs escaping
+    diff_path_reserve(d, 1 + 2 * len);
+    char *out = d->ctx->diff_path + d->path_len;
+
+    *out++ = '/';
+    for (size_t i = 0; i < len; ++i) {
+        if (key[i] == '~') {
+            *out++ = '~';
+            *out++ = '0';
+        } else if (key[i] == '/') {
+            *out++ = '~';
+            *out++ = '1';
+        } else {
+            *out++ = key[i];
+        }
+    }
+    d->path_len = out - d->ctx->diff_path;
+
+    return prev;
+}
+
+static size_t
+diff_path_push_index(struct ws_diff *d, size_t i)
+{
+    char tmp[24];
+    int len = snprintf(tmp, sizeof(tmp), "%zu", i);
+    return diff_path_push(d, tmp, len);
+}
+
+static void
+diff_op(struct ws_diff *d, const char *op, const struct ws_node *value)
+{
+    struct ws_writer *w = d->w;
+
+    if (d->ops++ > 0) {
+        writer_putc(w, ',');
+    }
+    writer_write(w, "{\"op\":\"", 7);
+    writer_write(w, op, strlen(op));
+    writer_write(w, "\",\"path\":", 9);
+    json_write_string(w, d->ctx->diff_path, d->path_len);
+    if (value) {
+        writer_write(w, ",\"value\":", 9);
+        json_write_node(w, value);
+    }
+    writer_putc(w, '}');
+}
+
+static void
+diff_nodes(struct ws_diff *d, const struct ws_node *a, const struct ws_node *b)
+{
+    if (a->type != b->type) {
+        diff_op(d, "replace", b);
+        return;
+    }
+
+    size_t prev;
+
+    switch (a->type) {
+    case WS_NODE_NULL:
+        break;
+    case WS_NODE_BOOLEAN:
+        if (a->boolean != b->boolean) {
+            diff_op(d, "replace", b);
+        }
+        break;
+    case WS_NODE_NUMBER:
+        if (a->number != b->number) {
+            diff_op(d, "replace", b);
+        }
+        break;
+    case WS_NODE_STRING:
+        if (a->len != b->len || memcmp(a->string, b->string, a->len) != 0) {
+            diff_op(d, "replace", b);
+        }
+        break;
+    case WS_NODE_ARRAY: {
+        size_t common = a->len < b->len ? a->len : b->len;
+        for (size_t i = 0; i < common; ++i) {
+            prev = diff_path_push_index(d, i);
+            diff_nodes(d, &a->items[i], &b->items[i]);
+            d->path_len = prev;
+        }
+        for (size_t i = common; i < b->len; ++i) {
+            prev = diff_path_push_index(d, i);
+            diff_op(d, "add", &b->items[i]);
+            d->path_len = prev;
+        }
+        // from the back, so the indices stay valid while applying
+        for (size_t i = a->len; i > common; --i) {
+            prev = diff_path_push_index(d, i - 1);
+            diff_op(d, "remove", NULL);
+            d->path_len = prev;
+        }
+        break;
+    }
+    case WS_NODE_OBJECT: {
+        // both are sorted, so walk them side by side
+        size_t i = 0, j = 0;
+        while (i < a->len || j < b->len) {
+            const struct ws_member *ma = i < a->len ? &a->members[i] : NULL;
+            const struct ws_member *mb = j < b->len ? &b->members[j] : NULL;
+
+            int cmp = !ma ? 1 : !mb ? -1 : member_cmp(ma, mb);
+            if (cmp < 0) {
+                prev = diff_path_push(d, ma->key, ma->key_len);
+                diff_op(d, "remove", NULL);
+                ++i;
+            } else if (cmp > 0) {
+                prev = diff_path_push(d, mb->key, mb->key_len);
+                diff_op(d, "add", &mb->value);
+                ++j;
+            } else {
+                prev = diff_path_push(d, ma->key, ma->key_len);
+                diff_nodes(d, &ma->value, &mb->value);
+                ++i;
+                ++j;
+            }
+            d->path_len = prev;
+        }
+        break;
+    }
+    }
+}
+
+static void
+json_write_stream_header(
+    struct ws_writer *w,
+    const char *kind,
+    struct ws_diff_stream *stream,
+    uint64_t seq)
+{
+    char tmp[32];
+    int len = snprintf(tmp, sizeof(tmp), "%llu", (unsigned long long)seq);
+
+    writer_write(w, "{\"kind\":", 8);
+    json_write_string(w, kind, strlen(kind));
+    writer_write(w, ",\"stream\":", 10);
+    json_write_string(w, stream->kind, strlen(stream->kind));
+    writer_write(w, ",\"seq\":", 7);
+    writer_write(w, tmp, len);
+}
 
-    struct lws_context *context;
-};
+static size_t
+push_snapshot(
+    struct context_user_data *ctx,
+    struct ws_diff_stream *stream,
+    lua_State *L)
+{
+    struct ws_writer w = record_begin(&ctx->scratch, L);
+    json_write_stream_header(&w, "snapshot", stream, stream->seq);
+    writer_write(&w, ",\"msg\":", 7);
+    json_write_node(&w, &stream->snapshot);
+    writer_putc(&w, '}');
+    return record_end(&w);
+}
 
-struct json_parse {
-    lua_State *L; // copy of L here as well for convenience
-    struct lejp_ctx lejp_ctx;
-    bool rejected;
-    int stack_ref, key_ref, res_ref;
-    int stack_top;
-};
+// Returns false and pushes no record if nothing changed
+static bool
+push_patch(
+    struct context_user_data *ctx,
+    struct ws_diff_stream *stream,
+    lua_State *L,
+    const struct ws_node *next,
+    size_t *offset)
+{
+    struct ws_writer w = record_begin(&ctx->scratch, L);
+    json_write_stream_header(&w, "patch", stream, stream->seq + 1);
+    writer_write(&w, ",\"ops\":[", 8);
+
+    struct ws_diff d = {
+        .ctx      = ctx,
+        .w        = &w,
+        .path_len = 0,
+        .ops      = 0,
+    };
+    diff_nodes(&d, &stream->snapshot, next);
 
-struct per_session_storage {
-    struct json_parse json_parse;
-    struct wl_list send_queue;
-};
+    if (d.ops == 0) {
+        return false;
+    }
 
-struct send_msg {
-    struct wl_list link; // per_session_storage::send_queue
-    unsigned char *buf;  // size len + LWS_PRE
-    size_t len;
-};
+    writer_write(&w, "]}", 2);
+    *offset = record_end(&w);
+    return true;
+}
 
-static char *
-to_json(lua_State *L, size_t *len)
+// The stream a broadcast belongs to, or NULL if it should be sent as is
+static struct ws_diff_stream *
+diff_stream_for(struct context_user_data *ctx, lua_State *L, int idx)
 {
-    char *buf = realloc(NULL, 1024);
-    size_t i = LWS_PRE, cap = 1024;
-#define GROW(space)                                                            \
-    if (i + (space) >= cap)                                                    \
-        cap = (cap + space) * 1.5, buf = realloc(buf, cap);
+    if (!lua_istable(L, idx)) {
+        return NULL;
+    }
 
-    // TODO: check for overflow of this stack
-    struct {
-        size_t len, index;
-        bool is_array;
-    } stack[128];
-    size_t stack_len = 0;
+    lua_pushliteral(L, "kind");
+    lua_rawget(L, idx);
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    const char *kind = lua_tostring(L, -1);
 
-    luaL_checkany(L, 1);
+    struct ws_diff_stream *stream;
+    wl_list_for_each (stream, &ctx->diff_streams, link) {
+        if (strcmp(stream->kind, kind) == 0) {
+            lua_pop(L, 1);
+            return stream;
+        }
+    }
 
-    int bottom = lua_gettop(L) - 1;
+    stream = NULL;
+    if (ctx->diff_stream_count < DIFF_MAX_STREAMS) {
+        stream = calloc(1, sizeof(*stream));
+        if (stream && !(stream->kind = strdup(kind))) {
+            free(stream);
+            stream = NULL;
+        }
+    }
+    lua_pop(L, 1);
 
-    while (true) {
-        lua_checkstack(L, 3);
+    if (!stream) {
+        return NULL;
+    }
 
-        int type = lua_type(L, -1);
+    stream->bit = 1u << ctx->diff_stream_count++;
+    wl_list_insert(ctx->diff_streams.prev, &stream->link);
+    return stream;
+}
 
-        if (type == LUA_TTABLE) {
-            lua_rawgeti(L, -1, 1);
-            type = lua_type(L, -1);
-            lua_pop(L, 1);
-            if (type == LUA_TNIL) {
-                stack[stack_len].is_array = false;
-                lua_pushnil(L);
-            } else {
-                stack[stack_len].is_array = true;
-                stack[stack_len].index    = 0;
-                stack[stack_len].len      = lua_objlen(L, -1);
-            }
-            ++stack_len;
-        } else {
-            if (type != LUA_TNUMBER) {
-                GROW(1);
-                buf[i++] = '"';
-            }
+static void
+diff_stream_destroy(struct ws_diff_stream *stream)
+{
+    wl_list_remove(&stream->link);
+    pool_fini(&stream->pools[0]);
+    pool_fini(&stream->pools[1]);
+    free(stream->kind);
+    free(stream);
+}
 
-            size_t len;
-            const char *str = lua_tolstring(L, -1, &len);
-            GROW(len);
-            memcpy(buf + i, str, len);
-            i += len;
-            lua_pop(L, 1);
+static size_t
+diff_broadcast(
+    struct context_user_data *ctx,
+    struct ws_diff_stream *stream,
+    lua_State *L,
+    int idx,
+    uint32_t kind)
+{
+    int next_pool        = !stream->current;
+    struct ws_pool *pool = &stream->pools[next_pool];
+    pool_reset(pool);
+
+    struct ws_node next;
+    node_from_lua(pool, L, &next, idx, 0);
+
+    bool need_full[WS_FORMAT_COUNT] = {false};
+    bool need_snapshot              = false;
+    struct per_session_storage *pss;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        if (!pss->diff) {
+            need_full[pss->format] = true;
+        } else if (!(pss->synced & stream->bit)) {
+            need_snapshot = true;
+        }
+    }
 
-            if (type != LUA_TNUMBER) {
-                GROW(1);
-                buf[i++] = '"';
-            }
+    // Encode everything up front, the messages for non-diff sessions come
+    // from the tree as well so the table is only walked once.
+    size_t full_offsets[WS_FORMAT_COUNT];
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (need_full[i]) {
+            full_offsets[i] = push_node(ctx, L, &next, i);
         }
+    }
 
-        while (true) {
-            if (lua_gettop(L) == bottom)
-                goto end;
+    size_t patch_offset = 0, snapshot_offset = 0;
+    bool changed        = true;
+    if (stream->seq > 0) {
+        changed = push_patch(ctx, stream, L, &next, &patch_offset);
+    }
+    if (changed) {
+        stream->snapshot = next;
+        stream->current  = next_pool;
+        ++stream->seq;
+    }
 
-            if (stack[stack_len - 1].is_array) {
-                ++stack[stack_len - 1].index;
-                if (stack[stack_len - 1].index <= stack[stack_len - 1].len) {
-                    if (stack[stack_len - 1].index == 1) {
-                        // first item in the array
-                        GROW(1);
-                        buf[i++] = '[';
-                    } else {
-                        GROW(1);
-                        buf[i++] = ',';
-                    }
-                    lua_rawgeti(L, -1, stack[stack_len - 1].index);
-                    break;
-                }
-            } else {
-                type = lua_type(L, -1);
-                if (lua_next(L, -2) != 0) {
-                    if (type == LUA_TNIL) {
-                        // first pair in the table
-                        GROW(1);
-                        buf[i++] = '{';
-                    } else {
-                        GROW(1);
-                        buf[i++] = ',';
-                    }
+    if (need_snapshot) {
+        snapshot_offset = push_snapshot(ctx, stream, L);
+    }
 
-                    lua_pushvalue(L, -2);
-                    size_t len;
-                    const char *str = lua_tolstring(L, -1, &len);
-                    GROW(len + 3);
-                    buf[i++] = '"';
-                    memcpy(buf + i, str, len);
-                    i += len;
-                    buf[i++] = '"';
-                    buf[i++] = ':';
-                    lua_pop(L, 1);
-
-                    break;
-                }
+    struct ws_payload *full[WS_FORMAT_COUNT] = {NULL};
+    struct ws_payload *patch = NULL, *snapshot = NULL;
+    bool failed = false;
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (need_full[i]) {
+            failed |= !(full[i] = payload_from_scratch(ctx, full_offsets[i]));
+        }
+    }
+    if (changed && stream->seq > 1) {
+        failed |= !(patch = payload_from_scratch(ctx, patch_offset));
+    }
+    if (need_snapshot) {
+        failed |= !(snapshot = payload_from_scratch(ctx, snapshot_offset));
+    }
 
-                if (type == LUA_TNIL) {
-                    // special case: this was an empty table, treat it like an array
-                    stack[stack_len - 1].is_array = true;
-                    GROW(1);
-                    buf[i++] = '[';
-                }
+    size_t count = 0;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        if (failed) {
+            break;
+        } else if (!pss->diff) {
+            count += session_queue(pss, full[pss->format], kind);
+        } else if (!(pss->synced & stream->bit)) {
+            // patches and snapshots build on each other, never supersede
+            if (session_queue(pss, snapshot, 0)) {
+                pss->synced |= stream->bit;
+                ++count;
             }
-            lua_pop(L, 1);
+        } else if (patch) {
+            if (session_queue(pss, patch, 0)) {
+                ++count;
+            } else {
+                // it missed a patch, so it gets a snapshot next time
+                pss->synced &= ~stream->bit;
+            }
+        }
+    }
+
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (full[i]) {
+            payload_unref(ctx, full[i]);
+        }
+    }
+    if (patch) {
+        payload_unref(ctx, patch);
+    }
+    if (snapshot) {
+        payload_unref(ctx, snapshot);
+    }
+
+    if (failed) {
+        return luaL_error(L, "failed to allocate ws_payload");
+    }
+    return count;
+}
+
+// Queues a snapshot of every stream for the session. Runs in protected
+// mode, since encoding reports errors with luaL_error().
+static int
+diff_resync(lua_State *L)
+{
+    struct context_user_data *ctx   = lua_touserdata(L, 1);
+    struct per_session_storage *pss = lua_touserdata(L, 2);
+
+    pss->synced = 0;
+
+    struct ws_diff_stream *stream;
+    wl_list_for_each (stream, &ctx->diff_streams, link) {
+        if (stream->seq == 0) {
+            continue;
+        }
 
-            GROW(1);
-            buf[i++] = stack[stack_len - 1].is_array ? ']' : '}';
-            --stack_len;
+        ctx->scratch.head = ctx->scratch.len;
+        struct ws_payload *snapshot =
+            payload_from_scratch(ctx, push_snapshot(ctx, stream, L));
+        if (!snapshot) {
+            return luaL_error(L, "failed to allocate ws_payload");
         }
+        if (session_queue(pss, snapshot, 0)) {
+            pss->synced |= stream->bit;
+        }
+        payload_unref(ctx, snapshot);
+    }
+
+    return 0;
+}
+
+// Configs that register callbacks without calling kiwmi:ws_listen() get the
+// listener kiwmi always used to have
+static void
+listen_default_cb(void *data)
+{
+    struct context_user_data *ctx = data;
+    ctx->listen_default           = NULL;
+
+    if (ctx->listen_configured) {
+        return;
     }
-end:
-    *len = i - LWS_PRE;
-    return buf;
 
-#undef GROW
+    struct websocket_listen_options options = {
+        .address = "127.0.0.1",
+        .port    = 8000,
+    };
+    websocket_listen((struct websocket *)ctx, &options);
 }
 
 void
@@ -182,52 +1652,415 @@ websocket_register_callbacks(
     ctx->connect_ref = connect_ref;
     ctx->recv_ref    = recv_ref;
     ctx->close_ref   = close_ref;
+
+    // Wait for the rest of the config, it might still call ws_listen
+    if (!ctx->listen_configured && !ctx->listen_default) {
+        ctx->listen_default =
+            wl_event_loop_add_idle(ctx->event_loop, listen_default_cb, ctx);
+    }
+}
+
+bool
+websocket_send(
+    struct websocket *self,
+    struct lua_State *L,
+    void *client,
+    int idx,
+    const struct websocket_send_options *options)
+{
+    struct context_user_data *ctx = (struct context_user_data *)self;
+
+    idx = idx > 0 ? idx : lua_gettop(L) + idx + 1;
+
+    // Lua might still hold on to a client that is gone
+    struct per_session_storage *pss;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        if (pss->wsi != client) {
+            continue;
+        }
+
+        // a message that is dropped anyway is not worth encoding
+        uint32_t kind = options->coalesce ? message_kind(ctx, L, idx) : 0;
+        if (!session_admit(pss, kind)) {
+            return false;
+        }
+
+        struct ws_arena *arena = &pss->arena;
+        size_t offset          = arena_push_value(arena, L, idx, pss->format);
+
+        struct send_msg *msg = (struct send_msg *)(arena->data + offset);
+        msg->kind            = kind;
+
+        session_queued(pss, offset);
+        return true;
+    }
+
+    return false;
+}
+
+size_t
+websocket_broadcast(
+    struct websocket *self,
+    struct lua_State *L,
+    int idx,
+    const struct websocket_send_options *options)
+{
+    struct context_user_data *ctx = (struct context_user_data *)self;
+
+    if (wl_list_empty(&ctx->sessions)) {
+        return 0;
+    }
+
+    idx = idx > 0 ? idx : lua_gettop(L) + idx + 1;
+
+    // whatever is left from the last broadcast has been copied already
+    ctx->scratch.head = ctx->scratch.len;
+
+    uint32_t kind = options->coalesce ? message_kind(ctx, L, idx) : 0;
+
+    if (options->diff && ctx->diff_sessions > 0) {
+        struct ws_diff_stream *stream = diff_stream_for(ctx, L, idx);
+        if (stream) {
+            return diff_broadcast(ctx, stream, L, idx, kind);
+        }
+    }
+
+    // Encode once per format in use, before anything can't be undone
+    bool need[WS_FORMAT_COUNT] = {false};
+    struct per_session_storage *pss;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        need[pss->format] = true;
+    }
+
+    size_t offsets[WS_FORMAT_COUNT];
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (need[i]) {
+            offsets[i] = arena_push_value(&ctx->scratch, L, idx, i);
+        }
+    }
+
+    struct ws_payload *payloads[WS_FORMAT_COUNT] = {NULL};
+    bool failed                                  = false;
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (need[i]) {
+            failed |= !(payloads[i] = payload_from_scratch(ctx, offsets[i]));
+        }
+    }
+
+    size_t count = 0;
+    if (!failed) {
+        wl_list_for_each (pss, &ctx->sessions, link) {
+            count += session_queue(pss, payloads[pss->format], kind);
+        }
+    }
+
+    for (int i = 0; i < WS_FORMAT_COUNT; ++i) {
+        if (payloads[i]) {
+            payload_unref(ctx, payloads[i]);
+        }
+    }
+
+    if (failed) {
+        return luaL_error(L, "failed to allocate ws_payload");
+    }
+    return count;
+}
+
+// Stats of `client`, or summed over all clients if it is NULL
+bool
+websocket_stats(
+    struct websocket *self,
+    void *client,
+    struct websocket_stats *stats)
+{
+    struct context_user_data *ctx = (struct context_user_data *)self;
+
+    *stats = (struct websocket_stats){0};
+
+    struct per_session_storage *pss;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        if (client && pss->wsi != client) {
+            continue;
+        }
+
+        ++stats->clients;
+        stats->queued += pss->queued;
+        stats->queued_bytes += pss->queued_bytes;
+        stats->dropped += pss->dropped;
+        stats->coalesced += pss->coalesced;
+    }
+
+    return !client || stats->clients > 0;
+}
+
+// static void
+// append_message_fragment(
+//     struct per_session_storage *pss,
+//     void *in,
+//     size_t len,
+//     size_t remaining)
+// {
+//     // Make sure that `len` more fits into `pss->msg_buffer`
+//     if (!pss->recv_buffer || pss->recv_len + len > pss->recv_buffer_len) {
+//         pss->recv_buffer_len = pss->recv_len + len + remaining;
+//         pss->recv_buffer     = realloc(pss->recv_buffer, pss->recv_buffer_len);
+//     }
+
+//     // Append to buffer
+//     memcpy(pss->recv_buffer + pss->recv_len, in, len);
+//     pss->recv_len += len;
+// }
+
+struct msgpack_reader {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+};
+
+static const unsigned char *
+reader_take(lua_State *L, struct msgpack_reader *r, size_t n)
+{
+    if (r->len - r->pos < n) {
+        luaL_error(L, "truncated msgpack message");
+    }
+
+    const unsigned char *ptr = r->data + r->pos;
+    r->pos += n;
+    return ptr;
+}
+
+static uint64_t
+reader_be(lua_State *L, struct msgpack_reader *r, int bytes)
+{
+    const unsigned char *ptr = reader_take(L, r, bytes);
+
+    uint64_t n = 0;
+    for (int i = 0; i < bytes; ++i) {
+        n = n << 8 | ptr[i];
+    }
+    return n;
+}
+
+static void msgpack_read_value(
+    lua_State *L,
+    struct msgpack_reader *r,
+    int depth);
+
+static void
+msgpack_read_string(lua_State *L, struct msgpack_reader *r, size_t len)
+{
+    const unsigned char *str = reader_take(L, r, len);
+    lua_pushlstring(L, (const char *)str, len);
+}
+
+static void
+msgpack_read_array(lua_State *L, struct msgpack_reader *r, size_t n, int depth)
+{
+    // every item is at least one byte, don't preallocate for a bogus count
+    if (n > r->len - r->pos) {
+        luaL_error(L, "truncated msgpack message");
+    }
+
+    lua_createtable(L, n, 0);
+    for (size_t i = 1; i <= n; ++i) {
+        msgpack_read_value(L, r, depth + 1);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+static void
+msgpack_read_map(lua_State *L, struct msgpack_reader *r, size_t n, int depth)
+{
+    if (n > (r->len - r->pos) / 2) {
+        luaL_error(L, "truncated msgpack message");
+    }
+
+    lua_createtable(L, 0, n);
+    for (size_t i = 0; i < n; ++i) {
+        msgpack_read_value(L, r, depth + 1);
+        if (lua_isnil(L, -1)
+            || (lua_type(L, -1) == LUA_TNUMBER
+                && lua_tonumber(L, -1) != lua_tonumber(L, -1))) {
+            luaL_error(L, "invalid msgpack map key");
+        }
+        msgpack_read_value(L, r, depth + 1);
+        lua_rawset(L, -3);
+    }
+}
+
+static void
+msgpack_read_value(lua_State *L, struct msgpack_reader *r, int depth)
+{
+    if (depth >= MESSAGE_MAX_DEPTH) {
+        luaL_error(L, "msgpack nesting too deep");
+    }
+
+    luaL_checkstack(L, 3, "msgpack nesting too deep");
+
+    unsigned char tag = *reader_take(L, r, 1);
+
+    if (tag <= 0x7f) {
+        lua_pushnumber(L, tag);
+        return;
+    } else if (tag <= 0x8f) {
+        msgpack_read_map(L, r, tag & 0x0f, depth);
+        return;
+    } else if (tag <= 0x9f) {
+        msgpack_read_array(L, r, tag & 0x0f, depth);
+        return;
+    } else if (tag <= 0xbf) {
+        msgpack_read_string(L, r, tag & 0x1f);
+        return;
+    } else if (tag >= 0xe0) {
+        lua_pushnumber(L, (signed char)tag);
+        return;
+    }
+
+    switch (tag) {
+    case 0xc0:
+        lua_pushnil(L);
+        break;
+    case 0xc2:
+    case 0xc3:
+        lua_pushboolean(L, tag == 0xc3);
+        break;
+    case 0xc4: // bin 8, 16, 32 map to plain strings
+    case 0xd9: // str 8, 16, 32
+        msgpack_read_string(L, r, reader_be(L, r, 1));
+        break;
+    case 0xc5:
+    case 0xda:
+        msgpack_read_string(L, r, reader_be(L, r, 2));
+        break;
+    case 0xc6:
+    case 0xdb:
+        msgpack_read_string(L, r, reader_be(L, r, 4));
+        break;
+    case 0xca: {
+        uint32_t bits = reader_be(L, r, 4);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        lua_pushnumber(L, f);
+        break;
+    }
+    case 0xcb: {
+        uint64_t bits = reader_be(L, r, 8);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        lua_pushnumber(L, d);
+        break;
+    }
+    case 0xcc:
+        lua_pushnumber(L, reader_be(L, r, 1));
+        break;
+    case 0xcd:
+        lua_pushnumber(L, reader_be(L, r, 2));
+        break;
+    case 0xce:
+        lua_pushnumber(L, reader_be(L, r, 4));
+        break;
+    case 0xcf:
+        lua_pushnumber(L, reader_be(L, r, 8));
+        break;
+    case 0xd0:
+        lua_pushnumber(L, (int8_t)reader_be(L, r, 1));
+        break;
+    case 0xd1:
+        lua_pushnumber(L, (int16_t)reader_be(L, r, 2));
+        break;
+    case 0xd2:
+        lua_pushnumber(L, (int32_t)reader_be(L, r, 4));
+        break;
+    case 0xd3:
+        lua_pushnumber(L, (int64_t)reader_be(L, r, 8));
+        break;
+    case 0xdc:
+        msgpack_read_array(L, r, reader_be(L, r, 2), depth);
+        break;
+    case 0xdd:
+        msgpack_read_array(L, r, reader_be(L, r, 4), depth);
+        break;
+    case 0xde:
+        msgpack_read_map(L, r, reader_be(L, r, 2), depth);
+        break;
+    case 0xdf:
+        msgpack_read_map(L, r, reader_be(L, r, 4), depth);
+        break;
+    default:
+        // ext types have no meaning here
+        luaL_error(L, "unsupported msgpack type 0x%02x", tag);
+        break;
+    }
 }
 
-int
-websocket_send_msg(struct lua_State *L)
+// Decodes the message buffered in the session into a Lua value. Runs in
+// protected mode, malformed messages raise errors.
+static int
+msgpack_decode(lua_State *L)
 {
-    luaL_checkudata(L, 1, "kiwmi_server");
-    luaL_checktype(L, 2, LUA_TLIGHTUSERDATA);
-    luaL_checkany(L, 3);
+    struct per_session_storage *pss = lua_touserdata(L, 1);
+    struct msgpack_reader r         = {
+        .data = pss->rx,
+        .len  = pss->rx_len,
+        .pos  = 0,
+    };
 
-    struct lws *wsi                 = lua_touserdata(L, 2);
-    struct per_session_storage *pss = lws_wsi_user(wsi);
+    msgpack_read_value(L, &r, 0);
+    if (r.pos != r.len) {
+        return luaL_error(L, "trailing bytes after msgpack message");
+    }
 
-    struct send_msg *send_msg = malloc(sizeof(*send_msg));
+    return 1;
+}
 
-    lua_pushvalue(L, 3);
-    send_msg->buf = (unsigned char *)to_json(L, &send_msg->len);
-    // const char *str = lua_tolstring(L, 3, &send_msg->len);
-    // send_msg->buf   = malloc(send_msg->len + LWS_PRE);
-    // memcpy(send_msg->buf + LWS_PRE, str, send_msg->len);
-    // printf("send_msg: %.*s\n", (int)send_msg->len, send_msg->buf + LWS_PRE);
+static bool
+rx_append(struct per_session_storage *pss, const void *in, size_t len)
+{
+    if (pss->rx_len + len > RX_MAX_BYTES) {
+        return false;
+    }
 
-    wl_list_insert(&pss->send_queue, &send_msg->link);
+    if (pss->rx_len + len > pss->rx_cap) {
+        size_t cap = pss->rx_cap ? pss->rx_cap : RX_BUFFER_BYTES;
+        while (cap < pss->rx_len + len) {
+            cap *= 2;
+        }
 
-    lws_callback_on_writable(wsi);
+        unsigned char *rx = realloc(pss->rx, cap);
+        if (!rx) {
+            return false;
+        }
+        pss->rx     = rx;
+        pss->rx_cap = cap;
+    }
 
-    return 0;
+    memcpy(pss->rx + pss->rx_len, in, len);
+    pss->rx_len += len;
+    return true;
 }
 
-// static void
-// append_message_fragment(
-//     struct per_session_storage *pss,
-//     void *in,
-//     size_t len,
-//     size_t remaining)
-// {
-//     // Make sure that `len` more fits into `pss->msg_buffer`
-//     if (!pss->recv_buffer || pss->recv_len + len > pss->recv_buffer_len) {
-//         pss->recv_buffer_len = pss->recv_len + len + remaining;
-//         pss->recv_buffer     = realloc(pss->recv_buffer, pss->recv_buffer_len);
-//     }
+static bool
+is_resync(lua_State *L)
+{
+    bool resync = false;
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, "kind");
+        const char *kind = lua_tostring(L, -1);
+        resync           = kind && strcmp(kind, "resync") == 0;
+        lua_pop(L, 1);
+    }
+    return resync;
+}
 
-//     // Append to buffer
-//     memcpy(pss->recv_buffer + pss->recv_len, in, len);
-//     pss->recv_len += len;
-// }
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
+// Hands the decoded message on top of the stack to Lua, and pops it
 static void
 done_message(
     struct context_user_data *ctx,
@@ -236,13 +2069,36 @@ done_message(
 {
     // printf("done_message %.*s\n", (int)pss->recv_len, pss->recv_buffer);
 
+    // lws_service_fd() keeps delivering whatever it has read for as long as
+    // it likes. Once the budget is spent, the client's next messages wait
+    // for service_idle_cb() instead of running more Lua in this callback.
+    if (!pss->throttled && now_nsec() >= ctx->service_deadline) {
+        lws_rx_flow_control(wsi, 0);
+        pss->throttled = true;
+        ++ctx->throttled;
+    }
+
+    // resync requests are answered here, Lua never sees them
+    if (pss->diff && is_resync(ctx->L)) {
+        lua_pop(ctx->L, 1);
+        lua_checkstack(ctx->L, 3);
+        lua_pushcfunction(ctx->L, diff_resync);
+        lua_pushlightuserdata(ctx->L, ctx);
+        lua_pushlightuserdata(ctx->L, pss);
+        if (lua_pcall(ctx->L, 2, 0, 0)) {
+            wlr_log(WLR_ERROR, "%s", lua_tostring(ctx->L, -1));
+            lua_pop(ctx->L, 1);
+        }
+        return;
+    }
+
     if (ctx->recv_ref != LUA_NOREF) {
         lua_checkstack(ctx->L, 3); // TODO: needed?
         lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, ctx->recv_ref);
         lua_pushlightuserdata(ctx->L, wsi);
 
         // lua_pushlstring(ctx->L, pss->recv_buffer, pss->recv_len);
-        lua_rawgeti(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.res_ref);
+        lua_pushvalue(ctx->L, -3);
 
         if (lua_pcall(ctx->L, 2, 0, 0)) {
             wlr_log(WLR_ERROR, "%s", lua_tostring(ctx->L, -1));
@@ -251,135 +2107,116 @@ done_message(
     } else {
         wlr_log(WLR_ERROR, "%s: %s", __func__, "no recv_ref, ignoring message");
     }
+    lua_pop(ctx->L, 1);
 
     // pss->recv_len = 0;
 }
 
+// Stores the value on top of the stack into the innermost open container
+static void
+json_parse_store(struct json_parse *jp)
+{
+    if (jp->levels[jp->depth - 1].object) {
+        lua_rawset(jp->T, -3);
+    } else {
+        lua_rawseti(jp->T, -2, ++jp->levels[jp->depth - 1].len);
+    }
+}
+
 signed char
 json_cb(struct lejp_ctx *json_ctx, char reason)
 {
     struct json_parse *jp = json_ctx->user;
+    lua_State *T          = jp->T;
 
     switch (reason) {
-    case LEJPCB_PAIR_NAME:
-        lua_checkstack(jp->L, 1);
-        lua_pushstring(jp->L, json_ctx->path + json_ctx->st[json_ctx->sp].p);
-        jp->key_ref = luaL_ref(jp->L, LUA_REGISTRYINDEX);
+    case LEJPCB_PAIR_NAME: {
+        const char *key = json_ctx->path + json_ctx->st[json_ctx->sp].p;
+        if (!lua_checkstack(T, 1)) {
+            return -1;
+        }
+        lua_pushlstring(T, key, json_ctx->ppos - json_ctx->st[json_ctx->sp].p);
         break;
+    }
     case LEJPCB_VAL_TRUE:
     case LEJPCB_VAL_FALSE:
     case LEJPCB_VAL_NULL:
     case LEJPCB_VAL_NUM_INT:
     case LEJPCB_VAL_NUM_FLOAT:
+    case LEJPCB_VAL_STR_CHUNK:
     case LEJPCB_VAL_STR_END:
-        lua_checkstack(jp->L, 4);
-
-        // get the stack
-        lua_rawgeti(jp->L, LUA_REGISTRYINDEX, jp->stack_ref);
-
-        // get the table
-        lua_rawgeti(jp->L, -1, jp->stack_top);
-
-        // get the key
-        if (jp->key_ref != LUA_NOREF) {
-            // object
-            lua_rawgeti(jp->L, LUA_REGISTRYINDEX, jp->key_ref);
-            luaL_unref(jp->L, LUA_REGISTRYINDEX, jp->key_ref);
-            jp->key_ref = LUA_NOREF;
-        } else {
-            // array
-            lua_pushnumber(jp->L, json_ctx->i[json_ctx->ipos - 1] + 1);
+        if (jp->depth == 0 || !lua_checkstack(T, 2)) {
+            return -1;
         }
 
-        // create the value
         switch (reason) {
         case LEJPCB_VAL_TRUE:
-            lua_pushboolean(jp->L, true);
+            lua_pushboolean(T, true);
             break;
         case LEJPCB_VAL_FALSE:
-            lua_pushboolean(jp->L, false);
+            lua_pushboolean(T, false);
             break;
         case LEJPCB_VAL_NULL:
-            lua_pushnil(jp->L);
+            lua_pushnil(T);
             break;
         case LEJPCB_VAL_NUM_INT:
-            lua_pushinteger(jp->L, atoll(json_ctx->buf));
+            lua_pushinteger(T, atoll(json_ctx->buf));
             break;
         case LEJPCB_VAL_NUM_FLOAT:
-            lua_pushnumber(jp->L, atof(json_ctx->buf));
+            lua_pushnumber(T, atof(json_ctx->buf));
             break;
+        case LEJPCB_VAL_STR_CHUNK:
         case LEJPCB_VAL_STR_END:
-            lua_pushstring(jp->L, json_ctx->buf);
+            // long strings arrive in pieces, join them as they come in
+            lua_pushlstring(T, json_ctx->buf, json_ctx->npos);
+            if (jp->chunked) {
+                lua_concat(T, 2);
+            }
+            jp->chunked = reason == LEJPCB_VAL_STR_CHUNK;
+            if (jp->chunked) {
+                return 0;
+            }
             break;
         }
 
-        // set the value in the table
-        lua_rawset(jp->L, -3);
-
-        lua_pop(jp->L, 2);
+        json_parse_store(jp);
         break;
     case LEJPCB_OBJECT_START:
     case LEJPCB_ARRAY_START:
-        lua_checkstack(jp->L, 5);
-
-        // get the stack
-        lua_rawgeti(jp->L, LUA_REGISTRYINDEX, jp->stack_ref);
-
-        // create the new table
-        lua_newtable(jp->L);
-
-        if (jp->stack_top > 0) {
-            // get the table
-            lua_rawgeti(jp->L, -2, jp->stack_top);
-
-            // get the key
-            if (jp->key_ref != LUA_NOREF) {
-                // object
-                lua_rawgeti(jp->L, LUA_REGISTRYINDEX, jp->key_ref);
-                luaL_unref(jp->L, LUA_REGISTRYINDEX, jp->key_ref);
-                jp->key_ref = LUA_NOREF;
-            } else {
-                // array
-                lua_pushnumber(jp->L, json_ctx->i[json_ctx->ipos - 1] + 1);
-            }
-
-            // duplicate the new table
-            lua_pushvalue(jp->L, -3);
-
-            // set the new table in the table
-            lua_rawset(jp->L, -3);
-
-            lua_pop(jp->L, 1);
+        // only one document per message
+        if (jp->done || jp->depth == LEJP_MAX_DEPTH || !lua_checkstack(T, 2)) {
+            return -1;
         }
 
-        // push the new table on the stack
-        lua_rawseti(jp->L, -2, ++jp->stack_top);
-
-        lua_pop(jp->L, 1);
+        lua_newtable(T);
+        jp->levels[jp->depth].object = reason == LEJPCB_OBJECT_START;
+        jp->levels[jp->depth].len    = 0;
+        ++jp->depth;
         break;
     case LEJPCB_OBJECT_END:
     case LEJPCB_ARRAY_END:
-        lua_checkstack(jp->L, 2);
-
-        // get the stack
-        lua_rawgeti(jp->L, LUA_REGISTRYINDEX, jp->stack_ref);
-
-        if (jp->stack_top == 1) {
-            lua_rawgeti(jp->L, -1, jp->stack_top);
-            jp->res_ref = luaL_ref(jp->L, LUA_REGISTRYINDEX);
+        if (--jp->depth > 0) {
+            json_parse_store(jp);
+        } else {
+            jp->done = true;
         }
-
-        // pop the table from the stack
-        lua_pushnil(jp->L);
-        lua_rawseti(jp->L, -2, jp->stack_top--);
-
-        lua_pop(jp->L, 1);
         break;
     }
 
     return 0;
 }
 
+static void
+json_parse_reset(struct json_parse *jp)
+{
+    lua_settop(jp->T, 0);
+    jp->rejected = false;
+    jp->done     = false;
+    jp->chunked  = false;
+    jp->depth    = 0;
+    lejp_construct(&jp->lejp_ctx, json_cb, jp, NULL, 0);
+}
+
 static int
 cb_main(
     struct lws *wsi,
@@ -395,18 +2232,47 @@ cb_main(
     case LWS_CALLBACK_ESTABLISHED: {
         // printf("connected, calling %d\n", ctx->connect_ref);
 
-        wl_list_init(&pss->send_queue);
+        pss->arena        = (struct ws_arena){0};
+        pss->queued       = 0;
+        pss->queued_bytes = 0;
+        pss->dropped      = 0;
+        pss->coalesced    = 0;
+        pss->wsi          = wsi;
+        pss->throttled    = false;
+        pss->format       = lws_get_protocol(wsi)->id;
+        memset(pss->live, 0, sizeof(pss->live));
+        wl_list_insert(ctx->sessions.prev, &pss->link);
+
+        pss->rx          = NULL;
+        pss->rx_len      = 0;
+        pss->rx_cap      = 0;
+        pss->rx_rejected = false;
+
+        // the headers are still around at this point
+        char arg[16];
+        const char *diff = lws_get_urlarg_by_name(wsi, "diff=", arg, 16);
+        bool want_diff   = diff && strcmp(diff, "0") != 0;
+
+        // patches are json only
+        pss->diff   = want_diff && pss->format == WS_FORMAT_JSON;
+        pss->synced = 0;
+        if (pss->diff) {
+            ++ctx->diff_sessions;
+        }
+
+        if (ctx->listen_deflate > 0) {
+            // fails harmlessly if the client didn't negotiate deflate
+            char level[4];
+            snprintf(level, sizeof(level), "%d", ctx->listen_deflate);
+            lws_set_extension_option(
+                wsi, "permessage-deflate", "compression_level", level);
+        }
 
         // set up json_parse
-        pss->json_parse.L = ctx->L;
-        lejp_construct(
-            &pss->json_parse.lejp_ctx, json_cb, &pss->json_parse, NULL, 0);
         lua_checkstack(ctx->L, 1);
-        lua_newtable(ctx->L);
-        pss->json_parse.stack_ref = luaL_ref(ctx->L, LUA_REGISTRYINDEX);
-        pss->json_parse.key_ref   = LUA_NOREF;
-        pss->json_parse.res_ref   = LUA_NOREF;
-        pss->json_parse.stack_top = 0;
+        pss->json_parse.T          = lua_newthread(ctx->L);
+        pss->json_parse.thread_ref = luaL_ref(ctx->L, LUA_REGISTRYINDEX);
+        json_parse_reset(&pss->json_parse);
 
         // pss->recv_buffer     = NULL;
         // pss->recv_buffer_len = 0;
@@ -435,6 +2301,20 @@ cb_main(
             }
         }
 
+        if (pss->wsi) {
+            wl_list_remove(&pss->link);
+            arena_fini(ctx, &pss->arena);
+            if (pss->diff) {
+                --ctx->diff_sessions;
+            }
+            free(pss->rx);
+            luaL_unref(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.thread_ref);
+            if (pss->throttled) {
+                --ctx->throttled;
+            }
+            pss->wsi = NULL;
+        }
+
         // free(pss->recv_buffer);
         break;
     }
@@ -442,6 +2322,38 @@ cb_main(
         const size_t remaining = lws_remaining_packet_payload(wsi);
         // printf("fragment: %.*s\n", (int)len, (const char *)in);
 
+        if (pss->format == WS_FORMAT_MSGPACK) {
+            if (!pss->rx_rejected && !rx_append(pss, in, len)) {
+                pss->rx_rejected = true;
+                wlr_log(
+                    WLR_ERROR,
+                    "%s: msgpack message too large, ignoring",
+                    __func__);
+            }
+
+            if (remaining == 0 && lws_is_final_fragment(wsi)) {
+                if (!pss->rx_rejected) {
+                    lua_checkstack(ctx->L, 2);
+                    lua_pushcfunction(ctx->L, msgpack_decode);
+                    lua_pushlightuserdata(ctx->L, pss);
+                    if (lua_pcall(ctx->L, 1, 1, 0)) {
+                        wlr_log(
+                            WLR_ERROR,
+                            "%s: %s, ignoring",
+                            __func__,
+                            lua_tostring(ctx->L, -1));
+                        lua_pop(ctx->L, 1);
+                    } else {
+                        done_message(ctx, pss, wsi);
+                    }
+                }
+
+                pss->rx_len      = 0;
+                pss->rx_rejected = false;
+            }
+            break;
+        }
+
         if (!pss->json_parse.rejected) {
             int reason = lejp_parse(&pss->json_parse.lejp_ctx, in, len);
             if (reason < 0 && reason != LEJP_CONTINUE) {
@@ -456,38 +2368,70 @@ cb_main(
         // append_message_fragment(pss, in, len, remaining);
 
         if (remaining == 0 && lws_is_final_fragment(wsi)) {
-            if (!pss->json_parse.rejected) {
+            struct json_parse *jp = &pss->json_parse;
+            if (!jp->rejected && !jp->done) {
+                wlr_log(WLR_ERROR, "%s: incomplete json, ignoring", __func__);
+            } else if (!jp->rejected) {
+                lua_checkstack(ctx->L, 1);
+                lua_xmove(jp->T, ctx->L, 1);
                 done_message(ctx, pss, wsi);
             }
 
-            luaL_unref(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.res_ref);
-            pss->json_parse.res_ref = LUA_NOREF;
-
-            luaL_unref(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.key_ref);
-            pss->json_parse.key_ref = LUA_NOREF;
-
-            luaL_unref(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.stack_ref);
-            pss->json_parse.stack_ref = LUA_NOREF;
-
-            // reinit json_parse
-            pss->json_parse.rejected = false;
-            lejp_construct(
-                &pss->json_parse.lejp_ctx, json_cb, &pss->json_parse, NULL, 0);
-            lua_checkstack(ctx->L, 1);
-            lua_newtable(ctx->L);
-            luaL_unref(ctx->L, LUA_REGISTRYINDEX, pss->json_parse.stack_ref);
-            pss->json_parse.stack_ref = luaL_ref(ctx->L, LUA_REGISTRYINDEX);
-            pss->json_parse.stack_top = 0;
+            json_parse_reset(jp);
         }
         break;
     }
     case LWS_CALLBACK_SERVER_WRITEABLE: {
-        struct send_msg *i, *tmp;
-        wl_list_for_each_safe (i, tmp, &pss->send_queue, link) {
-            lws_write(wsi, i->buf + LWS_PRE, i->len, LWS_WRITE_TEXT);
-            free(i->buf);
-            wl_list_remove(&i->link);
-            free(i);
+        struct ws_arena *arena = &pss->arena;
+        while (arena->head < arena->len) {
+            // lws keeps the rest of a short write and flushes it before the
+            // next callback, so only hand it more while the pipe has room
+            if (lws_send_pipe_choked(wsi)) {
+                lws_callback_on_writable(wsi);
+                break;
+            }
+
+            struct send_msg *msg =
+                (struct send_msg *)(arena->data + arena->head);
+            if (!msg->superseded) {
+                int n = lws_write(
+                    wsi,
+                    send_msg_payload(msg),
+                    msg->len,
+                    pss->format == WS_FORMAT_MSGPACK ? LWS_WRITE_BINARY
+                                                     : LWS_WRITE_TEXT);
+                if (n < 0) {
+                    // the connection is gone, CLOSED cleans up the rest
+                    return -1;
+                }
+                --pss->queued;
+                pss->queued_bytes -= msg->len;
+                if (msg->kind != 0) {
+                    pss->live[msg->kind] = 0;
+                }
+            }
+
+            if (msg->shared) {
+                payload_unref(ctx, msg->shared);
+            }
+            arena->head += send_msg_size(msg->len, msg->shared);
+        }
+
+        if (arena->head == arena->len) {
+            arena_reset(arena);
+        } else if (arena->head >= arena->len - arena->head) {
+            // Mostly sent, move the rest to the front instead of growing
+            memmove(
+                arena->data,
+                arena->data + arena->head,
+                arena->len - arena->head);
+            arena->len -= arena->head;
+            for (size_t i = 1; i <= MAX_KINDS; ++i) {
+                if (pss->live[i] != 0) {
+                    pss->live[i] -= arena->head;
+                }
+            }
+            arena->head = 0;
         }
         break;
     }
@@ -498,10 +2442,81 @@ cb_main(
     return 0;
 }
 
+// Lets the sessions that done_message() paused receive again
+static void
+service_resume(struct context_user_data *ctx)
+{
+    struct per_session_storage *pss;
+    wl_list_for_each (pss, &ctx->sessions, link) {
+        if (ctx->throttled == 0) {
+            break;
+        }
+        if (pss->throttled) {
+            pss->throttled = false;
+            --ctx->throttled;
+            lws_rx_flow_control(pss->wsi, 1);
+        }
+    }
+}
+
+// Runs the work lws has pending (buffered rx, partial tx, ...) until there
+// is none left or `deadline` has passed. Returns whether work is left,
+// including sessions that have to be resumed later.
+static bool
+service_pending(struct lws_context *context, uint64_t deadline)
+{
+    struct context_user_data *ctx = lws_context_user(context);
+    ctx->service_deadline         = deadline;
+
+    while (lws_service_adjust_timeout(context, 1, 0) == 0) {
+        if (now_nsec() >= deadline) {
+            return true;
+        }
+        lws_service_tsi(context, -1, 0);
+    }
+    return ctx->throttled > 0;
+}
+
+static int
+service_timer_cb(void *data)
+{
+    struct context_user_data *ctx = data;
+
+    ++ctx->servicing;
+    service_resume(ctx);
+    if (service_pending(ctx->context, now_nsec() + SERVICE_BUDGET_NSEC)) {
+        wl_event_source_timer_update(ctx->service_timer, 1);
+    }
+    --ctx->servicing;
+    return 0;
+}
+
+// Runs at the end of the current event loop iteration, after everything
+// else that was ready.
+static void
+service_idle_cb(void *data)
+{
+    struct context_user_data *ctx = data;
+    ctx->service_idle             = NULL;
+
+    ++ctx->servicing;
+    service_resume(ctx);
+    if (service_pending(ctx->context, now_nsec() + SERVICE_BUDGET_NSEC)) {
+        // Another idle source would run right away in the same iteration,
+        // the timer gives the other sources a turn first.
+        wl_event_source_timer_update(ctx->service_timer, 1);
+    }
+    --ctx->servicing;
+}
+
 int
 event_source_cb(int fd, uint32_t mask, void *data)
 {
-    struct lws_context *context = data;
+    struct lws_context *context   = data;
+    struct context_user_data *ctx = lws_context_user(context);
+    uint64_t deadline             = now_nsec() + SERVICE_BUDGET_NSEC;
+    ctx->service_deadline         = deadline;
+    ++ctx->servicing;
 
     struct lws_pollfd p = {
         .fd      = fd,
@@ -524,11 +2539,14 @@ event_source_cb(int fd, uint32_t mask, void *data)
     //     mask,
     //     srv_r);
 
-    // idk what could go wrong? this is supposed to be at the end of the event loop
-    while (lws_service_adjust_timeout(context, 1, 0) == 0) {
-        lws_service_tsi(context, -1, 0);
+    // Whatever doesn't fit in the budget waits until the rest of the event
+    // loop had its turn
+    if (service_pending(context, deadline) && !ctx->service_idle) {
+        ctx->service_idle =
+            wl_event_loop_add_idle(ctx->event_loop, service_idle_cb, ctx);
     }
 
+    --ctx->servicing;
     return 0;
 }
 
@@ -537,13 +2555,24 @@ struct pt_eventlibs_custom {
     struct context_user_data *ctx;
 };
 struct wsi_eventlibs_custom {
-    struct wl_event_source *event_source;
+    struct wl_event_source *event_source; // NULL if the fd is not ours
     uint32_t event_mask;
 };
 
-// HACK: Should be `wsi->evlib_wsi`, but we don't have access to the headers.
-// Offset obtained by looking at the memory in gdb.
-// #define wsi_to_priv(wsi) ((void *)wsi + 0x178)
+// Fds are small and dense, so a plain array indexed by them does the job of
+// the wsi evlib area, which would need the private lws headers.
+static struct wsi_eventlibs_custom *
+wsi_priv(struct lws *wsi)
+{
+    struct pt_eventlibs_custom *priv = lws_evlib_wsi_to_evlib_pt(wsi);
+    struct context_user_data *ctx    = priv->ctx;
+
+    int fd = lws_get_socket_fd(wsi);
+    if (fd < 0 || (size_t)fd >= ctx->fds_len || !ctx->fds[fd].event_source) {
+        return NULL;
+    }
+    return &ctx->fds[fd];
+}
 
 static int
 init_pt_custom(struct lws_context *cx, void *loop, int tsi)
@@ -562,16 +2591,28 @@ sock_accept_custom(struct lws *wsi)
     struct pt_eventlibs_custom *priv = lws_evlib_wsi_to_evlib_pt(wsi);
     struct context_user_data *ctx    = priv->ctx;
 
-    // struct wsi_eventlibs_custom *priv_wsi = wsi_to_priv(wsi);
-    // create lua registry entry
-    lua_pushlightuserdata(ctx->L, wsi);
-    struct wsi_eventlibs_custom *priv_wsi =
-        lua_newuserdata(ctx->L, sizeof(struct wsi_eventlibs_custom));
-    lua_rawset(ctx->L, LUA_REGISTRYINDEX);
+    int fd = lws_get_socket_fd(wsi);
+    if (fd < 0) {
+        return -1;
+    }
 
-    // memset(priv_wsi, 'A', sizeof(struct wsi_eventlibs_custom) + 128);
+    if ((size_t)fd >= ctx->fds_len) {
+        size_t len = ctx->fds_len ? ctx->fds_len : 16;
+        while (len <= (size_t)fd) {
+            len *= 2;
+        }
 
-    int fd = lws_get_socket_fd(wsi);
+        struct wsi_eventlibs_custom *fds =
+            realloc(ctx->fds, len * sizeof(*fds));
+        if (!fds) {
+            return -1;
+        }
+        memset(fds + ctx->fds_len, 0, (len - ctx->fds_len) * sizeof(*fds));
+        ctx->fds     = fds;
+        ctx->fds_len = len;
+    }
+
+    struct wsi_eventlibs_custom *priv_wsi = &ctx->fds[fd];
     // printf(
     //     "%s context=%p priv=%p fd=%d priv_wsi=%p ctx=%p\n",
     //     __func__,
@@ -584,6 +2625,9 @@ sock_accept_custom(struct lws *wsi)
     priv_wsi->event_mask   = WL_EVENT_READABLE;
     priv_wsi->event_source = wl_event_loop_add_fd(
         priv->event_loop, fd, priv_wsi->event_mask, event_source_cb, context);
+    if (!priv_wsi->event_source) {
+        return -1;
+    }
 
     // priv_wsi->event_mask     = POLLIN;
     // struct epoll_event event = {
@@ -600,15 +2644,10 @@ sock_accept_custom(struct lws *wsi)
 static void
 io_custom(struct lws *wsi, unsigned int flags)
 {
-    struct pt_eventlibs_custom *priv = lws_evlib_wsi_to_evlib_pt(wsi);
-    struct context_user_data *ctx    = priv->ctx;
-
-    // struct wsi_eventlibs_custom *priv_wsi = wsi_to_priv(wsi);
-    lua_checkstack(ctx->L, 3);
-    lua_pushlightuserdata(ctx->L, wsi);
-    lua_rawget(ctx->L, LUA_REGISTRYINDEX);
-    struct wsi_eventlibs_custom *priv_wsi = lua_touserdata(ctx->L, -1);
-    lua_pop(ctx->L, 1);
+    struct wsi_eventlibs_custom *priv_wsi = wsi_priv(wsi);
+    if (!priv_wsi) {
+        return;
+    }
 
     uint32_t event_mask = priv_wsi->event_mask;
     if (flags & LWS_EV_START) {
@@ -654,18 +2693,14 @@ io_custom(struct lws *wsi, unsigned int flags)
 static int
 wsi_logical_close_custom(struct lws *wsi)
 {
-    struct pt_eventlibs_custom *priv = lws_evlib_wsi_to_evlib_pt(wsi);
-    struct context_user_data *ctx    = priv->ctx;
-
-    // struct wsi_eventlibs_custom *priv_wsi = wsi_to_priv(wsi);
-    lua_checkstack(ctx->L, 3);
-    lua_pushlightuserdata(ctx->L, wsi);
-    lua_rawget(ctx->L, LUA_REGISTRYINDEX);
-    struct wsi_eventlibs_custom *priv_wsi = lua_touserdata(ctx->L, -1);
-    lua_pop(ctx->L, 1);
+    struct wsi_eventlibs_custom *priv_wsi = wsi_priv(wsi);
+    if (!priv_wsi) {
+        return 0;
+    }
 
     // printf("%s\n", __func__);
     wl_event_source_remove(priv_wsi->event_source);
+    priv_wsi->event_source = NULL;
 
     // int fd = lws_get_socket_fd(wsi);
     // if (epoll_ctl(global_efd, EPOLL_CTL_DEL, fd, NULL) == -1)
@@ -682,7 +2717,6 @@ static const struct lws_event_loop_ops event_loop_ops_custom = {
     .io                    = io_custom,
     .wsi_logical_close     = wsi_logical_close_custom,
     .evlib_size_pt         = sizeof(struct pt_eventlibs_custom),
-    // .evlib_size_wsi        = sizeof(struct wsi_eventlibs_custom),
 };
 
 static const lws_plugin_evlib_t evlib_custom = {
@@ -696,20 +2730,147 @@ static const lws_plugin_evlib_t evlib_custom = {
     .ops = &event_loop_ops_custom,
 };
 
-struct websocket *
-websocket_init(struct lua_State *L, struct wl_event_loop *event_loop)
+static void
+websocket_stop(struct context_user_data *ctx)
 {
-    struct context_user_data *ctx = malloc(sizeof(*ctx));
+    if (ctx->service_idle) {
+        wl_event_source_remove(ctx->service_idle);
+        ctx->service_idle = NULL;
+    }
+    if (ctx->service_timer) {
+        wl_event_source_timer_update(ctx->service_timer, 0);
+    }
 
-    *ctx = (struct context_user_data){
-        .L           = L,
-        .connect_ref = LUA_NOREF,
-        .recv_ref    = LUA_NOREF,
-        .close_ref   = LUA_NOREF,
-    };
+    if (ctx->context) {
+        // closes all sessions, running the close callbacks
+        ++ctx->servicing;
+        lws_context_destroy(ctx->context);
+        --ctx->servicing;
+        ctx->context = NULL;
+    }
+
+    free(ctx->listen_address);
+    free(ctx->listen_unix_path);
+    ctx->listen_address   = NULL;
+    ctx->listen_unix_path = NULL;
+    ctx->listen_port      = 0;
+    ctx->listen_deflate   = 0;
+}
+
+// Offered to every client, lws only compresses for the ones that accept it.
+// Message sizes aren't known to lws ahead of the write, so there is no
+// per-message opt-out: once negotiated, everything on that session goes
+// through deflate.
+static const struct lws_extension extensions[] = {
+    {
+        "permessage-deflate",
+        lws_extension_callback_pm_deflate,
+        "permessage-deflate; client_no_context_takeover; "
+        "client_max_window_bits",
+    },
+    {NULL, NULL, NULL},
+};
+
+static bool
+str_equal(const char *a, const char *b)
+{
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void
+listen_deferred_clear(struct context_user_data *ctx)
+{
+    if (ctx->listen_deferred) {
+        wl_event_source_remove(ctx->listen_deferred);
+        ctx->listen_deferred = NULL;
+    }
+
+    free((char *)ctx->listen_next.address);
+    free((char *)ctx->listen_next.unix_path);
+    ctx->listen_next      = (struct websocket_listen_options){0};
+    ctx->listen_next_stop = false;
+}
+
+static void
+listen_deferred_cb(void *data)
+{
+    struct context_user_data *ctx = data;
+    ctx->listen_deferred          = NULL;
+
+    struct websocket_listen_options options = ctx->listen_next;
+    bool stop                               = ctx->listen_next_stop;
+    ctx->listen_next      = (struct websocket_listen_options){0};
+    ctx->listen_next_stop = false;
+
+    websocket_listen((struct websocket *)ctx, stop ? NULL : &options);
+
+    free((char *)options.address);
+    free((char *)options.unix_path);
+}
+
+// Lua handlers run from inside lws, where destroying the context would pull
+// the wsi out from under it. The restart waits until lws has returned.
+static bool
+listen_defer(
+    struct context_user_data *ctx,
+    const struct websocket_listen_options *options)
+{
+    listen_deferred_clear(ctx);
+
+    if (options) {
+        ctx->listen_next = *options;
+        ctx->listen_next.address =
+            options->address ? strdup(options->address) : NULL;
+        ctx->listen_next.unix_path =
+            options->unix_path ? strdup(options->unix_path) : NULL;
+        if ((options->address && !ctx->listen_next.address)
+            || (options->unix_path && !ctx->listen_next.unix_path)) {
+            listen_deferred_clear(ctx);
+            return false;
+        }
+    }
+    ctx->listen_next_stop = !options;
+
+    ctx->listen_deferred =
+        wl_event_loop_add_idle(ctx->event_loop, listen_deferred_cb, ctx);
+    if (!ctx->listen_deferred) {
+        listen_deferred_clear(ctx);
+        return false;
+    }
+    return true;
+}
+
+bool
+websocket_listen(
+    struct websocket *self,
+    const struct websocket_listen_options *options)
+{
+    struct context_user_data *ctx = (struct context_user_data *)self;
+    ctx->listen_configured        = true;
+
+    // Configs get reloaded, don't drop the clients for nothing
+    if (ctx->context && options
+        && str_equal(ctx->listen_address, options->address)
+        && str_equal(ctx->listen_unix_path, options->unix_path)
+        && (options->unix_path || ctx->listen_port == options->port)
+        && ctx->listen_deflate == options->deflate) {
+        listen_deferred_clear(ctx);
+        return true;
+    }
+
+    if (ctx->servicing > 0) {
+        return listen_defer(ctx, options);
+    }
+
+    listen_deferred_clear(ctx);
+    websocket_stop(ctx);
+
+    if (!options) {
+        return true;
+    }
 
     struct pt_eventlibs_custom loop_var = {
-        .event_loop = event_loop,
+        .event_loop = ctx->event_loop,
         .ctx        = ctx,
     };
 
@@ -723,26 +2884,94 @@ websocket_init(struct lua_State *L, struct wl_event_loop *event_loop)
             .callback              = cb_main,
             .per_session_data_size = sizeof(struct per_session_storage),
             .rx_buffer_size        = RX_BUFFER_BYTES,
+            .id                    = WS_FORMAT_JSON,
+        },
+        {
+            .name                  = "main.msgpack",
+            .callback              = cb_main,
+            .per_session_data_size = sizeof(struct per_session_storage),
+            .rx_buffer_size        = RX_BUFFER_BYTES,
+            .id                    = WS_FORMAT_MSGPACK,
         },
         LWS_PROTOCOL_LIST_TERM,
     };
+    // lws keeps pointing at these, so they have to outlive the context
+    memcpy(ctx->protocols, protocols, sizeof(protocols));
+
     struct lws_context_creation_info info = {
         .gid              = -1,
         .uid              = -1,
         .user             = ctx,
-        .iface            = "127.0.0.1",
-        .port             = 8000,
-        .protocols        = protocols,
+        .iface            = options->address,
+        .port             = options->port,
+        .protocols        = ctx->protocols,
         .event_lib_custom = &evlib_custom,
         .foreign_loops    = (void *[]){&loop_var},
     };
+    if (options->deflate > 0) {
+        info.extensions = extensions;
+    }
+    if (options->unix_path) {
+        // lws takes the socket path in place of the interface
+        info.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+        info.iface = options->unix_path;
+        info.port  = 0;
+    }
 
     // global_efd = epoll_create1(0);
 
     lws_set_log_level(LLL_WARN | LLL_ERR, NULL);
-    struct lws_context *context = lws_create_context(&info);
+    ctx->context = lws_create_context(&info);
+    if (!ctx->context) {
+        wlr_log(WLR_ERROR, "%s: failed to create lws context", __func__);
+        return false;
+    }
+
+    // failing to copy these only means the next call restarts the listener
+    ctx->listen_port    = options->port;
+    ctx->listen_deflate = options->deflate;
+    if (options->address) {
+        ctx->listen_address = strdup(options->address);
+    }
+    if (options->unix_path) {
+        ctx->listen_unix_path = strdup(options->unix_path);
+    }
+
+    if (options->unix_path) {
+        wlr_log(WLR_INFO, "websocket listening on %s", options->unix_path);
+    } else {
+        wlr_log(
+            WLR_INFO,
+            "websocket listening on %s:%d",
+            options->address ? options->address : "*",
+            options->port);
+    }
+
+    return true;
+}
+
+// Nothing listens until websocket_listen() is called, or callbacks are
+// registered without it
+struct websocket *
+websocket_init(struct lua_State *L, struct wl_event_loop *event_loop)
+{
+    struct context_user_data *ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+
+    *ctx = (struct context_user_data){
+        .L           = L,
+        .connect_ref = LUA_NOREF,
+        .recv_ref    = LUA_NOREF,
+        .close_ref   = LUA_NOREF,
+        .event_loop  = event_loop,
+    };
+    wl_list_init(&ctx->sessions);
+    wl_list_init(&ctx->diff_streams);
 
-    ctx->context = context;
+    ctx->service_timer =
+        wl_event_loop_add_timer(event_loop, service_timer_cb, ctx);
 
     return (struct websocket *)ctx;
 
@@ -772,11 +3001,33 @@ void
 websocket_fini(struct websocket *self)
 {
     struct context_user_data *ctx = (struct context_user_data *)self;
-    lws_context_destroy(ctx->context);
+
+    websocket_stop(ctx);
+    listen_deferred_clear(ctx);
+    if (ctx->service_timer) {
+        wl_event_source_remove(ctx->service_timer);
+    }
+    if (ctx->listen_default) {
+        wl_event_source_remove(ctx->listen_default);
+    }
 
     luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->connect_ref);
     luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->recv_ref);
     luaL_unref(ctx->L, LUA_REGISTRYINDEX, ctx->close_ref);
 
+    arena_fini(ctx, &ctx->scratch);
+    free(ctx->spare);
+    free(ctx->fds);
+
+    struct ws_diff_stream *stream, *tmp;
+    wl_list_for_each_safe (stream, tmp, &ctx->diff_streams, link) {
+        diff_stream_destroy(stream);
+    }
+    free(ctx->diff_path);
+
+    for (size_t i = 0; i < ctx->kind_count; ++i) {
+        free(ctx->kinds[i]);
+    }
+
     free(ctx);
 }
@@ -11,6 +11,15 @@ kiwmi = {}
 function kiwmi:active_output()
 end
 
+---Moves, resizes and shows (or hides) many views in one call, along with scene nodes belonging to them.
+---The views are moved and shown together, once every resized client has drawn its new size (showing the old
+---contents until then), or after `timeout` milliseconds (default 200, 0 applies immediately). Nodes are applied
+---right away. Views and nodes that no longer exist are skipped.
+---@param entries { view: kiwmi_view, x?: number, y?: number, w?: number, h?: number, hidden?: boolean, nodes?: { [1]: scene_node, [2]: number, [3]: number, [4]?: number, [5]?: number }[] }[]
+---@param options? { timeout?: number }
+function kiwmi:apply_layout(entries, options)
+end
+
 ---Sets the background color (shown behind all views).
 ---@param color string The color in the format #rrggbb.
 function kiwmi:bg_color(color)
@@ -20,6 +29,14 @@ end
 function kiwmi:cursor()
 end
 
+---Sets how the focus is handled. Each call replaces the previous policy.
+---With `follow_mouse`, the view the cursor is moved onto gets focused once the cursor stayed on it for `delay_ms`
+---(0 by default). Views that end up under a resting cursor, e.g. after a layout change, don't take the focus. `on_change` is called with the focused view, or `nil`, whenever the focused view changes, whatever
+---changed it.
+---@param policy { follow_mouse: boolean|nil, delay_ms: integer|nil, on_change: fun(view: kiwmi_view|nil)|nil }
+function kiwmi:focus_policy(policy)
+end
+
 ---@return kiwmi_view view The currently focused view.
 function kiwmi:focused_view()
 end
@@ -90,6 +107,26 @@ end
 function kiwmi:view_at(lx, ly)
 end
 
+---Sends `msg` to every websocket client, encoded once per format.
+---`coalesce` works as for `ws_send`. With `diff`, clients that connected with `?diff=1` get a table with a string
+---`kind` as a stream of patches against the last one, and nothing if it didn't change, so only use it for state.
+---Both default to `true` for `kind = "layout_state"`, `false` otherwise.
+---@param msg any
+---@param options? { coalesce?: boolean, diff?: boolean }
+---@return integer count The number of clients it was queued for.
+function kiwmi:ws_broadcast(msg, options)
+end
+
+---Queues `msg` for a websocket client. Messages beyond its send queue limit are dropped.
+---With `coalesce`, a table with a string `kind` replaces a queued message of the same kind that wasn't sent yet,
+---which is then never sent, so only use it for state. Defaults to `true` for `kind = "layout_state"`, `false`
+---otherwise.
+---@param msg any
+---@param options? { coalesce?: boolean }
+---@return boolean sent Whether it was queued.
+function kiwmi:ws_send(client, msg, options)
+end
+
 ---@class kiwmi_cursor
 local cursor = {}
 
@@ -122,6 +159,12 @@ end
 --- The cursor got moved.
 --- Callback receives a table containing `oldx`, `oldy`, `newx`, and `newy`.
 ---
+--- #### motion_frame
+---
+--- The cursor got moved since the last `motion_frame`.
+--- Delivered at most once per output frame, or once per interval set with `cursor:set_motion_interval()`.
+--- Callback receives a table containing `oldx`, `oldy`, `newx`, `newy`, and `dx`, `dy` with the summed device deltas.
+---
 --- #### scroll
 ---
 --- Something was scrolled.
@@ -137,6 +180,11 @@ end
 function cursor:pos()
 end
 
+--- Sets how often `motion_frame` is delivered at most, in milliseconds.
+--- 0 (the default) delivers it once per output frame.
+function cursor:set_motion_interval(interval)
+end
+
 ---@return kiwmi_view view The view at the cursor position, or `nil` if there is none.
 function cursor:view_at_pos()
 end
@@ -144,6 +192,28 @@ end
 ---@class kiwmi_keyboard
 local keyboard = {}
 
+---Binds a key combination to a callback. The lookup happens in the compositor, so keys without a binding never reach
+---Lua. The modifiers must match exactly, apart from `caps` and `mod2` (num lock). The key is matched as translated by
+---the keymap first (e.g. `exclam` for shift+1), then as on the first level (`1`). The key press and its release are
+---not sent to the client. Pass nil as the callback to remove the binding.
+---A number binds a keycode instead, as in the `keycode` of key_down events. It is matched after the keysyms and stays on
+---the same physical key whatever the layout.
+---@param mods string[]|nil Modifier names as in keyboard:modifiers(), e.g. { "super", "shift" }.
+---@param key string|integer The xkb keysym name, e.g. "Return" or "q", or a keycode.
+---@param callback fun(keyboard: kiwmi_keyboard)|nil
+---@param options { mode: string }|nil The mode to bind in, "default" if not set.
+function keyboard:bind(mods, key, callback, options)
+end
+
+---Binds a sequence of key combinations, e.g. { "super+x", "c" }. After each step but the last one, the next key has to
+---be pressed before the chord timeout (see keyboard:set_chord_timeout()). Any other key cancels the chord and is not
+---sent to the client. Pass nil as the callback to remove the binding.
+---@param steps string[] Modifier names and a keysym name, joined by "+".
+---@param callback fun(keyboard: kiwmi_keyboard)|nil
+---@param options { mode: string }|nil The mode to bind in, "default" if not set.
+function keyboard:bind_chord(steps, callback, options)
+end
+
 --- The function takes a table as parameter.
 --- The possible table indexes are "rules, model, layout, variant, options".
 --- All the table parameters are optional and set to the system default if not set.
@@ -152,6 +222,11 @@ local keyboard = {}
 function keyboard:keymap(keymap)
 end
 
+---Returns the name of the current mode.
+---@return string
+function keyboard:mode()
+end
+
 --- Returns a table with the state of all modifiers.
 --- These are: `shift`, `caps`, `ctrl`, `alt`, `mod2`, `mod3`, `super`, and `mod5`.
 function keyboard:modifiers()
@@ -188,6 +263,25 @@ end
 function keyboard:on(event, callback)
 end
 
+---Sets how long a chord waits for its next key, 1000 ms by default.
+---@param ms integer
+function keyboard:set_chord_timeout(ms)
+end
+
+---Switches to another set of bindings. Switching to a mode without bindings leaves only the taps active.
+---@param mode string
+function keyboard:set_mode(mode)
+end
+
+---Tells whether a key is tapped or held on its own, while still sending it to the client. `hold` is called when the
+---key is held without pressing another key until the timeout (200 ms by default) and `release` when it's released
+---afterwards. `tap` is called when it's released before. Pressing another key in between calls neither. A timeout
+---of 0 calls `hold` right on the press and `release` on the release, and never `tap`. Pass nil to remove it.
+---@param key string The xkb keysym name, e.g. "Super_L".
+---@param callbacks { tap: fun(keyboard: kiwmi_keyboard)|nil, hold: fun(keyboard: kiwmi_keyboard)|nil, release: fun(keyboard: kiwmi_keyboard)|nil, timeout: integer|nil }|nil
+function keyboard:tap(key, callbacks)
+end
+
 ---Represents an output (most often a display).
 ---@class kiwmi_output
 local output = {}
@@ -346,6 +440,12 @@ end
 function view:title()
 end
 
+---Draw a border around the view, following its size and switching to
+---focused_color while it is focused. Pass nil or false to remove it.
+---@param options? { width?: integer, color: string, focused_color?: string } Colors in the format #rrggbb.
+function view:set_border(options)
+end
+
 ---Display a debug text for this view.
 ---@param text string The text to be displayed.
 function view:set_debug_text(text)
@@ -372,6 +472,14 @@ end
 function node:set_color(color)
 end
 
+---Sets the position, and the size if given (only valid for rects).
+---@param x number
+---@param y number
+---@param width? number
+---@param height? number
+function node:set_geometry(x, y, width, height)
+end
+
 ---@class scene_tree
 local tree = {}
 
@@ -380,6 +488,8 @@ local tree = {}
 function tree:add_rect(width, height, color)
 end
 
+---@param color string The color in the format #rrggbb.
+---@param options? { font?: string } e.g. { font = "sans 11" }
 ---@return scene_node node
-function tree:add_text(text, color)
+function tree:add_text(text, color, options)
 end